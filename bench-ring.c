@@ -0,0 +1,108 @@
+/*
+ * bench-ring.c - cross-vcpu spin latency benchmark
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ * vcpu 0 bounces a counter off vcpu 1, both waiting with pause loops.
+ * Run it under gaol with two vcpus pinned to isolated cpus, with and
+ * without --dedicated-cores, e.g.:
+ *
+ *   gaol --vcpus=2 --pin-vcpus=2,3 --dedicated-cores ./bench-ring
+ *
+ * and compare the round trip times here with the exits to kvm gaol
+ * reports for each vcpu.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "ioring.h"
+#include "ports.h"
+
+#define BENCH_ROUNDS 100000
+#define BENCH_WAIT 100000000ul
+
+/* each on its own cache line, so only the handoff itself bounces */
+static volatile uint64_t ping aligned(64);
+static volatile uint64_t pong aligned(64);
+static volatile uint32_t ready aligned(64);
+
+static inline uint64_t
+rdtsc(void)
+{
+        uint32_t lo, hi;
+
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
+
+static void
+stall(uint64_t n)
+{
+        for (uint64_t x = 0; x < n; x++)
+                __asm__("pause");
+}
+
+static void
+say(const char * const msg)
+{
+        while (ioring_write(msg, strlen(msg)) == -ENOSPC)
+                stall(1000);
+}
+
+void
+ap_main(unsigned int cpu, unsigned int ncpus unused)
+{
+        if (cpu == 1) {
+                ready = 1;
+                for (;;) {
+                        uint64_t val;
+
+                        while ((val = ping) == pong)
+                                __asm__("pause");
+                        pong = val;
+                }
+        }
+
+        for (;;)
+                __asm__("hlt");
+}
+
+int main(void)
+{
+        uint64_t best = UINT64_MAX, worst = 0, total = 0;
+        char msg[128];
+
+        for (uint64_t i = 0; !ready; i++) {
+                if (i == BENCH_WAIT) {
+                        say("bench-ring needs gaol --vcpus=2\n");
+                        guest_exit(1);
+                }
+                __asm__("pause");
+        }
+
+        for (uint64_t i = 1; i <= BENCH_ROUNDS; i++) {
+                uint64_t start, cycles;
+
+                start = rdtsc();
+                ping = i;
+                while (pong != i)
+                        __asm__("pause");
+                cycles = rdtsc() - start;
+
+                total += cycles;
+                if (cycles < best)
+                        best = cycles;
+                if (cycles > worst)
+                        worst = cycles;
+        }
+
+        snprintf(msg, sizeof(msg),
+                 "round trip: %u rounds, %lu min %lu avg %lu max cycles\n",
+                 BENCH_ROUNDS, best, total / BENCH_ROUNDS, worst);
+        say(msg);
+        guest_exit(0);
+}
+
+// vim:fenc=utf-8:tw=75:et
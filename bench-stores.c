@@ -0,0 +1,102 @@
+/*
+ * bench-stores.c - guest store bandwidth benchmark
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ * Run it under gaol with and without e.g. --mem-type=data:wt to see
+ * what the memory type costs.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "ioring.h"
+
+#define BENCH_SIZE (4ul << 20)
+#define BENCH_PASSES 32
+
+static uint8_t buf[BENCH_SIZE] aligned(4096);
+
+static inline uint64_t
+rdtsc(void)
+{
+        uint32_t lo, hi;
+
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
+
+static void
+stall(uint64_t n)
+{
+        for (uint64_t x = 0; x < n; x++)
+                __asm__("pause");
+}
+
+static void
+say(const char * const msg)
+{
+        while (ioring_write(msg, strlen(msg)) == -ENOSPC)
+                stall(1000);
+}
+
+static uint64_t
+bench_memset(void)
+{
+        uint64_t best = UINT64_MAX;
+
+        for (unsigned int i = 0; i < BENCH_PASSES; i++) {
+                uint64_t start, end;
+
+                start = rdtsc();
+                memset(buf, i, sizeof(buf));
+                __asm__ __volatile__("" : : : "memory");
+                end = rdtsc();
+                if (end - start < best)
+                        best = end - start;
+        }
+
+        return best;
+}
+
+static uint64_t
+bench_stores(void)
+{
+        volatile uint64_t *words = (volatile uint64_t *)buf;
+        uint64_t best = UINT64_MAX;
+
+        for (unsigned int i = 0; i < BENCH_PASSES; i++) {
+                uint64_t start, end;
+
+                start = rdtsc();
+                for (size_t j = 0; j < sizeof(buf) / sizeof(*words); j++)
+                        words[j] = j ^ i;
+                end = rdtsc();
+                if (end - start < best)
+                        best = end - start;
+        }
+
+        return best;
+}
+
+static void
+report(const char * const name, uint64_t cycles)
+{
+        char msg[128];
+
+        snprintf(msg, sizeof(msg),
+                 "%s: 0x%lx bytes in %lu cycles, %lu.%02lu bytes/cycle\n",
+                 name, BENCH_SIZE, cycles, BENCH_SIZE / cycles,
+                 (BENCH_SIZE * 100 / cycles) % 100);
+        say(msg);
+}
+
+int main(void)
+{
+        report("memset", bench_memset());
+        report("stores", bench_stores());
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -16,6 +16,7 @@
 #define nonnull(...) __attribute__((__nonnull__(__VA_ARGS__)))
 #define PRINTF(...) __attribute__((__format__(printf, __VA_ARGS__)))
 #define flatten __attribute__((__flatten__))
+#define noinline __attribute__((__noinline__))
 #define packed __attribute__((__packed__))
 #define aligned(x) __attribute__((__aligned__(x)))
 #define version(sym, ver) __asm__(".symver " # sym "," # ver)
@@ -0,0 +1,163 @@
+/*
+ * console.c - the guest's output console
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+static inline bool
+console_pending(struct console *con)
+{
+        return con->ring &&
+               __atomic_load_n(&con->ring->first, __ATOMIC_RELAXED) !=
+               __atomic_load_n(&con->ring->last, __ATOMIC_ACQUIRE);
+}
+
+static void
+copy_out(struct console *con)
+{
+        struct kvm_coalesced_mmio_ring *ring = con->ring;
+        uint8_t buf[4096];
+        size_t n = 0;
+        uint32_t first, last;
+
+        first = ring->first;
+        last = __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE);
+        while (first != last) {
+                struct kvm_coalesced_mmio *m = &ring->coalesced_mmio[first];
+                uint32_t len = m->len < sizeof(m->data) ? m->len
+                                                        : sizeof(m->data);
+
+                if (n + len > sizeof(buf)) {
+                        fwrite(buf, 1, n, stdout);
+                        n = 0;
+                }
+                memcpy(&buf[n], m->data, len);
+                n += len;
+
+                first = (first + 1) % con->ring_max;
+                __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE);
+        }
+
+        if (n) {
+                fwrite(buf, 1, n, stdout);
+                fflush(stdout);
+                con->bytes += n;
+        }
+        con->drains += 1;
+}
+
+/*
+ * Called after every KVM_RUN, so when there's nothing there this is one
+ * compare.  Any vcpu can get here, and one of them draining is enough.
+ */
+void hidden
+drain_console(struct context *ctx)
+{
+        struct console *con = &ctx->console;
+
+        if (!console_pending(con))
+                return;
+
+        if (pthread_mutex_trylock(&con->lock) != 0)
+                return;
+        copy_out(con);
+        pthread_mutex_unlock(&con->lock);
+}
+
+/*
+ * Either kvm can't coalesce port writes, or its ring is full.  Anything
+ * already in the ring was written before this byte, so it goes first.
+ */
+static int
+exit_console(struct vcpu *vcpu, void *data)
+{
+        struct console *con = data;
+        struct kvm_run *run = vcpu->run;
+        uint8_t *bytes = exit_io_data(vcpu);
+        size_t len = (size_t)run->io.size * run->io.count;
+
+        if (run->io.direction != KVM_EXIT_IO_OUT)
+                return EXIT_RESUME;
+
+        pthread_mutex_lock(&con->lock);
+        if (con->ring)
+                copy_out(con);
+        fwrite(bytes, 1, len, stdout);
+        fflush(stdout);
+        con->bytes += len;
+        con->exits += 1;
+        pthread_mutex_unlock(&con->lock);
+
+        return EXIT_RESUME;
+}
+
+int hidden
+init_console(struct context *ctx)
+{
+        struct console *con = &ctx->console;
+        struct kvm_coalesced_mmio_zone zone;
+        int offset;
+        int rc;
+
+        memset(con, 0, sizeof(*con));
+        pthread_mutex_init(&con->lock, NULL);
+
+        rc = register_pio_handler(ctx, GAOL_PORT_CONSOLE, 1, exit_console,
+                                  con);
+        if (rc < 0)
+                return -1;
+
+        offset = vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+        if (offset <= 0 ||
+            vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0 ||
+            (offset + 1) * PAGE_SIZE > (size_t)ctx->vcpu_mmap_size) {
+                printf("console: no coalesced pio, one exit per write\n");
+                return 0;
+        }
+
+        memset(&zone, 0, sizeof(zone));
+        zone.addr = GAOL_PORT_CONSOLE;
+        zone.size = 1;
+        zone.pio = 1;
+        rc = vm_ioctl(ctx, KVM_REGISTER_COALESCED_MMIO, &zone);
+        if (rc < 0) {
+                warn("Could not coalesce console port writes");
+                return 0;
+        }
+
+        /* it's one ring per vm, but it's in every vcpu's mmap */
+        con->ring = (void *)((uint8_t *)ctx->run + offset * PAGE_SIZE);
+        con->ring_max = KVM_COALESCED_MMIO_MAX;
+        con->coalesced = true;
+        printf("console: port 0x%x, coalesced in a %u entry ring\n",
+               GAOL_PORT_CONSOLE, con->ring_max);
+        return 0;
+}
+
+void hidden
+free_console(struct context *ctx)
+{
+        struct console *con = &ctx->console;
+
+        if (con->ring) {
+                pthread_mutex_lock(&con->lock);
+                copy_out(con);
+                pthread_mutex_unlock(&con->lock);
+        }
+
+        if (con->bytes || con->exits)
+                printf("console: %lu bytes, %lu drains, %lu exits\n",
+                       con->bytes, con->drains, con->exits);
+
+        con->ring = NULL;
+        pthread_mutex_destroy(&con->lock);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,37 @@
+/*
+ * console.h - the guest's output console
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct context;
+struct kvm_coalesced_mmio_ring;
+
+/*
+ * Bytes the guest writes to GAOL_PORT_CONSOLE.  When kvm can coalesce
+ * them, they land in its ring without an exit, and whichever vcpu exits
+ * next copies them out; otherwise each one is an exit of its own.
+ */
+struct console {
+        bool coalesced;
+        struct kvm_coalesced_mmio_ring *ring;
+        unsigned int ring_max;
+        pthread_mutex_t lock;
+
+        unsigned long bytes;
+        unsigned long drains;
+        unsigned long exits;
+};
+
+extern int init_console(struct context *ctx) hidden;
+extern void drain_console(struct context *ctx) hidden;
+extern void free_console(struct context *ctx) hidden;
+
+#endif /* !CONSOLE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -31,6 +31,19 @@ struct proc_map {
 
         bool user_pages;
         struct kvm_userspace_memory_region kumr;
+        struct shared_segment *shared;
+
+        /* backed by ctx->guest_memfd rather than our own pages */
+        bool memfd;
+        off_t memfd_offset;
+        size_t memfd_mapped;
+
+        /* came from page_pool_alloc(), and goes back there */
+        size_t pooled;
+
+        /* paging structures: a memslot, but not in the guest's va space */
+        bool page_tables;
+
         struct list_head list;
 };
 
@@ -42,8 +55,11 @@ struct symbol {
 };
 
 struct context {
+        vmid_t id;
         pid_t pid;
 
+        struct vm_options options;
+
         int kvm;
 
         int sev;
@@ -55,20 +71,83 @@ struct context {
         unsigned long vm_phys_base;
         struct kvm_clock_data vm_clock;
 
+        /* the boot vcpu's fd and kvm_run, as vcpus[0] */
         long vcpu;
         ssize_t vcpu_mmap_size;
         int vcpu_tsc_khz;
 
         struct kvm_run *run;
 
+        unsigned int nvcpus;
+        struct vcpu *vcpus;
+
+        /* what every vcpu's cpuid says, and the xsave state it has on */
+        struct kvm_cpuid2 *cpuid;
+        uint64_t xcr0;
+        /* each vcpu's TSC_AUX is its index, for rdtscp in the guest */
+        bool tsc_aux_ids;
+
+        /* --instances: one per vcpu, or none */
+        struct instance *instances;
+        unsigned int ninstances;
+
+        /* the in-kernel lapic and the irqfds that wake each vcpu */
+        struct irqchip irqchip;
+
+        /* what happens on each kind of vcpu exit */
+        struct exit_handlers exits;
+
+        /* where the guest's console output goes */
+        struct console console;
+
+        /* what the guest passed to guest_exit(), if it did */
+        int guest_status;
+        bool guest_exited;
+
+        /* run queue class and cpu accounting */
+        struct vm_sched sched;
+
         char *name;
         int argc;
         char **argv;
         void *phandle;
 
         struct proc_map *stack_map;
+        struct proc_map *heap_map;
         struct proc_map *page_table_map;
 
+        /* guest memslot bytes backed by shared vs. our own host pages */
+        size_t shared_bytes;
+        size_t private_bytes;
+
+        /* bytes we've handed to ksm, and whether prctl() did it all */
+        size_t ksm_bytes;
+        bool ksm_merge_any;
+
+        /* guest free page reporting */
+        struct free_page_reports *free_page_reports;
+        struct proc_map *free_page_reports_map;
+        unsigned long free_page_ranges;
+        unsigned long free_page_rejects;
+        size_t free_page_bytes;
+
+        /* the page the guest reads its time from */
+        struct guest_clock *guest_clock;
+        struct proc_map *guest_clock_map;
+        uint64_t guest_clock_updated_ns;
+        unsigned long guest_clock_refreshes;
+
+        /* memfd guest ram */
+        int guest_memfd;
+        size_t guest_memfd_size;
+
+        /* idle hibernation: since when the boot vcpu's been halted, or 0 */
+        uint64_t idle_since_ns;
+        struct hibernation *hibernation;
+        struct hibernate_stats hibernate_stats;
+        /* a page couldn't be put back; every vcpu has to stop */
+        bool restore_failed;
+
         list_t symbols;
         list_t host_maps;
         list_t guest_maps;
@@ -77,8 +156,16 @@ struct context {
         list_t page_tables;
         pml4e_t *pml4;
 
-        /* for our global vm context list */
-        list_t list;
+        /* the tables the guest actually runs on, and walks through them */
+        pml4e_t *guest_pml4;
+        struct guest_tlb tlb;
+
+        /* read-only tables from the cross-vm cache we hold a ref on */
+        int nshared_tables;
+        struct shared_table **shared_tables;
+        /* and the one memslot the whole shared pool is in here */
+        bool have_shared_pool_slot;
+        int shared_pool_slot;
 };
 
 static int unused
@@ -177,8 +264,31 @@ highest_guest_addr(struct context *ctx)
         return addr;
 }
 
+/*
+ * The tables the guest walks are in memslots like everything else, at
+ * vm_phys_base plus their host address, and that's what the entries
+ * above them (and cr3) hold.  Host code following one back down has to
+ * undo it.
+ */
+static inline uint64_t unused
+table_pfn(struct context *ctx, const void *table)
+{
+        return ptr64_to_pfn40(ctx->vm_phys_base + (uintptr_t)table);
+}
+
+static inline void * unused
+table_hva(struct context *ctx, uint64_t pfn)
+{
+        return (void *)(((pfn & PFN40_MASK) << PAGE_SHIFT) -
+                        ctx->vm_phys_base);
+}
+
 extern int private init_paging(struct context *ctx);
+extern int private add_page_table_memslot(struct context *ctx,
+                                          struct proc_map *map,
+                                          void *tables, size_t size);
 extern int private finalize_paging(struct context *ctx);
+extern void private put_shared_page_tables(struct context *ctx);
 extern int private init_segments(struct context *ctx);
 
 #endif /* !CONTEXT_H_ */
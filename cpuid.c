@@ -0,0 +1,330 @@
+/*
+ * cpuid.c - what the guest's cpu says it can do
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * Guests get everything KVM_GET_SUPPORTED_CPUID says we can give them,
+ * less whatever --hide-cpu-features asks for, and xsave turned on for
+ * every state component that's left, so their libc picks its AVX (or
+ * AVX-512) string functions.  A feature whose state isn't in xcr0 is
+ * hidden too, since using it would just fault.
+ */
+enum cpuid_reg {
+        EAX,
+        EBX,
+        ECX,
+        EDX,
+};
+
+struct cpu_feature {
+        const char *name;
+        uint32_t leaf;
+        uint32_t subleaf;
+        enum cpuid_reg reg;
+        int bit;
+        /* xcr0 bits it needs, and the ones hiding it takes away */
+        uint64_t needs;
+        uint64_t provides;
+};
+
+static const struct cpu_feature cpu_features[] = {
+        { "sse3", 1, 0, ECX, 0, 0, 0 },
+        { "ssse3", 1, 0, ECX, 9, 0, 0 },
+        { "fma", 1, 0, ECX, 12, XFEATURE_YMM, 0 },
+        { "sse4.1", 1, 0, ECX, 19, 0, 0 },
+        { "sse4.2", 1, 0, ECX, 20, 0, 0 },
+        { "popcnt", 1, 0, ECX, 23, 0, 0 },
+        { "aes", 1, 0, ECX, 25, 0, 0 },
+        { "xsave", 1, 0, ECX, 26, 0, GAOL_XCR0_MASK },
+        { "avx", 1, 0, ECX, 28, XFEATURE_YMM, XFEATURE_YMM },
+        { "f16c", 1, 0, ECX, 29, XFEATURE_YMM, 0 },
+        { "rdrand", 1, 0, ECX, 30, 0, 0 },
+        { "bmi1", 7, 0, EBX, 3, 0, 0 },
+        { "avx2", 7, 0, EBX, 5, XFEATURE_YMM, 0 },
+        { "bmi2", 7, 0, EBX, 8, 0, 0 },
+        { "erms", 7, 0, EBX, 9, 0, 0 },
+        { "avx512f", 7, 0, EBX, 16, XFEATURE_YMM | XFEATURE_AVX512,
+          XFEATURE_AVX512 },
+        { "avx512dq", 7, 0, EBX, 17, XFEATURE_YMM | XFEATURE_AVX512, 0 },
+        { "adx", 7, 0, EBX, 19, 0, 0 },
+        { "avx512cd", 7, 0, EBX, 28, XFEATURE_YMM | XFEATURE_AVX512, 0 },
+        { "sha", 7, 0, EBX, 29, 0, 0 },
+        { "avx512bw", 7, 0, EBX, 30, XFEATURE_YMM | XFEATURE_AVX512, 0 },
+        { "avx512vl", 7, 0, EBX, 31, XFEATURE_YMM | XFEATURE_AVX512, 0 },
+        { "rdtscp", 0x80000001, 0, EDX, 27, 0, 0 },
+};
+#define NR_CPU_FEATURES (sizeof(cpu_features) / sizeof(cpu_features[0]))
+
+/*
+ * A comma separated list of the names above, as a mask of their indices.
+ */
+int hidden
+parse_cpu_features(const char *arg, uint64_t *mask)
+{
+        *mask = 0;
+
+        while (*arg) {
+                size_t len = strcspn(arg, ",");
+                unsigned int i;
+
+                for (i = 0; i < NR_CPU_FEATURES; i++) {
+                        if (strlen(cpu_features[i].name) == len &&
+                            !strncmp(arg, cpu_features[i].name, len))
+                                break;
+                }
+                if (i == NR_CPU_FEATURES) {
+                        warnx("Unknown cpu feature \"%.*s\"", (int)len, arg);
+                        return -1;
+                }
+                *mask |= 1ul << i;
+
+                arg += len;
+                if (*arg == ',')
+                        arg++;
+        }
+
+        return 0;
+}
+
+static const struct cpu_feature *
+feature_named(const char *name)
+{
+        for (unsigned int i = 0; i < NR_CPU_FEATURES; i++)
+                if (!strcmp(cpu_features[i].name, name))
+                        return &cpu_features[i];
+        return NULL;
+}
+
+static struct kvm_cpuid_entry2 *
+find_leaf(struct kvm_cpuid2 *cpuid, uint32_t leaf, uint32_t subleaf)
+{
+        for (uint32_t i = 0; i < cpuid->nent; i++) {
+                struct kvm_cpuid_entry2 *e = &cpuid->entries[i];
+
+                if (e->function != leaf)
+                        continue;
+                if ((e->flags & KVM_CPUID_FLAG_SIGNIFCANT_INDEX) &&
+                    e->index != subleaf)
+                        continue;
+                return e;
+        }
+
+        return NULL;
+}
+
+static uint32_t *
+leaf_reg(struct kvm_cpuid_entry2 *e, enum cpuid_reg reg)
+{
+        switch (reg) {
+        case EAX:
+                return &e->eax;
+        case EBX:
+                return &e->ebx;
+        case ECX:
+                return &e->ecx;
+        case EDX:
+        default:
+                return &e->edx;
+        }
+}
+
+static bool
+has_feature(struct kvm_cpuid2 *cpuid, const struct cpu_feature *f)
+{
+        struct kvm_cpuid_entry2 *e = find_leaf(cpuid, f->leaf, f->subleaf);
+
+        return e && (*leaf_reg(e, f->reg) & (1u << f->bit));
+}
+
+static void
+clear_feature(struct kvm_cpuid2 *cpuid, const struct cpu_feature *f)
+{
+        struct kvm_cpuid_entry2 *e = find_leaf(cpuid, f->leaf, f->subleaf);
+
+        if (e)
+                *leaf_reg(e, f->reg) &= ~(1u << f->bit);
+}
+
+static struct kvm_cpuid2 *
+get_supported_cpuid(struct context *ctx)
+{
+        struct kvm_cpuid2 *cpuid = NULL;
+        uint32_t nent = 64;
+        int rc;
+
+        for (;;) {
+                struct kvm_cpuid2 *new;
+
+                new = realloc(cpuid, sizeof(*cpuid) +
+                                     nent * sizeof(cpuid->entries[0]));
+                if (!new) {
+                        warn("Could not allocate %u cpuid entries", nent);
+                        free(cpuid);
+                        return NULL;
+                }
+                cpuid = new;
+                memset(cpuid, 0, sizeof(*cpuid));
+                cpuid->nent = nent;
+
+                rc = kvm_ioctl(ctx, KVM_GET_SUPPORTED_CPUID, cpuid);
+                if (rc >= 0)
+                        return cpuid;
+                if (errno != E2BIG || nent >= 4096) {
+                        warn("KVM_GET_SUPPORTED_CPUID failed");
+                        free(cpuid);
+                        return NULL;
+                }
+                nent *= 2;
+        }
+}
+
+/*
+ * Each vcpu gets the same cpuid, except for where it says which apic it
+ * is.
+ */
+static void
+set_apic_id(struct kvm_cpuid2 *cpuid, unsigned int id)
+{
+        for (uint32_t i = 0; i < cpuid->nent; i++) {
+                struct kvm_cpuid_entry2 *e = &cpuid->entries[i];
+
+                if (e->function == 1)
+                        e->ebx = (e->ebx & 0x00fffffful) | (id << 24);
+                else if (e->function == 0xb || e->function == 0x1f)
+                        e->edx = id;
+        }
+}
+
+/*
+ * With rdtscp, TSC_AUX is how guest code finds out which vcpu it's on
+ * without a trap; the guest heap uses it to pick its per-cpu caches.
+ */
+static int
+set_tsc_aux(struct vcpu *vcpu, unsigned int id)
+{
+        struct {
+                struct kvm_msrs msrs;
+                struct kvm_msr_entry entries[1];
+        } msrs;
+
+        memset(&msrs, 0, sizeof(msrs));
+        msrs.msrs.nmsrs = 1;
+        msrs.entries[0].index = MSR_TSC_AUX;
+        msrs.entries[0].data = id;
+
+        return cpu_ioctl(vcpu, KVM_SET_MSRS, &msrs) == 1 ? 0 : -1;
+}
+
+int hidden
+init_cpuid(struct context *ctx)
+{
+        struct kvm_cpuid2 *cpuid;
+        struct kvm_cpuid_entry2 *xsave;
+        const struct cpu_feature *xsave_feature = feature_named("xsave");
+        uint64_t hide = ctx->options.cpuid_hide;
+        uint64_t xcr0 = 0;
+        bool tsc_aux_ids;
+        int rc;
+
+        cpuid = get_supported_cpuid(ctx);
+        if (!cpuid)
+                return -1;
+
+        xsave = find_leaf(cpuid, 0xd, 0);
+        if (xsave && has_feature(cpuid, xsave_feature))
+                xcr0 = (xsave->eax | ((uint64_t)xsave->edx << 32)) &
+                       GAOL_XCR0_MASK;
+
+        for (unsigned int i = 0; i < NR_CPU_FEATURES; i++)
+                if (hide & (1ul << i))
+                        xcr0 &= ~cpu_features[i].provides;
+        /*
+         * Anything else is an xcr0 that KVM_SET_XCRS refuses: the
+         * AVX-512 components come all together or not at all, and only
+         * on top of YMM, which needs SSE, which needs x87.  What's left
+         * out here takes the features that need it with it, below.
+         */
+        if ((xcr0 & XFEATURE_AVX512) != XFEATURE_AVX512 ||
+            !(xcr0 & XFEATURE_YMM))
+                xcr0 &= ~XFEATURE_AVX512;
+        if (!(xcr0 & XFEATURE_X87) || !(xcr0 & XFEATURE_SSE))
+                xcr0 = 0;
+
+        for (unsigned int i = 0; i < NR_CPU_FEATURES; i++) {
+                const struct cpu_feature *f = &cpu_features[i];
+
+                if ((hide & (1ul << i)) || (f->needs & ~xcr0))
+                        clear_feature(cpuid, f);
+        }
+        if (!xcr0)
+                clear_feature(cpuid, xsave_feature);
+
+        if (xsave) {
+                xsave->eax = xcr0 & 0xfffffffful;
+                xsave->edx = xcr0 >> 32;
+        }
+
+        tsc_aux_ids = has_feature(cpuid, feature_named("rdtscp"));
+
+        for (unsigned int i = 0; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                set_apic_id(cpuid, i);
+                rc = cpu_ioctl(vcpu, KVM_SET_CPUID2, cpuid);
+                if (rc < 0) {
+                        warn("Could not set vcpu %u cpuid", i);
+                        goto err;
+                }
+
+                if (xcr0) {
+                        struct kvm_xcrs xcrs;
+
+                        memset(&xcrs, 0, sizeof(xcrs));
+                        xcrs.nr_xcrs = 1;
+                        xcrs.xcrs[0].xcr = 0;
+                        xcrs.xcrs[0].value = xcr0;
+                        rc = cpu_ioctl(vcpu, KVM_SET_XCRS, &xcrs);
+                        if (rc < 0) {
+                                warn("Could not set vcpu %u xcr0", i);
+                                goto err;
+                        }
+                }
+
+                if (tsc_aux_ids && set_tsc_aux(vcpu, i) < 0) {
+                        printf("vcpu %u: could not set TSC_AUX\n", i);
+                        tsc_aux_ids = false;
+                }
+        }
+
+        printf("cpuid: %u leaves, xcr0 0x%lx:", cpuid->nent, xcr0);
+        for (unsigned int i = 0; i < NR_CPU_FEATURES; i++)
+                if (has_feature(cpuid, &cpu_features[i]))
+                        printf(" %s", cpu_features[i].name);
+        printf("\n");
+
+        ctx->cpuid = cpuid;
+        ctx->xcr0 = xcr0;
+        ctx->tsc_aux_ids = tsc_aux_ids;
+        return 0;
+err:
+        free(cpuid);
+        return -1;
+}
+
+void hidden
+free_cpuid(struct context *ctx)
+{
+        free(ctx->cpuid);
+        ctx->cpuid = NULL;
+}
+
+// vim:fenc=utf-8:tw=75:et
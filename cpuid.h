@@ -0,0 +1,37 @@
+/*
+ * cpuid.h - what the guest's cpu says it can do
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef CPUID_H_
+#define CPUID_H_
+
+#include <stdint.h>
+
+struct context;
+
+/* xsave state components, as xcr0 bits */
+#define XFEATURE_X87            (1ul << 0)
+#define XFEATURE_SSE            (1ul << 1)
+#define XFEATURE_YMM            (1ul << 2)
+#define XFEATURE_OPMASK         (1ul << 5)
+#define XFEATURE_ZMM_HI256      (1ul << 6)
+#define XFEATURE_HI16_ZMM       (1ul << 7)
+#define XFEATURE_AVX512         (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | \
+                                 XFEATURE_HI16_ZMM)
+
+/*
+ * The state we'll turn on for a guest, at most.  Everything else (MPX,
+ * PKRU, AMX, ...) needs more from us than setting a bit.
+ */
+#define GAOL_XCR0_MASK          (XFEATURE_X87 | XFEATURE_SSE | \
+                                 XFEATURE_YMM | XFEATURE_AVX512)
+
+#define MSR_TSC_AUX             0xc0000103
+
+extern int parse_cpu_features(const char *arg, uint64_t *mask) hidden;
+extern int init_cpuid(struct context *ctx) hidden;
+extern void free_cpuid(struct context *ctx) hidden;
+
+#endif /* !CPUID_H_ */
+// vim:fenc=utf-8:tw=75:et
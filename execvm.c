@@ -12,6 +12,7 @@
 #include <gelf.h>
 #include <inttypes.h>
 #include <link.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,10 +34,9 @@
 #define MEM_SIZE (PS_LIMIT * 0x2)
 
 #define SKIP_SEV
-static LIST_HEAD(contexts);
 
 static struct context *
-new_vm_ctx(void)
+new_vm_ctx(const struct vm_options *opts)
 {
         struct context *ctx;
 
@@ -44,45 +44,39 @@ new_vm_ctx(void)
         if (!ctx)
                 return NULL;
 
+        if (opts)
+                memcpy(&ctx->options, opts, sizeof(*opts));
+        else
+                init_vm_options(&ctx->options);
+
+        ctx->id = -1;
         ctx->pid = -1;
         ctx->kvm = -1;
         ctx->sev = -1;
 
         ctx->vm = -1;
-        ctx->vm_identity.userspace_addr = (uintptr_t)MAP_FAILED;
-        ctx->vm_tss.userspace_addr = (uintptr_t)MAP_FAILED;
 
         ctx->vcpu = -1;
         ctx->vcpu_mmap_size = -1;
 
         ctx->run = NULL;
 
+        ctx->guest_memfd = -1;
+
         INIT_LIST_HEAD(&ctx->host_maps);
         INIT_LIST_HEAD(&ctx->guest_maps);
         INIT_LIST_HEAD(&ctx->symbols);
         INIT_LIST_HEAD(&ctx->page_tables);
 
-        list_add(&ctx->list, &contexts);
+        if (vm_registry_add(ctx) < 0) {
+                warn("Could not register vm");
+                free(ctx);
+                return NULL;
+        }
 
         return ctx;
 }
 
-static unused struct context *
-get_ctx(pid_t pid)
-{
-        struct list_head *n, *pos;
-
-        errno = 0;
-        list_for_each_safe(pos, n, &contexts) {
-                struct context *ctx = list_entry(pos, struct context, list);
-                printf("%s(): found pid %d\n", __func__, ctx->pid);
-                if (ctx->pid == pid)
-                        return ctx;
-        }
-        errno = ESRCH;
-        return NULL;
-}
-
 static void
 free_maps(struct context *ctx, struct list_head *head)
 {
@@ -95,6 +89,16 @@ free_maps(struct context *ctx, struct list_head *head)
                         vm_ioctl(ctx, KVM_SET_USER_MEMORY_REGION, &map->kumr);
                 }
 
+                put_shared_segment(map->shared);
+                map->shared = NULL;
+
+                if (map->memfd)
+                        munmap((void *)map->kumr.userspace_addr,
+                               map->memfd_mapped);
+                else if (map->pooled)
+                        page_pool_free((void *)map->kumr.userspace_addr,
+                                       map->pooled);
+
                 list_del(&map->list);
                 if (map->name)
                         free(map->name);
@@ -531,6 +535,27 @@ get_symbol_guest_object(struct context *ctx, const char * const name)
         return guest_object;
 }
 
+/*
+ * Where a guest address's bytes actually live in our address space, which
+ * isn't the address itself once a region has been moved to guest ram.
+ */
+static void *
+guest_hva(struct context *ctx, uintptr_t gva)
+{
+        struct list_head *pos;
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+
+                if (!map->user_pages || gva < map->start || gva >= map->end)
+                        continue;
+
+                return (void *)(map->kumr.userspace_addr + gva - map->start);
+        }
+
+        return (void *)gva;
+}
+
 #if 0
 static int
 add_symbols(struct context *ctx)
@@ -579,25 +604,40 @@ destroy_vm(struct context *ctx)
         if (!ctx)
                 return;
 
-        list_del(&ctx->list);
-
-        if (ctx->vcpu >= 0) {
-                ctx->run->immediate_exit = 1;
-#if 0
-                /* this hangs the task in the error cases, and the guest
-                 * seems to go away correctly without it, so... */
-                printf("%d doing KVM_RUN\n", __LINE__);
-                vcpu_ioctl(ctx, KVM_RUN, 0);
-#endif
-                close(ctx->vcpu);
-        }
+        vm_registry_remove(ctx);
+
+        print_vm_memory_stats(ctx, "exit");
+        print_guest_tlb_stats(ctx);
+        ksm_print_stats(ctx);
+        print_hibernate_stats(ctx);
+        free_hibernation(ctx);
+        if (ctx->free_page_reports)
+                printf("free page reporting: %lu ranges, 0x%zx bytes released, %lu rejected\n",
+                       ctx->free_page_ranges, ctx->free_page_bytes,
+                       ctx->free_page_rejects);
+
+        free_console(ctx);
+        free_instances(ctx);
+        print_vcpu_stats(ctx);
+        print_vm_sched_stats(ctx);
+        destroy_vcpus(ctx);
+        free_irqchip(ctx);
+        free_cpuid(ctx);
+        free_exit_handlers(ctx);
+        free_vm_sched(ctx);
 
         free_symbols(ctx);
 
-        free((void *)ctx->stack_map->start);
+        free(ctx->free_page_reports);
+        free_guest_clock(ctx);
+
+        /* the page tables go with the maps */
+        ctx->guest_pml4 = NULL;
+        guest_tlb_flush(ctx);
 
         free_maps(ctx, &ctx->host_maps);
         free_maps(ctx, &ctx->guest_maps);
+        guest_ram_free(ctx);
 
         struct list_head *n, *this;
         list_for_each_safe(this, n, &ctx->page_tables) {
@@ -607,15 +647,11 @@ destroy_vm(struct context *ctx)
                 list_del(&pti->list);
                 free(pti);
         }
+        put_shared_page_tables(ctx);
 
         if (ctx->vm >= 0)
                 close(ctx->vm);
 
-        if (ctx->run) {
-                munmap(ctx->run, ctx->vcpu_mmap_size);
-                ctx->run = NULL;
-        }
-
         if (ctx->sev >= 0) {
                 close(ctx->sev);
                 ctx->sev = -1;
@@ -628,18 +664,34 @@ destroy_vm(struct context *ctx)
 
         ctx->vcpu_mmap_size = -1;
 
-        if (ctx->vm_tss.userspace_addr != (uintptr_t)MAP_FAILED)
-                munmap((void *)ctx->vm_tss.userspace_addr, PAGE_SIZE * 3);
-
-        if (ctx->vm_identity.userspace_addr != (uintptr_t)MAP_FAILED)
-                munmap((void *)ctx->vm_identity.userspace_addr, PAGE_SIZE);
-
         if (ctx->phandle)
                 dlclose(ctx->phandle);
 
         free(ctx);
 }
 
+/*
+ * Copy a writable region into guest ram and back its memslot from there
+ * instead of from the pages the loader gave us.
+ */
+static int
+move_to_guest_ram(struct context *ctx, struct proc_map *map)
+{
+        size_t size = map->end - map->start;
+        void *addr;
+
+        addr = guest_ram_alloc(ctx, size, &map->memfd_offset,
+                               &map->memfd_mapped);
+        if (!addr)
+                return -1;
+
+        memcpy(addr, (void *)map->start, size);
+        map->memfd = true;
+        map->kumr.userspace_addr = (uintptr_t)addr;
+
+        return 0;
+}
+
 static int
 pick_and_place_dsos(struct context *ctx)
 {
@@ -677,6 +729,24 @@ pick_and_place_dsos(struct context *ctx)
                 map->kumr.memory_size = map->end - map->start;
                 map->kumr.userspace_addr = map->start;
 
+                if (ctx->options.share_dsos && can_share_map(map)) {
+                        map->shared = get_shared_segment(map);
+                        if (map->shared)
+                                map->kumr.userspace_addr =
+                                        (uintptr_t)map->shared->addr;
+                }
+
+                if (ctx->options.memfd && (map->mode & M_W_OK)) {
+                        rc = move_to_guest_ram(ctx, map);
+                        if (rc < 0) {
+                                map->kumr.slot = -1;
+                                map->kumr.memory_size = 0;
+                                warnx("Could not move %s to guest ram",
+                                      map->name);
+                                goto err;
+                        }
+                }
+
                 printf("  -> as phys:%p-%p gaol:%p-%p\n",
                        (void *)map->kumr.guest_phys_addr,
                        (void *)map->kumr.guest_phys_addr+map->kumr.memory_size,
@@ -691,9 +761,31 @@ pick_and_place_dsos(struct context *ctx)
                         map->kumr.guest_phys_addr = 0;
                         map->kumr.memory_size = 0;
                         map->kumr.userspace_addr = 0;
+                        put_shared_segment(map->shared);
+                        map->shared = NULL;
                         warn("KVM_SET_USER_MEMORY_REGION failed");
                         goto err;
                 }
+
+                if (map->shared)
+                        ctx->shared_bytes += map->kumr.memory_size;
+                else
+                        ctx->private_bytes += map->kumr.memory_size;
+
+                if (map->mode & M_W_OK)
+                        ksm_mark_mergeable(ctx, map->kumr.userspace_addr,
+                                           map->kumr.memory_size);
+        }
+
+        if (ctx->options.share_dsos) {
+                struct share_stats stats;
+
+                get_share_stats(&stats);
+                printf("memslots: 0x%zx bytes shared 0x%zx bytes private\n",
+                       ctx->shared_bytes, ctx->private_bytes);
+                printf("shared segments: %d using 0x%zx bytes for 0x%zx bytes of memslots\n",
+                       stats.nsegments, stats.segment_bytes,
+                       stats.mapped_bytes);
         }
 
         rc = 0;
@@ -730,10 +822,20 @@ err:
 #endif
 }
 
+/*
+ * KVM allocates the pages behind the identity map and the TSS itself; all
+ * it wants from us is a gpa range the vm doesn't use for anything else.
+ * Every memslot we make is at vm_phys_base plus a host address, so the
+ * four pages just below vm_phys_base are always free, in every vm, and
+ * there's nothing of ours in the host to map for them.
+ */
+#define VM_PHYS_BASE 0xfffc0000ul
+#define VM_IDENTITY_GPA(base) ((base) - PAGE_SIZE * 4)
+#define VM_TSS_GPA(base) ((base) - PAGE_SIZE * 3)
+
 static struct context *
-set_up_vm(void)
+set_up_vm(const struct vm_options *opts)
 {
-        unsigned long cpuid = 0;
         struct context *ctx;
         int rc;
 
@@ -742,7 +844,7 @@ set_up_vm(void)
         setlinebuf(stdout);
         setlinebuf(stderr);
 
-        ctx = new_vm_ctx();
+        ctx = new_vm_ctx(opts);
         if (ctx == NULL)
                 return NULL;
 
@@ -758,74 +860,77 @@ set_up_vm(void)
                 goto err;
         }
 
+        ksm_enable(ctx);
+
+        rc = guest_ram_init(ctx);
+        if (rc < 0)
+                goto err;
+
+        ctx->vm_phys_base = VM_PHYS_BASE;
+
         /* PJFIX: check capabilities */
-        ctx->vm_identity.slot = ctx->kumr_slot++;
-        ctx->vm_identity.flags = 0;
-        ctx->vm_identity.guest_phys_addr = 0xfffbc000;
+        ctx->vm_identity.slot = -1;
+        ctx->vm_identity.guest_phys_addr = VM_IDENTITY_GPA(ctx->vm_phys_base);
         ctx->vm_identity.memory_size = PAGE_SIZE;
-        ctx->vm_identity.userspace_addr =
-                (uintptr_t)mmap((void *)0xfffbc000ul, PAGE_SIZE, PROT_READ|PROT_WRITE,
-                                MAP_FIXED|MAP_SHARED|MAP_ANONYMOUS, -1, 0);
         printf("vm_identity.guest_phys_addr: 0x%016llx\n", ctx->vm_identity.guest_phys_addr);
-        printf("vm_identity.userspace_addr: 0x%016llx\n", ctx->vm_identity.userspace_addr);
-        if (!ctx->vm_identity.userspace_addr) {
-                warn("Couldn't get identity map");
-                goto err;
-        }
 
-        rc = vm_ioctl(ctx, KVM_SET_IDENTITY_MAP_ADDR, &ctx->vm_identity.userspace_addr);
+        rc = vm_ioctl(ctx, KVM_SET_IDENTITY_MAP_ADDR, &ctx->vm_identity.guest_phys_addr);
         if (rc < 0) {
                 warn("Could not set vm identity map address");
                 goto err;
         }
 
         /* PJFIX: check capabilities */
-        ctx->vm_tss.slot = ctx->kumr_slot++;
-        ctx->vm_tss.flags = 0;
-        ctx->vm_tss.guest_phys_addr = 0xfffbd000;
+        ctx->vm_tss.slot = -1;
+        ctx->vm_tss.guest_phys_addr = VM_TSS_GPA(ctx->vm_phys_base);
         ctx->vm_tss.memory_size = PAGE_SIZE * 3;
-        ctx->vm_tss.userspace_addr =
-                (uintptr_t)mmap((void *)0xfffbd000ul, PAGE_SIZE * 3, PROT_READ|PROT_WRITE,
-                                MAP_FIXED|MAP_SHARED|MAP_ANONYMOUS, -1, 0);
         printf("vm_tss.guest_phys_addr: 0x%016llx\n", ctx->vm_tss.guest_phys_addr);
-        printf("vm_tss.userspace_addr: 0x%016llx\n", ctx->vm_tss.userspace_addr);
-        if (!ctx->vm_tss.userspace_addr) {
-                warn("Couldn't get identity map");
-                goto err;
-        }
 
-        rc = vm_ioctl(ctx, KVM_SET_TSS_ADDR, ctx->vm_tss.userspace_addr);
+        rc = vm_ioctl(ctx, KVM_SET_TSS_ADDR, ctx->vm_tss.guest_phys_addr);
         if (rc < 0) {
                 warn("Could not set vm tss address");
                 goto err;
         }
 
-        ctx->vm_phys_base = 0xfffc0000;
+        rc = configure_halt_poll(ctx);
+        if (rc < 0)
+                goto err;
 
-        ctx->vcpu = vm_ioctl(ctx, KVM_CREATE_VCPU, cpuid);
-        if (ctx->vcpu < 0) {
-                warn("Could not make vcpu");
+        rc = enable_dedicated_cores(ctx);
+        if (rc < 0)
+                goto err;
+
+        init_vm_sched(ctx);
+
+        rc = create_irqchip(ctx);
+        if (rc < 0)
                 goto err;
-        }
 
-        ctx->vcpu_mmap_size = kvm_ioctl(ctx, KVM_GET_VCPU_MMAP_SIZE, 0);
-        if (ctx->vcpu_mmap_size < 0) {
-                warn("Could not get vcpu mmap size");
+        rc = create_vcpus(ctx, ctx->options.nvcpus);
+        if (rc < 0)
                 goto err;
-        }
 
-        ctx->run = mmap(NULL, ctx->vcpu_mmap_size, PROT_READ|PROT_WRITE,
-                        MAP_PRIVATE, ctx->vcpu, 0);
-        if (ctx->run == MAP_FAILED) {
-                warn("Could not map vcpu runtime controls");
+        rc = init_cpuid(ctx);
+        if (rc < 0)
+                goto err;
+
+        rc = init_irq_routes(ctx);
+        if (rc < 0)
+                goto err;
+
+        rc = init_exit_handlers(ctx);
+        if (rc < 0)
+                goto err;
+
+        rc = init_console(ctx);
+        if (rc < 0)
                 goto err;
-        }
 
         ctx->vcpu_tsc_khz = vcpu_ioctl(ctx, KVM_GET_TSC_KHZ, 0);
         if (ctx->vcpu_tsc_khz < 0)
                 warn("KVM_GET_TSC_KHZ failed?");
 
-        printf("vcpu: %ld at %dkHZ\n", ctx->vcpu, ctx->vcpu_tsc_khz);
+        printf("vcpus: %u at %dkHZ\n", ctx->nvcpus, ctx->vcpu_tsc_khz);
 
         rc = vm_ioctl(ctx, KVM_GET_CLOCK, &ctx->vm_clock);
         if (rc < 0)
@@ -839,6 +944,105 @@ err:
         return NULL;
 }
 
+/*
+ * Give the guest a region of our own memory, at the same address it has
+ * in the host.
+ */
+static struct proc_map *
+add_guest_region(struct context *ctx, const char * const name,
+                 void *addr, size_t size, int mode)
+{
+        struct proc_map *map;
+        int rc;
+
+        map = calloc(1, sizeof(*map));
+        if (!map) {
+                warn("Could not allocate guest map entry");
+                return NULL;
+        }
+
+        map->name = strdup(name);
+        if (!map->name) {
+                warn("Could not allocate guest map name");
+                free(map);
+                return NULL;
+        }
+
+        INIT_LIST_HEAD(&map->list);
+        map->start = (uintptr_t)addr;
+        map->end = map->start + size;
+        map->mode = mode;
+
+        map->user_pages = true;
+        map->kumr.slot = ctx->kumr_slot++;
+        map->kumr.flags = (mode & M_W_OK) ? 0 : KVM_MEM_READONLY;
+        map->kumr.guest_phys_addr = ctx->vm_phys_base + map->start;
+        map->kumr.memory_size = size;
+        map->kumr.userspace_addr = (uintptr_t)addr;
+
+        printf("  -> %s as phys:%p-%p gaol:%p-%p\n", name,
+               (void *)map->kumr.guest_phys_addr,
+               (void *)map->kumr.guest_phys_addr + map->kumr.memory_size,
+               (void *)map->kumr.userspace_addr,
+               (void *)map->kumr.userspace_addr + map->kumr.memory_size);
+        fflush(stdout);
+
+        rc = vm_ioctl(ctx, KVM_SET_USER_MEMORY_REGION, &map->kumr);
+        if (rc < 0) {
+                warn("KVM_SET_USER_MEMORY_REGION failed");
+                free(map->name);
+                free(map);
+                return NULL;
+        }
+
+        list_add(&map->list, &ctx->guest_maps);
+        ctx->private_bytes += size;
+        return map;
+}
+
+/*
+ * Allocate size bytes of zeroed memory, from the memfd if we're using
+ * one and the page pool otherwise, and give it to the guest.
+ */
+hidden struct proc_map *
+add_guest_ram(struct context *ctx, const char * const name, size_t size,
+              int mode)
+{
+        struct proc_map *map;
+        off_t offset = 0;
+        size_t mapped = 0;
+        void *addr;
+
+        if (ctx->options.memfd)
+                addr = guest_ram_alloc(ctx, size, &offset, &mapped);
+        else
+                addr = page_pool_alloc(size);
+        if (!addr) {
+                warn("Could not allocate %s", name);
+                return NULL;
+        }
+        ksm_mark_mergeable(ctx, (uintptr_t)addr, size);
+
+        map = add_guest_region(ctx, name, addr, size, mode);
+        if (!map) {
+                if (ctx->options.memfd)
+                        munmap(addr, mapped);
+                else
+                        page_pool_free(addr, size);
+                return NULL;
+        }
+
+        if (ctx->options.memfd) {
+                map->memfd = true;
+                map->memfd_offset = offset;
+                map->memfd_mapped = mapped;
+        } else {
+                map->pooled = size;
+        }
+
+        return map;
+}
+
 /*
  * We know none of the addresses *outside* of the link map we've
  * mirrored are in use in the vm, and ASLR has already happened for
@@ -851,17 +1055,10 @@ init_stack(struct context *ctx)
         struct list_head *this;
         struct proc_map *guest_map, *host_map = NULL;
         uintptr_t addr;
-        void *stack;
         size_t size;
 
         addr = (uintptr_t)&addr;
 
-        guest_map = calloc(1, sizeof(*guest_map));
-        if (!guest_map) {
-                warn("Could not allocate guest stack map entry");
-                return -1;
-        }
-
         list_for_each(this, &ctx->host_maps) {
                 host_map = list_entry(this, struct proc_map, list);
                 if (host_map->start <= addr && host_map->end >= addr)
@@ -871,50 +1068,275 @@ init_stack(struct context *ctx)
 
         if (host_map == NULL) {
                 warnx("Could not find host stack map?!?!");
-                free(guest_map);
                 return -1;
         }
 
         size = ALIGN_UP(host_map->end - host_map->start, PAGE_SIZE);
-        stack = calloc(1, size);
-        if (!stack) {
-                warn("Could not allocate guest stack");
+        guest_map = add_guest_ram(ctx, host_map->name, size, host_map->mode);
+        if (!guest_map) {
+                warnx("Could not allocate guest stack");
                 return -1;
         }
 
-        memmove(guest_map, host_map, sizeof(*guest_map));
-        INIT_LIST_HEAD(&guest_map->list);
-        guest_map->start = (uintptr_t)stack;
-        guest_map->end = guest_map->start + size;
+        ctx->stack_map = guest_map;
+        ctx->vcpus[0].stack_map = guest_map;
+        return 0;
+}
+
+/*
+ * Every other vcpu gets a stack the same size as the boot one's, from
+ * wherever the rest of the guest's writable memory comes from.
+ */
+static int
+init_ap_stacks(struct context *ctx)
+{
+        size_t size = ctx->stack_map->end - ctx->stack_map->start;
+
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct proc_map *map;
+                char name[32];
+
+                snprintf(name, sizeof(name), "[stack:%u]", i);
+                map = add_guest_ram(ctx, name, size, M_R_OK|M_W_OK|M_P_OK);
+                if (!map) {
+                        warnx("Could not allocate vcpu %u stack", i);
+                        return -1;
+                }
+                ctx->vcpus[i].stack_map = map;
+        }
+
+        return 0;
+}
+
+/*
+ * The guest can't grow its heap with brk() or mmap(), so if it links
+ * the heap allocator, reserve it one up front and say where it is.
+ */
+static int
+init_guest_heap(struct context *ctx)
+{
+        struct guest_heap *heap;
+        struct proc_map *map;
+        size_t size;
+
+        if (!ctx->options.heap_size)
+                return 0;
+
+        heap = get_symbol_object(ctx, "guest_heap__");
+        if (!heap) {
+                printf("guest does not use the gaol heap\n");
+                return 0;
+        }
+        heap = guest_hva(ctx, (uintptr_t)heap);
 
-        guest_map->name = strdup(guest_map->name);
-        if (!guest_map->name) {
-                free(guest_map);
-                free(stack);
+        size = PAGE_ALIGN_UP(ctx->options.heap_size);
+        map = add_guest_ram(ctx, "[heap]", size, M_R_OK|M_W_OK|M_P_OK);
+        if (!map) {
+                warnx("Could not allocate guest heap");
                 return -1;
         }
 
-        guest_map->user_pages = true;
-        guest_map->kumr.slot = ctx->kumr_slot++;
-        guest_map->kumr.flags = 0;
-        guest_map->kumr.guest_phys_addr = ctx->vm_phys_base + guest_map->start;
-        guest_map->kumr.memory_size = size;
-        guest_map->kumr.userspace_addr = (uintptr_t)stack;
-
-        printf("  -> [stack] as phys:%p-%p gaol:%p-%p\n",
-               (void *)guest_map->kumr.guest_phys_addr,
-               (void *)guest_map->kumr.guest_phys_addr
-                     + guest_map->kumr.memory_size,
-               (void *)guest_map->kumr.userspace_addr,
-               (void *)guest_map->kumr.userspace_addr
-                     + guest_map->kumr.memory_size);
-        fflush(stdout);
+        heap->base = map->start;
+        heap->size = size;
+        heap->flags = ctx->tsc_aux_ids ? GUEST_HEAP_CPU_IDS : 0;
+        __atomic_store_n(&heap->version, GUEST_HEAP_VERSION,
+                         __ATOMIC_RELEASE);
 
-        list_add(&guest_map->list, &ctx->guest_maps);
-        ctx->stack_map = guest_map;
+        ctx->heap_map = map;
         return 0;
 }
 
+/*
+ * If the vm has an in-kernel lapic and the guest links the interrupt
+ * code, tell it it can sleep in HLT and what its lapic timer counts in.
+ */
+static int
+init_guest_irqs(struct context *ctx)
+{
+        struct guest_irqs *irqs;
+
+        if (!ctx->irqchip.enabled)
+                return 0;
+
+        irqs = get_symbol_object(ctx, "guest_irqs__");
+        if (!irqs) {
+                printf("guest does not take interrupts\n");
+                return 0;
+        }
+        irqs = guest_hva(ctx, (uintptr_t)irqs);
+
+        /* kvm's lapic timer counts at its bus clock, 1GHz */
+        irqs->lapic_timer_khz = 1000000;
+        __atomic_store_n(&irqs->version, GUEST_IRQS_VERSION,
+                         __ATOMIC_RELEASE);
+        return 0;
+}
+
+static int
+init_guest_clock(struct context *ctx)
+{
+        struct guest_clock **guest_gc;
+        struct guest_clock *gc;
+        struct proc_map *map;
+
+        guest_gc = get_symbol_object(ctx, "guest_clock__");
+        if (!guest_gc) {
+                printf("guest does not read the clock page\n");
+                return 0;
+        }
+        guest_gc = guest_hva(ctx, (uintptr_t)guest_gc);
+
+        if (ctx->vcpu_tsc_khz <= 0) {
+                printf("no tsc frequency, so no guest clock page\n");
+                return 0;
+        }
+
+        if (posix_memalign((void **)&gc, PAGE_SIZE, sizeof(*gc)) != 0) {
+                warn("Could not allocate guest clock page");
+                return -1;
+        }
+        memset(gc, 0, sizeof(*gc));
+
+        map = add_guest_region(ctx, "[guest-clock]", gc, sizeof(*gc),
+                               M_R_OK|M_P_OK);
+        if (!map) {
+                free(gc);
+                return -1;
+        }
+
+        if (start_guest_clock(ctx, gc) < 0)
+                return -1;
+
+        ctx->guest_clock_map = map;
+        *guest_gc = gc;
+        return 0;
+}
+
+static int
+init_free_page_reports(struct context *ctx)
+{
+        struct free_page_reports **guest_fpr;
+        struct free_page_reports *fpr;
+        struct proc_map *map;
+
+        if (!ctx->options.free_page_min_chunk)
+                return 0;
+
+        guest_fpr = get_symbol_object(ctx, "free_page_reports__");
+        if (!guest_fpr) {
+                printf("guest does not report free pages\n");
+                return 0;
+        }
+        guest_fpr = guest_hva(ctx, (uintptr_t)guest_fpr);
+
+        if (posix_memalign((void **)&fpr, PAGE_SIZE, sizeof(*fpr)) != 0) {
+                warn("Could not allocate free page report channel");
+                return -1;
+        }
+        memset(fpr, 0, sizeof(*fpr));
+        fpr->version = FREE_PAGE_REPORTS_VERSION;
+        fpr->min_chunk = PAGE_ALIGN_UP(ctx->options.free_page_min_chunk);
+
+        map = add_guest_region(ctx, "[free-page-reports]", fpr,
+                               sizeof(*fpr), M_R_OK|M_W_OK|M_P_OK);
+        if (!map) {
+                free(fpr);
+                return -1;
+        }
+
+        ctx->free_page_reports = fpr;
+        ctx->free_page_reports_map = map;
+        *guest_fpr = fpr;
+        return 0;
+}
+
+/*
+ * Give back the host pages behind one range the guest says it's done
+ * with.  Whatever the guest touches there next is demand-zero.
+ */
+static int
+release_guest_range(struct context *ctx, uint64_t addr, uint64_t size)
+{
+        struct list_head *pos;
+
+        if (size < ctx->free_page_reports->min_chunk ||
+            addr + size < addr ||
+            (addr | size) & PAGE_MASK)
+                goto reject;
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+                void *hva;
+                int rc;
+
+                if (addr < map->start || addr + size > map->end)
+                        continue;
+
+                if (!map->user_pages || !(map->mode & M_W_OK) ||
+                    map->shared || map == ctx->free_page_reports_map)
+                        goto reject;
+
+                hva = (void *)(map->kumr.userspace_addr + addr - map->start);
+
+                /*
+                 * MADV_DONTNEED on a private file mapping would bring
+                 * back the file's contents rather than zeroes, so those
+                 * get replaced with anonymous memory instead, and guest
+                 * ram is shared memory, so it needs a hole punched.
+                 */
+                if (map->memfd) {
+                        rc = madvise(hva, size, MADV_REMOVE);
+                } else if (map->ino) {
+                        void *new;
+
+                        new = mmap(hva, size, PROT_READ|PROT_WRITE,
+                                   MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS,
+                                   -1, 0);
+                        rc = new == MAP_FAILED ? -1 : 0;
+                } else {
+                        rc = madvise(hva, size,
+                                     ctx->options.free_page_advice);
+                }
+                if (rc < 0) {
+                        warn("Could not release guest pages at %p", hva);
+                        goto reject;
+                }
+                ksm_mark_mergeable(ctx, (uintptr_t)hva, size);
+
+                ctx->free_page_ranges += 1;
+                ctx->free_page_bytes += size;
+                return 0;
+        }
+
+reject:
+        ctx->free_page_rejects += 1;
+        return -1;
+}
+
+static void
+release_free_pages(struct context *ctx)
+{
+        struct free_page_reports *fpr = ctx->free_page_reports;
+        uint32_t head, tail;
+
+        if (!fpr)
+                return;
+
+        head = __atomic_load_n(&fpr->head, __ATOMIC_ACQUIRE);
+        tail = fpr->tail;
+        if (head - tail > FREE_PAGE_REPORTS_ENTRIES)
+                tail = head - FREE_PAGE_REPORTS_ENTRIES;
+
+        while (tail != head) {
+                struct free_page_range range;
+
+                range = fpr->ranges[tail & FREE_PAGE_REPORTS_MASK];
+                tail += 1;
+                release_guest_range(ctx, range.addr, range.size);
+        }
+        __atomic_store_n(&fpr->tail, tail, __ATOMIC_RELEASE);
+}
+
 typedef union {
         struct {
                 /*
@@ -938,14 +1360,155 @@ typedef union {
         uint8_t arena[PAGE_SIZE * 1024];
 } arena_t;
 
+/*
+ * One trip into the guest and back, and whatever the exit needs.  Only
+ * the boot vcpu looks after the vm as a whole (hibernation, free page
+ * reports); the rest just run.  A handled exit goes straight back into
+ * the guest, so nothing here may sleep or talk.
+ *
+ * The caller owns running_vcpu and immediate_exit: a kick that comes
+ * while we're out of KVM_RUN has to make the next one return at once,
+ * so they stay set across calls and the caller decides when a kick has
+ * been dealt with.
+ *
+ * Returns EXIT_RESUME, EXIT_STOP, EXIT_PARK, or -1.
+ */
+int hidden
+run_vcpu_once(struct vcpu *vcpu)
+{
+        struct context *ctx = vcpu->ctx;
+        bool boot = vcpu->id == 0;
+        uint64_t t0, t1;
+        int rc;
+
+        if (boot) {
+                rc = restore_vm(ctx);
+                if (rc < 0) {
+                        warnx("Could not restore hibernated vm");
+                        return -1;
+                }
+        } else if (__atomic_load_n(&ctx->restore_failed, __ATOMIC_ACQUIRE)) {
+                return -1;
+        }
+
+        rc = flush_vcpu_regs(vcpu);
+        if (rc < 0)
+                return -1;
+
+        t0 = monotonic_ns();
+        vcpu->run_thread = pthread_self();
+        __atomic_store_n(&vcpu->in_run, true, __ATOMIC_RELEASE);
+        rc = cpu_ioctl(vcpu, KVM_RUN, 0);
+        __atomic_store_n(&vcpu->in_run, false, __ATOMIC_RELEASE);
+        t1 = monotonic_ns();
+        invalidate_vcpu_regs(vcpu);
+        vcpu->stats.runs += 1;
+        vcpu->stats.run_ns += t1 - t0;
+        __atomic_add_fetch(&ctx->sched.cpu_ns, t1 - t0, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&ctx->restore_failed, __ATOMIC_ACQUIRE)) {
+                warnx("vcpu %u stopped: guest memory was lost", vcpu->id);
+                return -1;
+        }
+        if (rc < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                        return EXIT_RESUME;
+                warn("vcpu %u KVM_RUN failed", vcpu->id);
+                return -1;
+        }
+
+        drain_console(ctx);
+        if (boot) {
+                release_free_pages(ctx);
+                refresh_guest_clock(ctx, t1);
+        }
+
+        return dispatch_exit(vcpu);
+}
+
+/*
+ * A halted vcpu with the in-kernel lapic doesn't come back out of KVM_RUN
+ * on its own, so for the boot vcpu to notice it's idle (see
+ * check_vcpu_idle()), something has to knock it out every so often.
+ * Twice per --hibernate-after period means it hibernates within one and
+ * a half of them.
+ */
+static bool
+start_idle_timer(struct vcpu *vcpu, timer_t *timer)
+{
+        struct context *ctx = vcpu->ctx;
+        uint64_t period = ctx->options.hibernate_idle_ms * 1000000ul / 2;
+        struct itimerspec its;
+        struct sigevent sev;
+
+        if (vcpu->id != 0 || !period || !ctx->irqchip.enabled)
+                return false;
+
+        init_vcpu_kick();
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = VCPU_KICK_SIGNAL;
+        sev._sigev_un._tid = gettid();
+        if (timer_create(CLOCK_MONOTONIC, &sev, timer) < 0) {
+                warn("Could not create the idle timer, vm won't hibernate");
+                return false;
+        }
+
+        its.it_value.tv_sec = period / 1000000000ul;
+        its.it_value.tv_nsec = period % 1000000000ul;
+        its.it_interval = its.it_value;
+        timer_settime(*timer, 0, &its, NULL);
+        return true;
+}
+
+/*
+ * Run one vcpu on this thread until a handler stops it or we're asked to.
+ */
+int hidden
+run_vcpu(struct vcpu *vcpu)
+{
+        timer_t idle_timer;
+        bool have_idle_timer;
+        int rc = 0;
+
+        set_vcpu_thread_policy(vcpu);
+        set_running_vcpu(vcpu);
+        have_idle_timer = start_idle_timer(vcpu, &idle_timer);
+
+        while (!__atomic_load_n(&vcpu->stop, __ATOMIC_ACQUIRE)) {
+                rc = run_vcpu_once(vcpu);
+                if (rc == EXIT_PARK) {
+                        wait_for_wake(vcpu);
+                        rc = 0;
+                        continue;
+                }
+                if (rc != EXIT_RESUME) {
+                        if (rc > 0)
+                                rc = 0;
+                        break;
+                }
+
+                /* stopping is checked above, so the kick's been seen */
+                if (vcpu->run->exit_reason == KVM_EXIT_INTR)
+                        vcpu->run->immediate_exit = 0;
+                check_vcpu_idle(vcpu);
+        }
+
+        if (have_idle_timer)
+                timer_delete(idle_timer);
+        set_running_vcpu(NULL);
+        return rc;
+}
+
 vmid_t hidden
-forkvm(const char *filename, char * const argv[] unused)
+forkvm(const char *filename, char * const argv[] unused,
+       const struct vm_options *opts)
 {
         int rc = -1;
         struct context *ctx;
         Lmid_t lmid;
 
-        ctx = set_up_vm();
+        ctx = set_up_vm(opts);
         if (ctx == NULL) {
                 warnx("Could not set up VM");
                 return -1;
@@ -1059,6 +1622,36 @@ forkvm(const char *filename, char * const argv[] unused)
                 goto err;
         }
 
+        rc = init_ap_stacks(ctx);
+        if (rc < 0) {
+                warnx("init_ap_stacks() failed");
+                goto err;
+        }
+
+        rc = init_free_page_reports(ctx);
+        if (rc < 0) {
+                warnx("init_free_page_reports() failed");
+                goto err;
+        }
+
+        rc = init_guest_heap(ctx);
+        if (rc < 0) {
+                warnx("init_guest_heap() failed");
+                goto err;
+        }
+
+        rc = init_guest_clock(ctx);
+        if (rc < 0) {
+                warnx("init_guest_clock() failed");
+                goto err;
+        }
+
+        rc = init_guest_irqs(ctx);
+        if (rc < 0) {
+                warnx("init_guest_irqs() failed");
+                goto err;
+        }
+
         rc = init_paging(ctx);
         if (rc < 0) {
                 warnx("init_paging() failed");
@@ -1081,12 +1674,14 @@ forkvm(const char *filename, char * const argv[] unused)
 #endif
 
         struct kvm_regs regs;
+        struct kvm_regs *vcpu_regs;
 
-        rc = vcpu_ioctl(ctx, KVM_GET_REGS, &regs);
-        if (rc < 0) {
-                warn("Could not get vcpu regs");
+        vcpu_regs = get_vcpu_regs(&ctx->vcpus[0]);
+        if (!vcpu_regs) {
+                rc = -1;
                 goto err;
         }
+        memcpy(&regs, vcpu_regs, sizeof(regs));
 
 #if 1 && 0
         regs.rip = (uintptr_t)&arena->code;
@@ -1109,11 +1704,9 @@ forkvm(const char *filename, char * const argv[] unused)
 #endif
         printf("setting rip=0x%016llx rsp=0x%016llx\n", regs.rip, regs.rsp);
 
-        rc = vcpu_ioctl(ctx, KVM_SET_REGS, &regs);
-        if (rc < 0) {
-                warn("Could not set vcpu regs");
-                goto err;
-        }
+        /* this and the sregs all go in with the first KVM_RUN */
+        memcpy(vcpu_regs, &regs, sizeof(regs));
+        dirty_vcpu_regs(&ctx->vcpus[0]);
 
 #if 1 && 0
         struct kvm_sregs sregs;
@@ -1170,72 +1763,53 @@ forkvm(const char *filename, char * const argv[] unused)
         pdp[0].pd_base = ptr64_to_pfn51(&arena->pd);
 
 #else
-        finalize_paging(ctx);
+        rc = finalize_paging(ctx);
+        if (rc < 0) {
+                warnx("finalize_paging() failed");
+                goto err;
+        }
 #endif
 
-        bool go = true;
-        while (go) {
-                struct timeval tv0 = { 0, 0 }, tv1 = { 0, 0 };
-                struct timespec req = { 0, 0 }, rem = { 0, 1 };
-                int64_t timediff;
+        rc = guest_ram_seal(ctx);
+        if (rc < 0)
+                goto err;
 
-                gettimeofday(&tv0, NULL);
-                printf("Doing KVM_RUN\n");
-                rc = vcpu_ioctl(ctx, KVM_RUN, 0);
-                gettimeofday(&tv1, NULL);
-                if (rc < 0) {
-                        warn("KVM_RUN failed");
-                        break;
-                }
-                printf("KVM_RUN took %ld.%06ld seconds\n",
-                       tv1.tv_sec - tv0.tv_sec,
-                       (tv1.tv_usec - tv0.tv_usec));
-                switch (ctx->run->exit_reason) {
-                case KVM_EXIT_HLT:
-                        printf("exited with KVM_EXIT_HLT\n");
-                        go = false;
-                        break;
-                case KVM_EXIT_IO:
-                        printf("exited with KVM_EXIT_IO\n");
-                        go = false;
-                        break;
-                case KVM_EXIT_FAIL_ENTRY:
-                        printf("exited with KVM_EXIT_FAIL_ENTRY\n");
-                        printf("failure reason: 0x%0llx\n", ctx->run->fail_entry.hardware_entry_failure_reason);
-                        go = false;
-                        break;
-                case KVM_EXIT_INTERNAL_ERROR:
-                        printf("exited with KVM_EXIT_INTERNAL_ERROR\n");
-                        go = false;
-                        break;
-                case KVM_EXIT_SHUTDOWN:
-                        printf("exited with KVM_EXIT_SHUTDOWN\n");
-                        go = false;
-                        break;
-                default:
-                        printf("exited with %d\n", ctx->run->exit_reason);
-                        go = false;
-                        break;
+        print_vm_memory_stats(ctx, "start");
+
+        if (ctx->nvcpus > 1) {
+                /* instances each start at main(), like the boot vcpu */
+                const char *entry = ctx->options.instances ? "main"
+                                                           : "ap_main";
+                uintptr_t ap_main = get_symbol_guest_object(ctx, entry);
+
+                if (!ap_main) {
+                        warnx("%u vcpus requested but the guest has no %s()",
+                              ctx->nvcpus, entry);
+                        rc = -1;
+                        goto err;
                 }
 
-                timediff = (tv1.tv_sec - tv0.tv_sec) * 1000000 +
-                           tv1.tv_usec - tv0.tv_usec;
-                if (timediff > 1000000)
-                        continue;
-                if (timediff < 0)
-                        timediff = 0;
+                rc = prepare_aps(ctx, ap_main, offset);
+                if (rc < 0)
+                        goto err;
 
-                rem.tv_nsec = (1000000 - timediff) * 1000;
-                rem.tv_sec = 0;
-                rc = 0;
-                do {
-                        memmove(&req, &rem, sizeof(req));
-                        rem.tv_sec = rem.tv_nsec = 0;
-                        rc = nanosleep(&req, &rem);
-                        if (rc < 0 && errno == EINTR)
-                                rc = 0;
-                } while (rc >= 0 && rem.tv_sec >= 0 && rem.tv_nsec > 0);
+                rc = init_instances(ctx);
+                if (rc < 0)
+                        goto err;
+        }
+
+        if (sched_running()) {
+                rc = sched_run_vm(ctx);
+        } else {
+                rc = start_aps(ctx);
+                if (rc < 0)
+                        goto err;
+                rc = run_vcpu(&ctx->vcpus[0]);
+                /* instances are done when they've all exited */
+                if (ctx->ninstances)
+                        wait_for_aps(ctx);
         }
+        stop_aps(ctx);
 
 err:
         destroy_vm(ctx);
@@ -9,8 +9,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-typedef int vmid_t;
-extern vmid_t forkvm(const char * filename, char * const argv[]) hidden;
+extern vmid_t forkvm(const char * filename, char * const argv[],
+                     const struct vm_options *opts) hidden;
+extern int run_vcpu_once(struct vcpu *vcpu) hidden;
+extern int run_vcpu(struct vcpu *vcpu) hidden;
+extern struct proc_map *add_guest_ram(struct context *ctx,
+                                      const char * const name, size_t size,
+                                      int mode) hidden;
 
 #endif /* !EXECVM_H_ */
 // vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,273 @@
+/*
+ * exits.c - dispatching vcpu exits to per-vm handlers
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * Everything here but dispatch_exit() happens while setting the vm up;
+ * dispatch_exit() happens after every KVM_RUN, so it just indexes or
+ * bisects and calls, and leaves any talking to the cold paths.
+ */
+int hidden
+register_exit_handler(struct context *ctx, unsigned int reason,
+                      exit_handler_t handler, void *data)
+{
+        if (reason >= EXIT_REASONS || reason == KVM_EXIT_IO ||
+            reason == KVM_EXIT_MMIO) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ctx->exits.by_reason[reason] = handler;
+        ctx->exits.data[reason] = data;
+        return 0;
+}
+
+static int
+add_exit_range(struct exit_ranges *ranges, uint64_t base, uint64_t len,
+               exit_handler_t handler, void *data)
+{
+        unsigned int i;
+
+        if (len == 0 || base + len < base || !handler) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; i < ranges->n; i++) {
+                struct exit_range *r = &ranges->ranges[i];
+
+                if (base < r->base + r->len && r->base < base + len) {
+                        errno = EEXIST;
+                        return -1;
+                }
+                if (base < r->base)
+                        break;
+        }
+
+        if (ranges->n == ranges->size) {
+                unsigned int size = ranges->size ? ranges->size * 2 : 8;
+                struct exit_range *new;
+
+                new = reallocarray(ranges->ranges, size, sizeof(*new));
+                if (!new)
+                        return -1;
+                ranges->ranges = new;
+                ranges->size = size;
+        }
+
+        memmove(&ranges->ranges[i + 1], &ranges->ranges[i],
+                (ranges->n - i) * sizeof(ranges->ranges[0]));
+        ranges->ranges[i].base = base;
+        ranges->ranges[i].len = len;
+        ranges->ranges[i].handler = handler;
+        ranges->ranges[i].data = data;
+        ranges->n += 1;
+        return 0;
+}
+
+int hidden
+register_pio_handler(struct context *ctx, uint16_t port, uint16_t len,
+                     exit_handler_t handler, void *data)
+{
+        int rc;
+
+        rc = add_exit_range(&ctx->exits.pio, port, len, handler, data);
+        if (rc < 0)
+                warn("Could not register handler for ports 0x%x-0x%x",
+                     port, port + len - 1);
+        return rc;
+}
+
+int hidden
+register_mmio_handler(struct context *ctx, uint64_t gpa, uint64_t len,
+                      exit_handler_t handler, void *data)
+{
+        int rc;
+
+        rc = add_exit_range(&ctx->exits.mmio, gpa, len, handler, data);
+        if (rc < 0)
+                warn("Could not register handler for mmio 0x%lx-0x%lx",
+                     gpa, gpa + len - 1);
+        return rc;
+}
+
+static inline struct exit_range *
+find_exit_range(struct exit_ranges *ranges, uint64_t addr)
+{
+        unsigned int lo = 0, hi = ranges->n;
+
+        while (lo < hi) {
+                unsigned int mid = lo + (hi - lo) / 2;
+                struct exit_range *r = &ranges->ranges[mid];
+
+                if (addr < r->base)
+                        hi = mid;
+                else if (addr >= r->base + r->len)
+                        lo = mid + 1;
+                else
+                        return r;
+        }
+
+        return NULL;
+}
+
+static int unhandled_exit(struct vcpu *vcpu);
+
+/*
+ * We only see HLT when there's no in-kernel lapic, so there's no
+ * interrupt coming to end it; a secondary vcpu that halts is idle until
+ * signal_guest() or stop_aps() wakes it, and it picks up after the hlt.
+ * The boot vcpu halting is still the end of the vm.
+ */
+static int
+exit_hlt(struct vcpu *vcpu, void *data unused)
+{
+        if (vcpu->id == 0)
+                return EXIT_STOP;
+        return park_vcpu(vcpu, 0);
+}
+
+static int
+exit_fail_entry(struct vcpu *vcpu, void *data unused)
+{
+        printf("vcpu %u exited with KVM_EXIT_FAIL_ENTRY\n", vcpu->id);
+        printf("failure reason: 0x%0llx\n",
+               vcpu->run->fail_entry.hardware_entry_failure_reason);
+        return EXIT_STOP;
+}
+
+static int
+exit_internal_error(struct vcpu *vcpu, void *data unused)
+{
+        printf("vcpu %u exited with KVM_EXIT_INTERNAL_ERROR suberror %u\n",
+               vcpu->id, vcpu->run->internal.suberror);
+        return EXIT_STOP;
+}
+
+static int
+exit_shutdown(struct vcpu *vcpu, void *data unused)
+{
+        printf("vcpu %u exited with KVM_EXIT_SHUTDOWN\n", vcpu->id);
+        return EXIT_STOP;
+}
+
+/*
+ * A signal got us out of KVM_RUN (immediate_exit, or a kick from
+ * stop_aps()); run_vcpu() decides whether that means stopping.
+ */
+static int
+exit_intr(struct vcpu *vcpu unused, void *data unused)
+{
+        return EXIT_RESUME;
+}
+
+static int
+exit_port(struct vcpu *vcpu, void *data unused)
+{
+        struct context *ctx = vcpu->ctx;
+        struct kvm_run *run = vcpu->run;
+
+        if (run->io.direction != KVM_EXIT_IO_OUT || run->io.size != 4)
+                return unhandled_exit(vcpu);
+
+        memcpy(&ctx->guest_status, exit_io_data(vcpu), sizeof(uint32_t));
+        ctx->guest_exited = true;
+        instance_exited(ctx, vcpu->id, ctx->guest_status);
+        printf("vcpu %u: guest exited with status %d\n", vcpu->id,
+               ctx->guest_status);
+        return EXIT_STOP;
+}
+
+int hidden
+init_exit_handlers(struct context *ctx)
+{
+        memset(&ctx->exits, 0, sizeof(ctx->exits));
+
+        register_exit_handler(ctx, KVM_EXIT_HLT, exit_hlt, NULL);
+        register_exit_handler(ctx, KVM_EXIT_FAIL_ENTRY, exit_fail_entry, NULL);
+        register_exit_handler(ctx, KVM_EXIT_INTERNAL_ERROR,
+                              exit_internal_error, NULL);
+        register_exit_handler(ctx, KVM_EXIT_SHUTDOWN, exit_shutdown, NULL);
+        register_exit_handler(ctx, KVM_EXIT_INTR, exit_intr, NULL);
+
+        return register_pio_handler(ctx, GAOL_PORT_EXIT, 1, exit_port, NULL);
+}
+
+void hidden
+free_exit_handlers(struct context *ctx)
+{
+        free(ctx->exits.pio.ranges);
+        free(ctx->exits.mmio.ranges);
+        memset(&ctx->exits, 0, sizeof(ctx->exits));
+}
+
+static int
+unhandled_exit(struct vcpu *vcpu)
+{
+        struct kvm_run *run = vcpu->run;
+
+        switch (run->exit_reason) {
+        case KVM_EXIT_IO:
+                printf("vcpu %u: unhandled %s of %u bytes at port 0x%x\n",
+                       vcpu->id,
+                       run->io.direction == KVM_EXIT_IO_OUT ? "out" : "in",
+                       run->io.size, run->io.port);
+                break;
+        case KVM_EXIT_MMIO:
+                printf("vcpu %u: unhandled mmio %s of %u bytes at 0x%llx\n",
+                       vcpu->id, run->mmio.is_write ? "write" : "read",
+                       run->mmio.len, run->mmio.phys_addr);
+                break;
+        default:
+                printf("vcpu %u exited with %d\n", vcpu->id,
+                       run->exit_reason);
+                break;
+        }
+
+        return EXIT_STOP;
+}
+
+int hidden
+dispatch_exit(struct vcpu *vcpu)
+{
+        struct exit_handlers *exits = &vcpu->ctx->exits;
+        struct kvm_run *run = vcpu->run;
+        unsigned int reason = run->exit_reason;
+        struct exit_range *r;
+
+        switch (reason) {
+        case KVM_EXIT_IO:
+                vcpu->stats.io_exits += 1;
+                r = find_exit_range(&exits->pio, run->io.port);
+                if (!r)
+                        return unhandled_exit(vcpu);
+                return r->handler(vcpu, r->data);
+        case KVM_EXIT_MMIO:
+                vcpu->stats.mmio_exits += 1;
+                r = find_exit_range(&exits->mmio, run->mmio.phys_addr);
+                if (!r)
+                        return unhandled_exit(vcpu);
+                return r->handler(vcpu, r->data);
+        case KVM_EXIT_HLT:
+                vcpu->stats.hlt_exits += 1;
+                break;
+        default:
+                vcpu->stats.other_exits += 1;
+                break;
+        }
+
+        if (reason >= EXIT_REASONS || !exits->by_reason[reason])
+                return unhandled_exit(vcpu);
+        return exits->by_reason[reason](vcpu, exits->data[reason]);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,72 @@
+/*
+ * exits.h - dispatching vcpu exits to per-vm handlers
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef EXITS_H_
+#define EXITS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct context;
+struct vcpu;
+
+/*
+ * What a handler wants done with the vcpu: go straight back into the
+ * guest, stop running it, or put it aside until wake_vcpu() or its
+ * deadline (see park_vcpu()).  Anything negative is an error, and stops
+ * it too.
+ */
+#define EXIT_RESUME     0
+#define EXIT_STOP       1
+#define EXIT_PARK       2
+
+typedef int (*exit_handler_t)(struct vcpu *vcpu, void *data);
+
+/* larger than any KVM_EXIT_* we know of */
+#define EXIT_REASONS    64
+
+struct exit_range {
+        uint64_t base;
+        uint64_t len;
+        exit_handler_t handler;
+        void *data;
+};
+
+struct exit_ranges {
+        unsigned int n;
+        unsigned int size;
+        /* sorted by base, never overlapping */
+        struct exit_range *ranges;
+};
+
+/*
+ * Handlers are looked up without any locking from every vcpu thread, so
+ * they all have to be registered before the vcpus start.
+ */
+struct exit_handlers {
+        exit_handler_t by_reason[EXIT_REASONS];
+        void *data[EXIT_REASONS];
+        struct exit_ranges pio;
+        struct exit_ranges mmio;
+};
+
+extern int register_exit_handler(struct context *ctx, unsigned int reason,
+                                 exit_handler_t handler, void *data) hidden;
+extern int register_pio_handler(struct context *ctx, uint16_t port,
+                                uint16_t len, exit_handler_t handler,
+                                void *data) hidden;
+extern int register_mmio_handler(struct context *ctx, uint64_t gpa,
+                                 uint64_t len, exit_handler_t handler,
+                                 void *data) hidden;
+extern int init_exit_handlers(struct context *ctx) hidden;
+extern void free_exit_handlers(struct context *ctx) hidden;
+extern int dispatch_exit(struct vcpu *vcpu) hidden;
+
+/* the bytes a KVM_EXIT_IO moves, in the vcpu's kvm_run page */
+#define exit_io_data(vcpu) \
+        ((void *)((uint8_t *)(vcpu)->run + (vcpu)->run->io.data_offset))
+
+#endif /* !EXITS_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,93 @@
+/*
+ * freepage.c - guest free page reporting
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * The host points this at the report page when it's listening; if it
+ * stays NULL, reporting is a no-op.
+ */
+struct free_page_reports *free_page_reports__ = NULL;
+
+/*
+ * Ranges are collected here and coalesced before they're posted, so a
+ * guest freeing lots of adjacent small chunks doesn't fill the ring
+ * with them.  Nothing here is locked; callers on more than one cpu need
+ * to serialize.
+ */
+#define FREE_PAGE_BATCH 16
+static struct free_page_range batch[FREE_PAGE_BATCH];
+static unsigned int nbatch = 0;
+
+int
+flush_free_page_reports(void)
+{
+        struct free_page_reports *fpr = free_page_reports__;
+        uint32_t head, tail;
+        unsigned int i;
+
+        if (!fpr || fpr->version != FREE_PAGE_REPORTS_VERSION) {
+                nbatch = 0;
+                return 0;
+        }
+
+        head = fpr->head;
+        tail = __atomic_load_n(&fpr->tail, __ATOMIC_ACQUIRE);
+        for (i = 0; i < nbatch; i++) {
+                if (batch[i].size < fpr->min_chunk)
+                        continue;
+                if (head - tail >= FREE_PAGE_REPORTS_ENTRIES)
+                        break;
+                fpr->ranges[head & FREE_PAGE_REPORTS_MASK] = batch[i];
+                head += 1;
+        }
+        __atomic_store_n(&fpr->head, head, __ATOMIC_RELEASE);
+
+        if (i < nbatch) {
+                memmove(&batch[0], &batch[i],
+                        (nbatch - i) * sizeof(batch[0]));
+                nbatch -= i;
+                return -ENOSPC;
+        }
+
+        nbatch = 0;
+        return 0;
+}
+
+int
+report_free_pages(void *addr, size_t size)
+{
+        uintptr_t start = PAGE_ALIGN_UP((uintptr_t)addr);
+        uintptr_t end = PAGE_ALIGN_DOWN((uintptr_t)addr + size);
+        struct free_page_range *last;
+        int rc;
+
+        if (!free_page_reports__ || end <= start)
+                return 0;
+
+        last = nbatch ? &batch[nbatch - 1] : NULL;
+        if (last && last->addr + last->size == start) {
+                last->size += end - start;
+                return 0;
+        }
+
+        if (nbatch == FREE_PAGE_BATCH) {
+                rc = flush_free_page_reports();
+                if (rc < 0 && nbatch == FREE_PAGE_BATCH)
+                        return rc;
+        }
+
+        batch[nbatch].addr = start;
+        batch[nbatch].size = end - start;
+        nbatch += 1;
+
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
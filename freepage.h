@@ -0,0 +1,43 @@
+/*
+ * freepage.h - guest free page reporting
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef FREEPAGE_H_
+#define FREEPAGE_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define FREE_PAGE_REPORTS_VERSION 2
+/* has to be a power of two, so the slots stay in order when head wraps */
+#define FREE_PAGE_REPORTS_ENTRIES 128
+#define FREE_PAGE_REPORTS_MASK (FREE_PAGE_REPORTS_ENTRIES - 1)
+
+struct free_page_range {
+        uint64_t addr;
+        uint64_t size;
+};
+
+/*
+ * One page shared between the guest and the host.  The guest fills
+ * ranges[] and advances head; the host releases what's been reported
+ * and advances tail.  Both only ever grow; the slot is the index masked
+ * with FREE_PAGE_REPORTS_MASK.
+ */
+struct free_page_reports {
+        uint32_t version;
+        /* set by the host: ranges smaller than this aren't worth it */
+        uint32_t min_chunk;
+        uint32_t head;
+        uint32_t tail;
+        struct free_page_range ranges[FREE_PAGE_REPORTS_ENTRIES];
+} aligned(4096);
+
+/* guest side */
+extern struct free_page_reports *free_page_reports__;
+extern int report_free_pages(void *addr, size_t size);
+extern int flush_free_page_reports(void);
+
+#endif /* !FREEPAGE_H_ */
+// vim:fenc=utf-8:tw=75:et
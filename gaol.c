@@ -7,12 +7,14 @@
 #include <err.h>
 #include <errno.h>
 #include <paths.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include "gaol.h"
 
@@ -21,7 +23,44 @@ usage(int status)
 {
         FILE *output = status == 0 ? stdout : stderr;
 
-        fprintf(output, "usage: gaol <cmd> [<arg0> ... <argN>]\n");
+        fprintf(output, "usage: gaol [<options>] <cmd> [<arg0> ... <argN>]\n");
+        fprintf(output, "options:\n");
+        fprintf(output, "  --share-dsos         share read-only DSO pages between vms\n");
+        fprintf(output, "  --share-page-tables  share read-only page tables between vms\n");
+        fprintf(output, "  --ksm                let ksmd merge identical guest pages\n");
+        fprintf(output, "  --free-page-reporting=<min-chunk>\n");
+        fprintf(output, "                       release guest-reported free pages\n");
+        fprintf(output, "  --free-page-advice=dontneed|free\n");
+        fprintf(output, "                       how to release them\n");
+        fprintf(output, "  --hibernate-after=<ms>\n");
+        fprintf(output, "                       compress idle vms\' memory away\n");
+        fprintf(output, "  --memfd              back writable guest memory with a memfd\n");
+        fprintf(output, "  --memfd-hugetlb      ... using hugetlbfs pages\n");
+        fprintf(output, "  --memfd-seal         ... and seal it once it's set up\n");
+        fprintf(output, "  --guest-heap=<size>  give the guest a preallocated heap\n");
+        fprintf(output, "  --mem-type=<region>:<type>\n");
+        fprintf(output, "                       cache text, data, stack, heap, or pagetables\n");
+        fprintf(output, "                       as wb (the default), wt, wc, or uc\n");
+        fprintf(output, "  --vcpus=<n>          run n vcpus; all but one start at ap_main()\n");
+        fprintf(output, "  --instances=<n>      run n copies of the guest in one vm, one per\n");
+        fprintf(output, "                       vcpu, sharing read-only memory\n");
+        fprintf(output, "  --pin-vcpus=<cpus>   pin vcpu threads round robin to a cpu list\n");
+        fprintf(output, "                       like 2-5,8\n");
+        fprintf(output, "  --vcpu-rt=<prio>     run vcpu threads SCHED_FIFO at prio\n");
+        fprintf(output, "  --halt-poll-ns=<ns>  cap kvm's halt polling for this vm\n");
+        fprintf(output, "  --dedicated-cores    don't exit on pause, hlt, or mwait; needs\n");
+        fprintf(output, "                       --pin-vcpus with isolated cpus\n");
+        fprintf(output, "  --irqchip            use kvm's lapic, so guests can sleep in hlt\n");
+        fprintf(output, "  --hide-cpu-features=<feature>[,<feature>...]\n");
+        fprintf(output, "                       keep e.g. avx512f,avx2 out of the guest's cpuid\n");
+        fprintf(output, "  --side-by-side=<n>   run n vms of the command at once, each on\n");
+        fprintf(output, "                       its own thread\n");
+        fprintf(output, "  --page-pool=<depth>[,<refills-per-sec>]\n");
+        fprintf(output, "                       keep pre-zeroed pages ready for vms\n");
+        fprintf(output, "  --sched[=<workers>[,<slice-us>]]\n");
+        fprintf(output, "                       run vcpus on a pool of worker threads\n");
+        fprintf(output, "  --priority=high|normal|low\n");
+        fprintf(output, "                       the scheduler class for our vcpus\n");
         exit(status);
 }
 
@@ -80,6 +119,108 @@ find_executable(const char *filename)
         return NULL;
 }
 
+struct vm_thread {
+        pthread_t thread;
+        const char *filename;
+        char **argv;
+        const struct vm_options *opts;
+        int rc;
+};
+
+static void *
+vm_thread(void *arg)
+{
+        struct vm_thread *vt = arg;
+
+        vt->rc = forkvm(vt->filename, vt->argv, vt->opts);
+        return NULL;
+}
+
+/*
+ * Run n copies of the same vm concurrently in this process, which is
+ * mostly a way to make sure nothing in a vm's setup or teardown steps on
+ * another's.
+ */
+static int
+run_side_by_side(unsigned int n, const char *filename, char **argv,
+                 const struct vm_options *opts)
+{
+        struct vm_thread *vts;
+        unsigned int started = 0, failed = 0;
+        struct timespec t0, t1;
+        long ns;
+
+        vts = calloc(n, sizeof(*vts));
+        if (!vts)
+                err(2, "Could not allocate memory");
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (unsigned int i = 0; i < n; i++) {
+                int rc;
+
+                vts[i].filename = filename;
+                vts[i].argv = argv;
+                vts[i].opts = opts;
+                rc = pthread_create(&vts[i].thread, NULL, vm_thread, &vts[i]);
+                if (rc != 0) {
+                        errno = rc;
+                        warn("Could not start vm %u", i);
+                        break;
+                }
+                started += 1;
+        }
+
+        for (unsigned int i = 0; i < started; i++) {
+                pthread_join(vts[i].thread, NULL);
+                if (vts[i].rc < 0)
+                        failed += 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        ns = (t1.tv_sec - t0.tv_sec) * 1000000000l +
+             (t1.tv_nsec - t0.tv_nsec);
+        printf("side by side: %u of %u vms started, %u failed, %ld.%06lds\n",
+               started, n, failed, ns / 1000000000, ns % 1000000000 / 1000);
+        free(vts);
+
+        return (started < n || failed) ? -1 : 0;
+}
+
+static int
+parse_mem_type(struct vm_options *opts, const char *arg)
+{
+        static const char * const regions[] = {
+                [MEM_REGION_TEXT] = "text",
+                [MEM_REGION_DATA] = "data",
+                [MEM_REGION_STACK] = "stack",
+                [MEM_REGION_HEAP] = "heap",
+                [MEM_REGION_PAGE_TABLES] = "pagetables",
+        };
+        const char *colon = strchr(arg, ':');
+        int region, type;
+
+        if (!colon)
+                return -1;
+
+        for (region = 0; region < MEM_REGIONS; region++) {
+                if (strlen(regions[region]) == (size_t)(colon - arg) &&
+                    !strncmp(arg, regions[region], colon - arg))
+                        break;
+        }
+        if (region == MEM_REGIONS)
+                return -1;
+
+        for (type = 0; type < MEM_TYPES; type++) {
+                if (!strcmp(colon + 1, mem_type_name(type)))
+                        break;
+        }
+        if (type == MEM_TYPES)
+                return -1;
+
+        opts->mem_types[region] = type;
+        return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -87,6 +228,13 @@ main(int argc, char *argv[])
         char *filename = NULL;
         int rc = -1;
         pid_t vmid;
+        struct vm_options options;
+        unsigned int pool_depth = 0, pool_refill_rate = 0;
+        bool sched = false;
+        unsigned int sched_workers = 0, sched_slice_us = 0;
+        unsigned int side_by_side = 0;
+
+        init_vm_options(&options);
 
         for (int i = 1; i < argc; i++) {
                 char *arg = argv[i];
@@ -94,6 +242,183 @@ main(int argc, char *argv[])
                     !strcmp(arg, "--usage") || !strcmp(arg, "-?"))
                         usage(0);
 
+                if (!strcmp(arg, "--share-dsos")) {
+                        options.share_dsos = true;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--share-page-tables")) {
+                        options.share_page_tables = true;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--ksm")) {
+                        options.ksm = true;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--free-page-reporting=", 22)) {
+                        char *end = NULL;
+
+                        errno = 0;
+                        options.free_page_min_chunk =
+                                strtoul(arg + 22, &end, 0);
+                        if (errno || !end || *end ||
+                            options.free_page_min_chunk == 0 ||
+                            options.free_page_min_chunk > UINT32_MAX)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strcmp(arg, "--free-page-advice=dontneed")) {
+                        options.free_page_advice = MADV_DONTNEED;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--free-page-advice=free")) {
+                        options.free_page_advice = MADV_FREE;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--memfd")) {
+                        options.memfd = true;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--memfd-hugetlb")) {
+                        options.memfd = true;
+                        options.memfd_hugetlb = true;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--memfd-seal")) {
+                        options.memfd = true;
+                        options.memfd_seal = true;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--hibernate-after=", 18)) {
+                        options.hibernate_idle_ms =
+                                strtoul(arg + 18, NULL, 0);
+                        if (options.hibernate_idle_ms == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--guest-heap=", 13)) {
+                        options.heap_size = strtoul(arg + 13, NULL, 0);
+                        if (options.heap_size == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--mem-type=", 11)) {
+                        if (parse_mem_type(&options, arg + 11) < 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--vcpus=", 8)) {
+                        options.nvcpus = strtoul(arg + 8, NULL, 0);
+                        if (options.nvcpus == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--instances=", 12)) {
+                        options.instances = strtoul(arg + 12, NULL, 0);
+                        if (options.instances == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--pin-vcpus=", 12)) {
+                        if (parse_cpu_list(&options.vcpu_cpus, arg + 12) < 0 ||
+                            CPU_COUNT(&options.vcpu_cpus) == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--vcpu-rt=", 10)) {
+                        options.vcpu_rt_prio = strtoul(arg + 10, NULL, 0);
+                        if (options.vcpu_rt_prio < sched_get_priority_min(SCHED_FIFO) ||
+                            options.vcpu_rt_prio > sched_get_priority_max(SCHED_FIFO))
+                                usage(1);
+                        continue;
+                }
+
+                if (!strcmp(arg, "--dedicated-cores")) {
+                        options.dedicated_cores = true;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--halt-poll-ns=", 15)) {
+                        options.halt_poll_ns = strtol(arg + 15, NULL, 0);
+                        if (options.halt_poll_ns < 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strcmp(arg, "--irqchip")) {
+                        options.irqchip = true;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--hide-cpu-features=", 20)) {
+                        if (parse_cpu_features(arg + 20,
+                                               &options.cpuid_hide) < 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strcmp(arg, "--sched")) {
+                        sched = true;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--sched=", 8)) {
+                        char *end = NULL;
+
+                        sched = true;
+                        sched_workers = strtoul(arg + 8, &end, 0);
+                        if (end && *end == ',')
+                                sched_slice_us = strtoul(end + 1, NULL, 0);
+                        continue;
+                }
+
+                if (!strcmp(arg, "--priority=high")) {
+                        options.sched_prio = SCHED_PRIO_HIGH;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--priority=normal")) {
+                        options.sched_prio = SCHED_PRIO_NORMAL;
+                        continue;
+                }
+
+                if (!strcmp(arg, "--priority=low")) {
+                        options.sched_prio = SCHED_PRIO_LOW;
+                        continue;
+                }
+
+                if (!strncmp(arg, "--side-by-side=", 15)) {
+                        side_by_side = strtoul(arg + 15, NULL, 0);
+                        if (side_by_side == 0)
+                                usage(1);
+                        continue;
+                }
+
+                if (!strncmp(arg, "--page-pool=", 12)) {
+                        char *end = NULL;
+
+                        pool_depth = strtoul(arg + 12, &end, 0);
+                        if (end && *end == ',')
+                                pool_refill_rate = strtoul(end + 1, NULL, 0);
+                        if (pool_depth == 0)
+                                usage(1);
+                        continue;
+                }
+
                 if (cmd < 0) {
                         cmd = i;
                         break;
@@ -103,12 +428,79 @@ main(int argc, char *argv[])
         if (cmd < 0)
                 usage(1);
 
+        /*
+         * A vm is idle when its vcpu is halted, and without the in-kernel
+         * lapic a halted boot vcpu is a vm that's finished.
+         */
+        if (options.hibernate_idle_ms && !options.irqchip) {
+                warnx("--hibernate-after needs --irqchip");
+                usage(1);
+        }
+
+        /*
+         * Releasing and refilling guest pages is done a small page at a
+         * time, which hugetlbfs won't have.
+         */
+        if (options.memfd_hugetlb &&
+            (options.free_page_min_chunk || options.hibernate_idle_ms)) {
+                warnx("--memfd-hugetlb can't be used with --free-page-reporting or --hibernate-after");
+                usage(1);
+        }
+
+        /*
+         * Scheduled vcpus run on whichever worker picks them up, so
+         * there's no thread of their own to pin or make realtime.
+         */
+        if (sched && (CPU_COUNT(&options.vcpu_cpus) || options.vcpu_rt_prio)) {
+                warnx("--pin-vcpus and --vcpu-rt can't be used with --sched");
+                usage(1);
+        }
+        if (sched && options.dedicated_cores) {
+                warnx("--dedicated-cores can't be used with --sched");
+                usage(1);
+        }
+
+        /*
+         * Instances share the one free page report page and its single
+         * producer index, and a reported address is always instance 0's.
+         * ksm would merge one instance's pages with another's, and the
+         * copy-on-write faults are a channel between them.
+         */
+        if (options.instances > 1 &&
+            (options.free_page_min_chunk || options.ksm)) {
+                warnx("--instances can't be used with --free-page-reporting or --ksm");
+                usage(1);
+        }
+
+        if (options.instances > 1) {
+                if (options.nvcpus != 1 && options.nvcpus != options.instances)
+                        usage(1);
+                options.nvcpus = options.instances;
+        }
+
         filename = find_executable(argv[cmd]);
         if (!filename)
                 err(2, "%s", argv[cmd]);
 
-        rc = vmid = forkvm(filename, &argv[cmd]);
+        if (pool_depth)
+                page_pool_start(pool_depth, pool_refill_rate);
+
+        if (sched && sched_start(sched_workers, sched_slice_us) < 0)
+                errx(6, "Could not start the scheduler");
+
+        if (side_by_side > 1)
+                rc = vmid = run_side_by_side(side_by_side, filename,
+                                             &argv[cmd], &options);
+        else
+                rc = vmid = forkvm(filename, &argv[cmd], &options);
         free(filename);
+        print_sched_stats();
+        print_vm_registry_stats();
+        if (options.ksm)
+                ksm_print_process_stats();
+        sched_stop();
+        page_pool_print_stats();
+        page_pool_stop();
         if (vmid < 0) {
                 warnx("Could not fork vm");
         }
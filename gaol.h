@@ -37,10 +37,32 @@
 #include "compiler.h"
 #include "list.h"
 #include "mmu.h"
+#include "options.h"
+#include "hibernate.h"
+#include "guestmem.h"
+#include "pagepool.h"
+#include "xlate.h"
+#include "vcpu.h"
+#include "cpuid.h"
+#include "exits.h"
+#include "console.h"
+#include "irqchip.h"
+#include "instance.h"
+#include "scheduler.h"
+#include "pvclock.h"
+#include "registry.h"
 
 #include "context.h"
 #include "util.h"
+#include "share.h"
+#include "ksm.h"
+#include "memstats.h"
 #include "ioring.h"
+#include "ports.h"
+#include "freepage.h"
+#include "guestheap.h"
+#include "guestclock.h"
+#include "guestirq.h"
 #include "dump.h"
 #include "execvm.h"
 
@@ -6,13 +6,16 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
 
 #include "compiler.h"
+#include "guestirq.h"
 #include "ioring.h"
+#include "ports.h"
 
 #include "dump.h"
 
@@ -31,11 +34,23 @@ ctor(void)
         test_ctors = 1;
 }
 
+/*
+ * Any vcpus past the first start here.  There's nothing for them to do
+ * yet, and there's nowhere to return to.
+ */
+void
+ap_main(unsigned int cpu unused, unsigned int ncpus unused)
+{
+        for (;;)
+                __asm__("hlt");
+}
+
 int main(void)
 {
         char buf[4096];
         uint16_t size = sizeof(buf);
         int status = 0;
+        bool irqs;
         int rc;
 
 #if 0
@@ -45,6 +60,13 @@ int main(void)
         dump_maps();
         printf("enarx_input_ring_ptr__: %p\n", enarx_input_ring_ptr__);
 #else
+        /*
+         * If the host can wake us, sleep when there's nothing to read.
+         * Nothing on the host writes our input ring or signals us yet,
+         * so for now that's until the vm is stopped.
+         */
+        irqs = guest_irq_init() == 0;
+
         if (test_ctors) {
                 strcpy(buf, "Ctors worked.\n");
                 size = strlen(buf);
@@ -55,7 +77,6 @@ int main(void)
                         stall(1000);
         }
         do {
-                stall(10000);
                 size = sizeof(buf);
                 rc = ioring_read(buf, size);
                 if (rc < 0) {
@@ -63,8 +84,13 @@ int main(void)
                         break;
                 }
 
-                if (rc == 0)
+                if (rc == 0) {
+                        if (irqs)
+                                guest_idle();
+                        else
+                                stall(10000);
                         continue;
+                }
 
                 size = rc;
                 rc = -ENOSPC;
@@ -75,7 +101,8 @@ int main(void)
         strcpy(buf, "Goodbye, cruel world.\n");
         size = strlen(buf);
         ioring_write(buf, size);
-        return status;
+        console_write(buf, size);
+        guest_exit(status);
 }
 
 // vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,90 @@
+/*
+ * guestclock.c - guest clock_gettime() from the host's clock page
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <errno.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "guestclock.h"
+
+/*
+ * The host points this at the vm's clock page if it has one.  If it
+ * stays NULL, we're not in a vm that keeps one, and clock_gettime()
+ * goes to the kernel like it normally would.
+ */
+struct guest_clock *guest_clock__ = NULL;
+
+static inline uint64_t
+rdtsc_ordered(void)
+{
+        uint32_t lo, hi;
+
+        __asm__ __volatile__("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+        return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t
+guest_clock_ns(const struct guest_clock *gc, int64_t *realtime_offset)
+{
+        uint32_t version;
+        uint64_t delta, ns;
+
+        do {
+                version = __atomic_load_n(&gc->version, __ATOMIC_ACQUIRE);
+                if (version & 1) {
+                        __asm__("pause");
+                        continue;
+                }
+
+                delta = rdtsc_ordered() - gc->tsc_timestamp;
+                if (gc->tsc_shift < 0)
+                        delta >>= -gc->tsc_shift;
+                else
+                        delta <<= gc->tsc_shift;
+                ns = gc->system_time +
+                     (uint64_t)(((unsigned __int128)delta *
+                                 gc->tsc_to_system_mul) >> 32);
+                *realtime_offset = gc->realtime_offset;
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((version & 1) ||
+                 version != __atomic_load_n(&gc->version, __ATOMIC_RELAXED));
+
+        return ns;
+}
+
+int
+clock_gettime(clockid_t clk, struct timespec *ts)
+{
+        struct guest_clock *gc = guest_clock__;
+        int64_t realtime_offset;
+        uint64_t ns;
+
+        if (!gc)
+                return syscall(SYS_clock_gettime, clk, ts);
+
+        switch (clk) {
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_COARSE:
+                ns = guest_clock_ns(gc, &realtime_offset);
+                break;
+        case CLOCK_REALTIME:
+        case CLOCK_REALTIME_COARSE:
+                ns = guest_clock_ns(gc, &realtime_offset);
+                ns += realtime_offset;
+                break;
+        default:
+                return syscall(SYS_clock_gettime, clk, ts);
+        }
+
+        ts->tv_sec = ns / 1000000000ull;
+        ts->tv_nsec = ns % 1000000000ull;
+        return 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,40 @@
+/*
+ * guestclock.h - the clock page guests read time from
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef GUESTCLOCK_H_
+#define GUESTCLOCK_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+
+/*
+ * The guest can't use the vdso, so the host keeps one page per vm that
+ * says how to turn the vcpu's tsc into time, in the same form as a
+ * pvclock record:
+ *
+ *   delta = rdtsc() - tsc_timestamp
+ *   delta = tsc_shift < 0 ? delta >> -tsc_shift : delta << tsc_shift
+ *   CLOCK_MONOTONIC = system_time + (delta * tsc_to_system_mul) >> 32
+ *   CLOCK_REALTIME = CLOCK_MONOTONIC + realtime_offset
+ *
+ * version is odd while the host is rewriting it; readers retry until
+ * they see the same even version before and after.
+ */
+struct guest_clock {
+        uint32_t version;
+        uint32_t tsc_to_system_mul;
+        int8_t tsc_shift;
+        uint8_t reserved[7];
+        uint64_t tsc_timestamp;
+        uint64_t system_time;
+        int64_t realtime_offset;
+        uint64_t tsc_khz;
+} aligned(4096);
+
+/* guest side */
+extern struct guest_clock *guest_clock__;
+
+#endif /* !GUESTCLOCK_H_ */
+// vim:fenc=utf-8:tw=75:et
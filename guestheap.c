@@ -0,0 +1,538 @@
+/*
+ * guestheap.c - guest malloc() from the preallocated heap
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * The host fills this in if it gave us a heap.  Our constructors (and
+ * libc's) run before it does that, so until it's here everything goes
+ * to libc's allocator, and anything libc allocated goes back to libc.
+ */
+struct guest_heap guest_heap__ = { 0, };
+
+/*
+ * The heap is carved into 64KiB runs.  Small allocations come from runs
+ * dedicated to one power-of-two size class, 16 bytes to 32KiB; anything
+ * bigger gets whole runs of its own.  One byte per run says which it
+ * is, so free() doesn't need a header on every block.
+ *
+ * Each vcpu keeps a few free blocks of each class, so most malloc()s
+ * and free()s never touch the lock or anything another cpu is writing.
+ * The guest has no TLS of its own (nothing sets up an fs base in the
+ * vm), so which cache is ours comes from rdtscp, which says whatever the
+ * host put in our TSC_AUX.  If it couldn't, everybody shares the locked
+ * lists.  Nothing in the guest can preempt a vcpu in the middle of a
+ * malloc(), so a cache only ever has one user at a time.
+ */
+#define HEAP_MIN_SHIFT 4
+#define HEAP_CLASSES 12
+#define HEAP_MAX_SMALL (1ul << (HEAP_MIN_SHIFT + HEAP_CLASSES - 1))
+#define HEAP_RUN_SHIFT 16
+#define HEAP_RUN_SIZE (1ul << HEAP_RUN_SHIFT)
+#define HEAP_CACHE_MAX 64
+#define HEAP_CACHE_BATCH 32
+#define HEAP_CACHE_CPUS 64
+
+/* run_class[] is class + 1 for small runs */
+#define RUN_FREE 0
+#define RUN_LARGE 0xfe
+#define RUN_CONT 0xff
+
+struct heap_block {
+        struct heap_block *next;
+};
+
+/* a free span of large runs, stored in its first run */
+struct heap_span {
+        struct heap_span *next;
+        uint64_t idx;
+        uint64_t nruns;
+};
+
+static struct {
+        int lock;
+        bool ready;
+        uintptr_t base;
+        uint64_t nruns;
+        uint64_t next_run;
+        uint8_t *run_class;
+        uint32_t *run_len;
+        struct heap_block *free[HEAP_CLASSES];
+        struct heap_span *spans;
+} heap;
+
+struct heap_cache {
+        struct heap_block *free[HEAP_CLASSES];
+        unsigned int count[HEAP_CLASSES];
+} aligned(64);
+static struct heap_cache caches[HEAP_CACHE_CPUS];
+
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static inline void
+heap_lock(void)
+{
+        while (__atomic_exchange_n(&heap.lock, 1, __ATOMIC_ACQUIRE))
+                __asm__("pause");
+}
+
+static inline void
+heap_unlock(void)
+{
+        __atomic_store_n(&heap.lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline uintptr_t
+run_addr(uint64_t idx)
+{
+        return heap.base + (idx << HEAP_RUN_SHIFT);
+}
+
+static void
+heap_init_locked(void)
+{
+        uintptr_t start, end;
+        uint64_t meta_runs;
+
+        if (__atomic_load_n(&guest_heap__.version, __ATOMIC_ACQUIRE) !=
+            GUEST_HEAP_VERSION)
+                return;
+
+        start = ALIGN_UP(guest_heap__.base, HEAP_RUN_SIZE);
+        end = guest_heap__.base + guest_heap__.size;
+        if (end <= start + HEAP_RUN_SIZE)
+                return;
+
+        heap.base = start;
+        heap.nruns = (end - start) >> HEAP_RUN_SHIFT;
+
+        /* the run map lives at the front of the heap itself */
+        heap.run_class = (uint8_t *)start;
+        heap.run_len = (uint32_t *)(start + ALIGN_UP(heap.nruns, 8));
+        meta_runs = ALIGN_UP(ALIGN_UP(heap.nruns, 8) +
+                             heap.nruns * sizeof(heap.run_len[0]),
+                             HEAP_RUN_SIZE) >> HEAP_RUN_SHIFT;
+        if (meta_runs >= heap.nruns)
+                return;
+        heap.next_run = meta_runs;
+
+        __atomic_store_n(&heap.ready, true, __ATOMIC_RELEASE);
+}
+
+static inline bool
+heap_ready(void)
+{
+        if (__atomic_load_n(&heap.ready, __ATOMIC_ACQUIRE))
+                return true;
+        if (guest_heap__.version == 0)
+                return false;
+
+        heap_lock();
+        if (!heap.ready)
+                heap_init_locked();
+        heap_unlock();
+        return heap.ready;
+}
+
+static inline bool
+heap_owns(void *ptr)
+{
+        uintptr_t addr = (uintptr_t)ptr;
+
+        return heap.ready && addr >= heap.base &&
+               addr < run_addr(heap.nruns);
+}
+
+static inline struct heap_cache *
+this_cache(void)
+{
+        uint32_t lo, hi, cpu;
+
+        if (!(guest_heap__.flags & GUEST_HEAP_CPU_IDS))
+                return NULL;
+
+        __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(cpu));
+        if (cpu >= HEAP_CACHE_CPUS)
+                return NULL;
+        return &caches[cpu];
+}
+
+static inline int
+size_class(size_t size)
+{
+        if (size <= (1ul << HEAP_MIN_SHIFT))
+                return 0;
+        return 64 - __builtin_clzl(size - 1) - HEAP_MIN_SHIFT;
+}
+
+/*
+ * Find nruns contiguous runs, first from what's been freed and then from
+ * the untouched end of the heap.  Called with the lock held.
+ */
+static int64_t
+alloc_runs(uint64_t nruns)
+{
+        struct heap_span **prev, *span;
+        uint64_t idx;
+
+        for (prev = &heap.spans; (span = *prev); prev = &span->next) {
+                if (span->nruns < nruns)
+                        continue;
+
+                idx = span->idx;
+                if (span->nruns == nruns) {
+                        *prev = span->next;
+                } else {
+                        struct heap_span *rest;
+
+                        rest = (struct heap_span *)run_addr(idx + nruns);
+                        rest->next = span->next;
+                        rest->idx = idx + nruns;
+                        rest->nruns = span->nruns - nruns;
+                        *prev = rest;
+                }
+                return idx;
+        }
+
+        if (heap.next_run + nruns > heap.nruns)
+                return -1;
+        idx = heap.next_run;
+        heap.next_run += nruns;
+        return idx;
+}
+
+/*
+ * Called with the lock held.  These aren't reported as free pages: we
+ * may hand them out again before the host gets around to releasing
+ * them.
+ */
+static void
+free_runs(uint64_t idx, uint64_t nruns)
+{
+        struct heap_span *span;
+
+        memset(&heap.run_class[idx], RUN_FREE, nruns);
+        if (idx + nruns == heap.next_run) {
+                heap.next_run = idx;
+        } else {
+                span = (struct heap_span *)run_addr(idx);
+                span->idx = idx;
+                span->nruns = nruns;
+                span->next = heap.spans;
+                heap.spans = span;
+        }
+}
+
+/*
+ * Make sure the shared list for class c has something on it, carving a
+ * new run if it's empty.  Called with the lock held.
+ */
+static bool
+fill_class(int c)
+{
+        size_t size = 1ul << (HEAP_MIN_SHIFT + c);
+        struct heap_block *b;
+        int64_t idx;
+        uintptr_t run;
+
+        if (heap.free[c])
+                return true;
+
+        idx = alloc_runs(1);
+        if (idx < 0)
+                return false;
+
+        heap.run_class[idx] = c + 1;
+        run = run_addr(idx);
+        for (size_t off = HEAP_RUN_SIZE; off > 0; off -= size) {
+                b = (struct heap_block *)(run + off - size);
+                b->next = heap.free[c];
+                heap.free[c] = b;
+        }
+        return true;
+}
+
+/*
+ * Move a batch of class c blocks into a vcpu's cache.  Called with the
+ * lock held.
+ */
+static void
+refill_cache(struct heap_cache *cache, int c)
+{
+        struct heap_block *b;
+
+        if (!fill_class(c))
+                return;
+
+        for (int i = 0; i < HEAP_CACHE_BATCH && heap.free[c]; i++) {
+                b = heap.free[c];
+                heap.free[c] = b->next;
+                b->next = cache->free[c];
+                cache->free[c] = b;
+                cache->count[c] += 1;
+        }
+}
+
+static void
+drain_cache(struct heap_cache *cache, int c)
+{
+        for (int i = 0; i < HEAP_CACHE_BATCH && cache->free[c]; i++) {
+                struct heap_block *b = cache->free[c];
+
+                cache->free[c] = b->next;
+                cache->count[c] -= 1;
+                b->next = heap.free[c];
+                heap.free[c] = b;
+        }
+}
+
+/* without a cache of our own, every block goes through the lock */
+static void *
+alloc_shared(int c)
+{
+        struct heap_block *b = NULL;
+
+        heap_lock();
+        if (fill_class(c)) {
+                b = heap.free[c];
+                heap.free[c] = b->next;
+        }
+        heap_unlock();
+
+        if (!b)
+                errno = ENOMEM;
+        return b;
+}
+
+static void
+free_shared(struct heap_block *b, int c)
+{
+        heap_lock();
+        b->next = heap.free[c];
+        heap.free[c] = b;
+        heap_unlock();
+}
+
+static void *
+alloc_large(size_t size)
+{
+        uint64_t nruns = ALIGN_UP(size, HEAP_RUN_SIZE) >> HEAP_RUN_SHIFT;
+        int64_t idx;
+
+        heap_lock();
+        idx = alloc_runs(nruns);
+        if (idx >= 0) {
+                heap.run_class[idx] = RUN_LARGE;
+                if (nruns > 1)
+                        memset(&heap.run_class[idx + 1], RUN_CONT,
+                               nruns - 1);
+                heap.run_len[idx] = nruns;
+        }
+        heap_unlock();
+
+        if (idx < 0) {
+                errno = ENOMEM;
+                return NULL;
+        }
+        return (void *)run_addr(idx);
+}
+
+/* class + 1, RUN_LARGE, or 0 if ptr isn't the start of anything we gave out */
+static uint8_t
+block_class(void *ptr)
+{
+        uint64_t idx = ((uintptr_t)ptr - heap.base) >> HEAP_RUN_SHIFT;
+        uint8_t cls = heap.run_class[idx];
+
+        if (cls == RUN_LARGE)
+                return run_addr(idx) == (uintptr_t)ptr ? cls : 0;
+        if (cls == RUN_FREE || cls > HEAP_CLASSES)
+                return 0;
+        return cls;
+}
+
+static size_t
+usable_size(void *ptr)
+{
+        uint64_t idx = ((uintptr_t)ptr - heap.base) >> HEAP_RUN_SHIFT;
+        uint8_t cls = block_class(ptr);
+
+        if (cls == 0)
+                return 0;
+        if (cls == RUN_LARGE)
+                return (size_t)heap.run_len[idx] << HEAP_RUN_SHIFT;
+        return 1ul << (HEAP_MIN_SHIFT + cls - 1);
+}
+
+void *
+heap_malloc(size_t size)
+{
+        struct heap_cache *cache;
+        struct heap_block *b;
+        int c;
+
+        if (!heap_ready()) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        if (size > HEAP_MAX_SMALL)
+                return alloc_large(size);
+
+        c = size_class(size);
+        cache = this_cache();
+        if (!cache)
+                return alloc_shared(c);
+
+        if (!cache->free[c]) {
+                heap_lock();
+                refill_cache(cache, c);
+                heap_unlock();
+                if (!cache->free[c]) {
+                        errno = ENOMEM;
+                        return NULL;
+                }
+        }
+
+        b = cache->free[c];
+        cache->free[c] = b->next;
+        cache->count[c] -= 1;
+        return b;
+}
+
+void
+heap_free(void *ptr)
+{
+        struct heap_block *b = ptr;
+        struct heap_cache *cache;
+        uint64_t idx;
+        uint8_t cls;
+        int c;
+
+        if (!heap_owns(ptr))
+                return;
+
+        /* a free run, or the middle of a large one: not ours to take */
+        cls = block_class(ptr);
+        if (cls == 0)
+                return;
+
+        idx = ((uintptr_t)ptr - heap.base) >> HEAP_RUN_SHIFT;
+        if (cls == RUN_LARGE) {
+                heap_lock();
+                free_runs(idx, heap.run_len[idx]);
+                heap_unlock();
+                return;
+        }
+
+        c = cls - 1;
+        cache = this_cache();
+        if (!cache) {
+                free_shared(b, c);
+                return;
+        }
+
+        b->next = cache->free[c];
+        cache->free[c] = b;
+        cache->count[c] += 1;
+        if (cache->count[c] > HEAP_CACHE_MAX) {
+                heap_lock();
+                drain_cache(cache, c);
+                heap_unlock();
+        }
+}
+
+void *
+heap_calloc(size_t nmemb, size_t size)
+{
+        size_t total;
+        void *ptr;
+
+        if (__builtin_mul_overflow(nmemb, size, &total)) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        /* blocks get reused, so unlike fresh pages they're not zeroed */
+        ptr = heap_malloc(total);
+        if (ptr)
+                memset(ptr, 0, total);
+        return ptr;
+}
+
+void *
+heap_realloc(void *ptr, size_t size)
+{
+        size_t old;
+        void *new;
+
+        if (!ptr)
+                return heap_malloc(size);
+        if (size == 0) {
+                heap_free(ptr);
+                return NULL;
+        }
+
+        old = usable_size(ptr);
+        if (old == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if (size <= old)
+                return ptr;
+
+        new = heap_malloc(size);
+        if (!new)
+                return NULL;
+        memcpy(new, ptr, old);
+        heap_free(ptr);
+        return new;
+}
+
+/*
+ * These take over libc's allocator for the guest's link map.
+ */
+void *
+malloc(size_t size)
+{
+        if (!heap_ready())
+                return __libc_malloc(size);
+        return heap_malloc(size);
+}
+
+void
+free(void *ptr)
+{
+        if (heap_owns(ptr))
+                heap_free(ptr);
+        else if (ptr)
+                __libc_free(ptr);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+        if (!heap_ready())
+                return __libc_calloc(nmemb, size);
+        return heap_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+        if ((ptr && !heap_owns(ptr)) || !heap_ready())
+                return __libc_realloc(ptr, size);
+        return heap_realloc(ptr, size);
+}
+
+// vim:fenc=utf-8:tw=75:et
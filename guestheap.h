@@ -0,0 +1,38 @@
+/*
+ * guestheap.h - preallocated guest heap
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef GUESTHEAP_H_
+#define GUESTHEAP_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define GUEST_HEAP_VERSION 1
+
+/* every vcpu's TSC_AUX holds its index, so rdtscp says which cpu we are */
+#define GUEST_HEAP_CPU_IDS 0x1
+
+/*
+ * The guest has no brk() or mmap(), so the host sets aside a region for
+ * it up front and fills this in (version last) before the guest runs.
+ * If version stays 0, there's no heap and the guest's allocations go to
+ * libc as usual.
+ */
+struct guest_heap {
+        uint32_t version;
+        uint32_t flags;
+        uint64_t base;
+        uint64_t size;
+};
+
+/* guest side */
+extern struct guest_heap guest_heap__;
+extern void *heap_malloc(size_t size);
+extern void heap_free(void *ptr);
+extern void *heap_calloc(size_t nmemb, size_t size);
+extern void *heap_realloc(void *ptr, size_t size);
+
+#endif /* !GUESTHEAP_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,253 @@
+/*
+ * guestirq.c - interrupts in the guest
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compiler.h"
+#include "guestirq.h"
+
+struct guest_irqs guest_irqs__ = { 0, };
+
+volatile uint64_t guest_irq_wakeups = 0;
+volatile uint64_t guest_timer_ticks = 0;
+
+#define MSR_IA32_APIC_BASE      0x1b
+#define APIC_BASE_EXTD          (1ul << 10)
+#define APIC_BASE_ENABLE        (1ul << 11)
+#define MSR_X2APIC_TPR          0x808
+#define MSR_X2APIC_EOI          0x80b
+#define MSR_X2APIC_SVR          0x80f
+#define MSR_X2APIC_LVT_TIMER    0x832
+#define MSR_X2APIC_TIMER_INIT   0x838
+#define MSR_X2APIC_TIMER_DIV    0x83e
+#define APIC_SVR_ENABLE         (1ul << 8)
+#define APIC_LVT_PERIODIC       (1ul << 17)
+#define APIC_TIMER_DIV_1        0xb
+
+#define GDT_CODE64              0x00af9a000000fffful
+#define SEL_CODE64              0x08
+
+/*
+ * Interrupts are only ever on inside guest_idle(), so the handlers don't
+ * have to save much: they count, EOI the x2apic, and go back.  Anything
+ * we didn't ask for is a fault, and there's no recovering from that, so
+ * it reports itself through the exit port and stops.
+ */
+extern void irq_wakeup_entry(void) hidden;
+extern void irq_timer_entry(void) hidden;
+extern void irq_spurious_entry(void) hidden;
+extern void irq_unexpected_entry(void) hidden;
+
+__asm__(
+"       .pushsection .text\n"
+"       .hidden irq_wakeup_entry, irq_timer_entry\n"
+"       .hidden irq_spurious_entry, irq_unexpected_entry\n"
+"       .globl irq_wakeup_entry, irq_timer_entry\n"
+"       .globl irq_spurious_entry, irq_unexpected_entry\n"
+"       .p2align 4\n"
+"irq_wakeup_entry:\n"
+"       lock incq guest_irq_wakeups(%rip)\n"
+"       jmp 1f\n"
+"       .p2align 4\n"
+"irq_timer_entry:\n"
+"       lock incq guest_timer_ticks(%rip)\n"
+"1:     pushq %rax\n"
+"       pushq %rcx\n"
+"       pushq %rdx\n"
+"       movl $0x80b, %ecx\n"
+"       xorl %eax, %eax\n"
+"       xorl %edx, %edx\n"
+"       wrmsr\n"
+"       popq %rdx\n"
+"       popq %rcx\n"
+"       popq %rax\n"
+"irq_spurious_entry:\n"
+"       iretq\n"
+"       .p2align 4\n"
+"irq_unexpected_entry:\n"
+"       movw $0x218, %dx\n"
+"       movl $0xff, %eax\n"
+"       outl %eax, %dx\n"
+"2:     hlt\n"
+"       jmp 2b\n"
+"       .popsection\n"
+);
+
+struct idt_gate {
+        uint16_t offset_lo;
+        uint16_t selector;
+        uint8_t ist;
+        uint8_t type;
+        uint16_t offset_mid;
+        uint32_t offset_hi;
+        uint32_t reserved;
+} packed;
+
+struct table_desc {
+        uint16_t limit;
+        uint64_t base;
+} packed;
+
+static uint64_t gdt[2] aligned(16) = { 0, GDT_CODE64 };
+static struct idt_gate idt[256] aligned(16);
+static int tables_state = 0;
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+        uint32_t lo, hi;
+
+        __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+        return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+        __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)val),
+                             "d"((uint32_t)(val >> 32)) : "memory");
+}
+
+static void
+set_gate(unsigned int vector, void (*handler)(void))
+{
+        uintptr_t addr = (uintptr_t)handler;
+
+        idt[vector].offset_lo = addr & 0xffff;
+        idt[vector].selector = SEL_CODE64;
+        idt[vector].ist = 0;
+        /* present, dpl 0, 64-bit interrupt gate */
+        idt[vector].type = 0x8e;
+        idt[vector].offset_mid = (addr >> 16) & 0xffff;
+        idt[vector].offset_hi = addr >> 32;
+        idt[vector].reserved = 0;
+}
+
+/*
+ * The first cpu here fills the tables in; the rest wait for it.
+ */
+static void
+build_tables(void)
+{
+        int expected = 0;
+
+        if (!__atomic_compare_exchange_n(&tables_state, &expected, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                while (__atomic_load_n(&tables_state, __ATOMIC_ACQUIRE) != 2)
+                        __asm__("pause");
+                return;
+        }
+
+        for (unsigned int i = 0; i < 256; i++)
+                set_gate(i, irq_unexpected_entry);
+        set_gate(GAOL_VECTOR_WAKEUP, irq_wakeup_entry);
+        set_gate(GAOL_VECTOR_TIMER, irq_timer_entry);
+        set_gate(GAOL_VECTOR_SPURIOUS, irq_spurious_entry);
+
+        __atomic_store_n(&tables_state, 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * The host leaves cs as a null selector with no gdt behind it, which
+ * works right up until an interrupt gate has to name a code segment.
+ * Only cs changes; the data segments and fs/gs are left as they are.
+ */
+static void noinline
+load_tables(void)
+{
+        struct table_desc gdtr = { sizeof(gdt) - 1, (uintptr_t)gdt };
+        struct table_desc idtr = { sizeof(idt) - 1, (uintptr_t)idt };
+
+        __asm__ __volatile__("lgdt %0" : : "m"(gdtr));
+        __asm__ __volatile__("lidt %0" : : "m"(idtr));
+        __asm__ __volatile__(
+                "pushq %[sel]\n"
+                "leaq 1f(%%rip), %%rax\n"
+                "pushq %%rax\n"
+                "lretq\n"
+                "1:\n"
+                : : [sel] "i"(SEL_CODE64) : "rax", "memory");
+}
+
+static bool
+have_x2apic(void)
+{
+        uint32_t eax = 1, ebx, ecx = 0, edx;
+
+        __asm__ __volatile__("cpuid"
+                             : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        return ecx & (1u << 21);
+}
+
+/*
+ * Every cpu that wants interrupts calls this once, with interrupts off,
+ * which they are from the start.
+ */
+int
+guest_irq_init(void)
+{
+        if (__atomic_load_n(&guest_irqs__.version, __ATOMIC_ACQUIRE) !=
+            GUEST_IRQS_VERSION)
+                return -1;
+
+        if (!have_x2apic())
+                return -1;
+
+        build_tables();
+        load_tables();
+
+        wrmsr(MSR_IA32_APIC_BASE, rdmsr(MSR_IA32_APIC_BASE) |
+                                  APIC_BASE_ENABLE | APIC_BASE_EXTD);
+        wrmsr(MSR_X2APIC_TPR, 0);
+        wrmsr(MSR_X2APIC_SVR, APIC_SVR_ENABLE | GAOL_VECTOR_SPURIOUS);
+        return 0;
+}
+
+/*
+ * Sleep until an interrupt comes.  Check for work with interrupts off,
+ * then call this: sti holds interrupts off for one more instruction, so
+ * one that arrives after the check still wakes the hlt.  The handler
+ * runs on our stack, so step past the red zone first.
+ */
+void
+guest_idle(void)
+{
+        __asm__ __volatile__(
+                "subq $128, %%rsp\n"
+                "sti\n"
+                "hlt\n"
+                "cli\n"
+                "addq $128, %%rsp\n"
+                : : : "memory");
+}
+
+int
+guest_timer_start(uint64_t period_ns)
+{
+        uint64_t count;
+
+        if (!guest_irqs__.lapic_timer_khz)
+                return -1;
+
+        count = period_ns * guest_irqs__.lapic_timer_khz / 1000000;
+        if (count == 0 || count > UINT32_MAX)
+                return -1;
+
+        wrmsr(MSR_X2APIC_TIMER_DIV, APIC_TIMER_DIV_1);
+        wrmsr(MSR_X2APIC_LVT_TIMER, APIC_LVT_PERIODIC | GAOL_VECTOR_TIMER);
+        wrmsr(MSR_X2APIC_TIMER_INIT, count);
+        return 0;
+}
+
+void
+guest_timer_stop(void)
+{
+        wrmsr(MSR_X2APIC_TIMER_INIT, 0);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,40 @@
+/*
+ * guestirq.h - interrupts in the guest
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef GUESTIRQ_H_
+#define GUESTIRQ_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#define GUEST_IRQS_VERSION 1
+
+/* what the host's wakeups come in on, and what the lapic timer uses */
+#define GAOL_VECTOR_WAKEUP      0x40
+#define GAOL_VECTOR_TIMER       0x41
+#define GAOL_VECTOR_SPURIOUS    0xff
+
+/*
+ * The host fills this in (version last) if the vm has an in-kernel
+ * lapic and a wakeup irqfd for each vcpu.  If version stays 0, there's
+ * nothing to wake the guest from HLT, and it has to spin.
+ */
+struct guest_irqs {
+        uint32_t version;
+        /* what the lapic timer's initial count counts in */
+        uint32_t lapic_timer_khz;
+};
+
+/* guest side */
+extern struct guest_irqs guest_irqs__;
+extern volatile uint64_t guest_irq_wakeups;
+extern volatile uint64_t guest_timer_ticks;
+extern int guest_irq_init(void);
+extern void guest_idle(void);
+extern int guest_timer_start(uint64_t period_ns);
+extern void guest_timer_stop(void);
+
+#endif /* !GUESTIRQ_H_ */
+// vim:fenc=utf-8:tw=75:et
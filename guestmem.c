@@ -0,0 +1,127 @@
+/*
+ * guestmem.c - memfd-backed guest ram
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gaol.h"
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+#define HUGE_PAGE_SIZE PD_SIZE
+
+/*
+ * Rather than letting the guest alias our own heap and data pages, all
+ * the writable memory we give it can instead come out of one memfd.
+ * That's something another process can map (an out-of-process i/o
+ * helper, say), that can be cloned with MAP_PRIVATE, and that can be
+ * backed by hugetlbfs without caring where each region came from.
+ */
+int hidden
+guest_ram_init(struct context *ctx)
+{
+        unsigned int flags = MFD_CLOEXEC|MFD_ALLOW_SEALING;
+
+        if (!ctx->options.memfd)
+                return 0;
+
+        if (ctx->options.memfd_hugetlb)
+                flags |= MFD_HUGETLB;
+
+        ctx->guest_memfd = memfd_create("gaol-guest-ram", flags);
+        if (ctx->guest_memfd < 0) {
+                warn("memfd_create() failed");
+                return -1;
+        }
+        ctx->guest_memfd_size = 0;
+
+        return 0;
+}
+
+static size_t
+guest_ram_granule(struct context *ctx)
+{
+        return ctx->options.memfd_hugetlb ? HUGE_PAGE_SIZE : PAGE_SIZE;
+}
+
+/*
+ * Grow the memfd by size bytes (rounded up to the page size it's backed
+ * by) and map the new part.  *mapped is how much actually got mapped,
+ * which is what has to be passed to munmap() later.
+ */
+hidden void *
+guest_ram_alloc(struct context *ctx, size_t size, off_t *offset,
+                size_t *mapped)
+{
+        size_t granule = guest_ram_granule(ctx);
+        size_t len = ALIGN_UP(size, granule);
+        off_t off = ctx->guest_memfd_size;
+        void *addr;
+        int rc;
+
+        if (ctx->guest_memfd < 0) {
+                errno = EBADF;
+                return NULL;
+        }
+
+        rc = ftruncate(ctx->guest_memfd, off + len);
+        if (rc < 0) {
+                warn("Could not grow guest ram to 0x%lx bytes", off + len);
+                return NULL;
+        }
+
+        addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
+                    ctx->guest_memfd, off);
+        if (addr == MAP_FAILED) {
+                warn("Could not map guest ram at offset 0x%lx", off);
+                ftruncate(ctx->guest_memfd, off);
+                return NULL;
+        }
+
+        ctx->guest_memfd_size += len;
+        *offset = off;
+        *mapped = len;
+        return addr;
+}
+
+/*
+ * Once the layout is done nobody gets to change the size, so anybody we
+ * hand the fd to can trust what they map.
+ */
+int hidden
+guest_ram_seal(struct context *ctx)
+{
+        int rc;
+
+        if (ctx->guest_memfd < 0 || !ctx->options.memfd_seal)
+                return 0;
+
+        rc = fcntl(ctx->guest_memfd, F_ADD_SEALS,
+                   F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+        if (rc < 0) {
+                warn("Could not seal guest ram");
+                return -1;
+        }
+
+        return 0;
+}
+
+void hidden
+guest_ram_free(struct context *ctx)
+{
+        if (ctx->guest_memfd >= 0)
+                close(ctx->guest_memfd);
+        ctx->guest_memfd = -1;
+        ctx->guest_memfd_size = 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
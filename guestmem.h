@@ -0,0 +1,21 @@
+/*
+ * guestmem.h - memfd-backed guest ram
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef GUESTMEM_H_
+#define GUESTMEM_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct context;
+
+extern int guest_ram_init(struct context *ctx) hidden;
+extern void *guest_ram_alloc(struct context *ctx, size_t size,
+                             off_t *offset, size_t *mapped) hidden;
+extern int guest_ram_seal(struct context *ctx) hidden;
+extern void guest_ram_free(struct context *ctx) hidden;
+
+#endif /* !GUESTMEM_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,575 @@
+/*
+ * hibernate.c - compress idle guests' memory out of the way
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include <linux/userfaultfd.h>
+
+#include "gaol.h"
+
+/*
+ * When a guest has been idle long enough, every private writable page
+ * it owns is compressed into memory we keep here, and the host pages
+ * behind it are released.  The regions are then registered with
+ * userfaultfd, so when the guest runs again each page is decompressed
+ * back into place the first time anything (the vcpu or us) touches it.
+ * If userfaultfd isn't available, everything is restored before the
+ * next KVM_RUN instead.
+ */
+
+#define PAGE_RESTORED UINT32_MAX
+#define RESTORE_TRIES 3
+
+struct hibernated_region {
+        uintptr_t hva;
+        size_t npages;
+        /* compressed size, 0 for a zero page, or PAGE_RESTORED */
+        uint32_t *sizes;
+        uint8_t **pages;
+};
+
+struct hibernation {
+        int nregions;
+        struct hibernated_region *regions;
+        unsigned long pages_left;
+
+        pthread_mutex_t lock;
+        int uffd;
+        pthread_t thread;
+        bool thread_running;
+        volatile bool stop;
+};
+
+static bool
+should_hibernate_map(struct context *ctx, struct proc_map *map)
+{
+        return map->user_pages &&
+               (map->mode & M_W_OK) &&
+               !map->shared &&
+               map != ctx->free_page_reports_map &&
+               map != ctx->guest_clock_map;
+}
+
+static int
+release_region(struct proc_map *map, void *hva, size_t size)
+{
+        void *new;
+
+        /* see release_guest_range() */
+        if (map->memfd)
+                return madvise(hva, size, MADV_REMOVE);
+        if (map->ino) {
+                new = mmap(hva, size, PROT_READ|PROT_WRITE,
+                           MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                return new == MAP_FAILED ? -1 : 0;
+        }
+        return madvise(hva, size, MADV_DONTNEED);
+}
+
+static int
+compress_region(struct context *ctx, struct hibernated_region *region)
+{
+        static const uint8_t zeroes[PAGE_SIZE];
+        uLongf bound = compressBound(PAGE_SIZE);
+        uint8_t buf[bound];
+
+        region->sizes = calloc(region->npages, sizeof(*region->sizes));
+        region->pages = calloc(region->npages, sizeof(*region->pages));
+        if (!region->sizes || !region->pages)
+                return -1;
+
+        for (size_t i = 0; i < region->npages; i++) {
+                uint8_t *page = (uint8_t *)region->hva + i * PAGE_SIZE;
+                uLongf len = bound;
+                int rc;
+
+                ctx->hibernate_stats.bytes_in += PAGE_SIZE;
+                if (!memcmp(page, zeroes, PAGE_SIZE)) {
+                        ctx->hibernate_stats.zero_pages += 1;
+                        continue;
+                }
+
+                rc = compress2(buf, &len, page, PAGE_SIZE, Z_BEST_SPEED);
+                if (rc != Z_OK) {
+                        warnx("compress2() failed: %d", rc);
+                        return -1;
+                }
+
+                region->pages[i] = malloc(len);
+                if (!region->pages[i])
+                        return -1;
+                memcpy(region->pages[i], buf, len);
+                region->sizes[i] = len;
+                ctx->hibernate_stats.bytes_out += len;
+        }
+
+        return 0;
+}
+
+static void
+free_regions(struct hibernation *h)
+{
+        for (int i = 0; i < h->nregions; i++) {
+                struct hibernated_region *region = &h->regions[i];
+
+                for (size_t j = 0; region->pages && j < region->npages; j++)
+                        free(region->pages[j]);
+                free(region->pages);
+                free(region->sizes);
+        }
+        free(h->regions);
+        h->regions = NULL;
+        h->nregions = 0;
+}
+
+/*
+ * Put one page back.  With uffd set the page is still missing and has
+ * to be installed atomically with UFFDIO_COPY; otherwise nothing can be
+ * touching it and we just write it.
+ */
+static int
+restore_page(struct context *ctx, struct hibernated_region *region,
+             size_t i, int uffd)
+{
+        struct hibernation *h = ctx->hibernation;
+        uint8_t buf[PAGE_SIZE] aligned(PAGE_SIZE);
+        uintptr_t hva = region->hva + i * PAGE_SIZE;
+        uint64_t t0 = monotonic_ns(), dt;
+        int rc;
+
+        if (region->sizes[i] == PAGE_RESTORED)
+                return 0;
+
+        if (region->sizes[i] == 0) {
+                memset(buf, 0, sizeof(buf));
+        } else {
+                uLongf len = PAGE_SIZE;
+
+                rc = uncompress(buf, &len, region->pages[i],
+                                region->sizes[i]);
+                if (rc != Z_OK || len != PAGE_SIZE) {
+                        warnx("uncompress() failed: %d", rc);
+                        return -1;
+                }
+        }
+
+        if (uffd >= 0) {
+                struct uffdio_copy copy = {
+                        .dst = hva,
+                        .src = (uintptr_t)buf,
+                        .len = PAGE_SIZE,
+                        .mode = 0,
+                };
+
+                rc = ioctl(uffd, UFFDIO_COPY, &copy);
+                if (rc < 0 && errno != EEXIST) {
+                        warn("UFFDIO_COPY to %p failed", (void *)hva);
+                        return -1;
+                }
+        } else {
+                memcpy((void *)hva, buf, PAGE_SIZE);
+        }
+
+        free(region->pages[i]);
+        region->pages[i] = NULL;
+        region->sizes[i] = PAGE_RESTORED;
+        __atomic_sub_fetch(&h->pages_left, 1, __ATOMIC_RELEASE);
+
+        dt = monotonic_ns() - t0;
+        ctx->hibernate_stats.pages_restored += 1;
+        ctx->hibernate_stats.restore_ns += dt;
+        if (dt > ctx->hibernate_stats.restore_max_ns)
+                ctx->hibernate_stats.restore_max_ns = dt;
+
+        return 0;
+}
+
+static int
+restore_addr(struct context *ctx, uintptr_t addr, int uffd)
+{
+        struct hibernation *h = ctx->hibernation;
+
+        addr &= ~PAGE_MASK;
+        for (int i = 0; i < h->nregions; i++) {
+                struct hibernated_region *region = &h->regions[i];
+
+                if (addr < region->hva ||
+                    addr >= region->hva + region->npages * PAGE_SIZE)
+                        continue;
+
+                return restore_page(ctx, region,
+                                    (addr - region->hva) / PAGE_SIZE, uffd);
+        }
+
+        errno = EFAULT;
+        return -1;
+}
+
+/*
+ * The guest's page is gone for good, so the vm is too.  Whoever faulted
+ * is stuck until something fills the page in, so we do fill it, but only
+ * after every vcpu has been told to stop and kicked: KVM sees the signal
+ * before it goes back into the guest, and the vcpu sees restore_failed
+ * when it comes out, so nothing ever runs on the zeroes.
+ */
+static void
+fail_restore(struct context *ctx, uintptr_t addr)
+{
+        struct hibernation *h = ctx->hibernation;
+        struct uffdio_zeropage zp = {
+                .range.start = addr & ~PAGE_MASK,
+                .range.len = PAGE_SIZE,
+        };
+
+        if (!__atomic_exchange_n(&ctx->restore_failed, true,
+                                 __ATOMIC_ACQ_REL)) {
+                warnx("Could not restore guest page %p, stopping vm",
+                      (void *)addr);
+                for (unsigned int i = 0; i < ctx->nvcpus; i++)
+                        kick_vcpu(&ctx->vcpus[i]);
+        }
+
+        ioctl(h->uffd, UFFDIO_ZEROPAGE, &zp);
+}
+
+static void *
+uffd_thread(void *arg)
+{
+        struct context *ctx = arg;
+        struct hibernation *h = ctx->hibernation;
+
+        while (!h->stop &&
+               __atomic_load_n(&h->pages_left, __ATOMIC_ACQUIRE)) {
+                struct pollfd pfd = { .fd = h->uffd, .events = POLLIN };
+                struct uffd_msg msg;
+                ssize_t sz;
+                int rc;
+
+                rc = poll(&pfd, 1, 100);
+                if (rc <= 0)
+                        continue;
+
+                sz = read(h->uffd, &msg, sizeof(msg));
+                if (sz != sizeof(msg))
+                        continue;
+                if (msg.event != UFFD_EVENT_PAGEFAULT)
+                        continue;
+
+                if (__atomic_load_n(&ctx->restore_failed, __ATOMIC_ACQUIRE)) {
+                        fail_restore(ctx, msg.arg.pagefault.address);
+                        continue;
+                }
+
+                pthread_mutex_lock(&h->lock);
+                for (int tries = 0; tries < RESTORE_TRIES; tries++) {
+                        rc = restore_addr(ctx, msg.arg.pagefault.address,
+                                          h->uffd);
+                        if (rc >= 0)
+                                break;
+                }
+                pthread_mutex_unlock(&h->lock);
+                if (rc < 0)
+                        fail_restore(ctx, msg.arg.pagefault.address);
+        }
+
+        return NULL;
+}
+
+static int
+register_uffd(struct context *ctx)
+{
+        struct hibernation *h = ctx->hibernation;
+        struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+        int rc;
+
+        h->uffd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK);
+        if (h->uffd < 0)
+                goto err;
+
+        rc = ioctl(h->uffd, UFFDIO_API, &api);
+        if (rc < 0)
+                goto err;
+
+        for (int i = 0; i < h->nregions; i++) {
+                struct uffdio_register reg = {
+                        .range.start = h->regions[i].hva,
+                        .range.len = h->regions[i].npages * PAGE_SIZE,
+                        .mode = UFFDIO_REGISTER_MODE_MISSING,
+                };
+
+                rc = ioctl(h->uffd, UFFDIO_REGISTER, &reg);
+                if (rc < 0)
+                        goto err;
+        }
+
+        rc = pthread_create(&h->thread, NULL, uffd_thread, ctx);
+        if (rc != 0) {
+                errno = rc;
+                goto err;
+        }
+        h->thread_running = true;
+
+        return 0;
+err:
+        warn("userfaultfd unavailable, restoring eagerly");
+        if (h->uffd >= 0)
+                close(h->uffd);
+        h->uffd = -1;
+        errno = 0;
+        return -1;
+}
+
+int hidden
+hibernate_vm(struct context *ctx)
+{
+        struct hibernation *h;
+        struct list_head *pos;
+        uint64_t t0 = monotonic_ns();
+        int n = 0;
+        int rc;
+
+        if (ctx->hibernation)
+                return 0;
+
+        h = calloc(1, sizeof(*h));
+        if (!h) {
+                warn("Could not allocate hibernation record");
+                return -1;
+        }
+        h->uffd = -1;
+        pthread_mutex_init(&h->lock, NULL);
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+
+                if (should_hibernate_map(ctx, map))
+                        h->nregions += 1;
+        }
+
+        h->regions = calloc(h->nregions, sizeof(*h->regions));
+        if (!h->regions) {
+                warn("Could not allocate hibernation record");
+                free(h);
+                return -1;
+        }
+
+        ctx->hibernation = h;
+        ctx->hibernate_stats.bytes_in = 0;
+        ctx->hibernate_stats.bytes_out = 0;
+        ctx->hibernate_stats.zero_pages = 0;
+        ctx->hibernate_stats.pages_restored = 0;
+        ctx->hibernate_stats.restore_ns = 0;
+        ctx->hibernate_stats.restore_max_ns = 0;
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+                struct hibernated_region *region = &h->regions[n];
+
+                if (!should_hibernate_map(ctx, map))
+                        continue;
+
+                region->hva = map->kumr.userspace_addr;
+                region->npages = map->kumr.memory_size / PAGE_SIZE;
+                rc = compress_region(ctx, region);
+                if (rc < 0)
+                        goto err;
+                h->pages_left += region->npages;
+                n += 1;
+        }
+
+        /*
+         * Only once everything is safely compressed do we start
+         * throwing pages away.
+         */
+        n = 0;
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+                struct hibernated_region *region = &h->regions[n];
+
+                if (!should_hibernate_map(ctx, map))
+                        continue;
+
+                rc = release_region(map, (void *)region->hva,
+                                    region->npages * PAGE_SIZE);
+                if (rc < 0) {
+                        warn("Could not release guest pages at %p",
+                             (void *)region->hva);
+                        /* what we did release has to come back */
+                        restore_vm(ctx);
+                        return -1;
+                }
+                ksm_mark_mergeable(ctx, region->hva,
+                                   region->npages * PAGE_SIZE);
+                n += 1;
+        }
+
+        ctx->hibernate_stats.lazy = register_uffd(ctx) >= 0;
+        ctx->hibernate_stats.hibernations += 1;
+        ctx->hibernate_stats.hibernate_ns = monotonic_ns() - t0;
+
+        printf("hibernated: 0x%zx bytes -> 0x%zx bytes (%lu zero pages) in %"PRIu64"ns\n",
+               ctx->hibernate_stats.bytes_in, ctx->hibernate_stats.bytes_out,
+               ctx->hibernate_stats.zero_pages,
+               ctx->hibernate_stats.hibernate_ns);
+        return 0;
+err:
+        free_regions(h);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+        ctx->hibernation = NULL;
+        return -1;
+}
+
+/*
+ * Only with the boot vcpu out of KVM_RUN, and on the thread that runs it.
+ */
+int hidden
+maybe_hibernate_vm(struct context *ctx)
+{
+        uint64_t idle_ns;
+
+        if (!ctx->options.hibernate_idle_ms || ctx->hibernation ||
+            !ctx->idle_since_ns)
+                return 0;
+
+        /*
+         * Secondary vcpus run on their own threads, and we'd lose
+         * anything they wrote between compressing a page and releasing
+         * it.
+         */
+        if (ctx->nvcpus > 1)
+                return 0;
+
+        idle_ns = monotonic_ns() - ctx->idle_since_ns;
+        if (idle_ns < ctx->options.hibernate_idle_ms * 1000000ul)
+                return 0;
+
+        return hibernate_vm(ctx);
+}
+
+/*
+ * Call after every KVM_RUN of the boot vcpu that we're resuming from.  A
+ * real exit means the guest is doing something.  Being knocked out of
+ * KVM_RUN by a signal with the vcpu halted means it's been sitting in
+ * HLT, at least since the last time we looked, and if that's been going
+ * on long enough, now's when it can hibernate.
+ */
+void hidden
+check_vcpu_idle(struct vcpu *vcpu)
+{
+        struct context *ctx = vcpu->ctx;
+
+        if (vcpu->id != 0 || !ctx->options.hibernate_idle_ms)
+                return;
+
+        if (vcpu->run->exit_reason != KVM_EXIT_INTR || !vcpu_halted(vcpu)) {
+                ctx->idle_since_ns = 0;
+                return;
+        }
+
+        if (!ctx->idle_since_ns) {
+                ctx->idle_since_ns = monotonic_ns();
+                return;
+        }
+
+        maybe_hibernate_vm(ctx);
+}
+
+void hidden
+free_hibernation(struct context *ctx)
+{
+        struct hibernation *h = ctx->hibernation;
+
+        if (!h)
+                return;
+
+        if (h->thread_running) {
+                h->stop = true;
+                pthread_join(h->thread, NULL);
+                h->thread_running = false;
+        }
+
+        if (h->uffd >= 0) {
+                for (int i = 0; i < h->nregions; i++) {
+                        struct uffdio_range range = {
+                                .start = h->regions[i].hva,
+                                .len = h->regions[i].npages * PAGE_SIZE,
+                        };
+                        ioctl(h->uffd, UFFDIO_UNREGISTER, &range);
+                }
+                close(h->uffd);
+        }
+
+        free_regions(h);
+        pthread_mutex_destroy(&h->lock);
+        free(h);
+        ctx->hibernation = NULL;
+}
+
+/*
+ * Called before every KVM_RUN.  If the uffd thread is handling it this
+ * just cleans up once it's done; otherwise it puts everything back now.
+ */
+int hidden
+restore_vm(struct context *ctx)
+{
+        struct hibernation *h = ctx->hibernation;
+        int rc = 0;
+
+        if (!h)
+                return 0;
+
+        if (__atomic_load_n(&ctx->restore_failed, __ATOMIC_ACQUIRE))
+                return -1;
+
+        if (h->uffd >= 0 && __atomic_load_n(&h->pages_left, __ATOMIC_ACQUIRE))
+                return 0;
+
+        pthread_mutex_lock(&h->lock);
+        for (int i = 0; i < h->nregions && rc >= 0; i++) {
+                struct hibernated_region *region = &h->regions[i];
+
+                if (!region->sizes)
+                        continue;
+                for (size_t j = 0; j < region->npages && rc >= 0; j++)
+                        rc = restore_page(ctx, region, j, h->uffd);
+        }
+        pthread_mutex_unlock(&h->lock);
+
+        if (rc < 0) {
+                __atomic_store_n(&ctx->restore_failed, true, __ATOMIC_RELEASE);
+                return rc;
+        }
+
+        free_hibernation(ctx);
+        return 0;
+}
+
+void hidden
+print_hibernate_stats(struct context *ctx)
+{
+        struct hibernate_stats *hs = &ctx->hibernate_stats;
+
+        if (!hs->hibernations)
+                return;
+
+        printf("hibernate: %lu times, last took %"PRIu64"ns, ratio %zu:%zu (%lu zero pages)\n",
+               hs->hibernations, hs->hibernate_ns,
+               hs->bytes_in, hs->bytes_out, hs->zero_pages);
+        printf("restore: %s, %lu pages, %"PRIu64"ns total, %"PRIu64"ns max\n",
+               hs->lazy ? "lazy" : "eager", hs->pages_restored,
+               hs->restore_ns, hs->restore_max_ns);
+}
+
+// vim:fenc=utf-8:tw=75:et
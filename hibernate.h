@@ -0,0 +1,53 @@
+/*
+ * hibernate.h - compress idle guests' memory out of the way
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef HIBERNATE_H_
+#define HIBERNATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct context;
+struct vcpu;
+
+struct hibernate_stats {
+        unsigned long hibernations;
+        /* the last hibernation */
+        uint64_t hibernate_ns;
+        size_t bytes_in;
+        size_t bytes_out;
+        unsigned long zero_pages;
+        /* restoring the last hibernation */
+        unsigned long pages_restored;
+        uint64_t restore_ns;
+        uint64_t restore_max_ns;
+        bool lazy;
+};
+
+extern int hibernate_vm(struct context *ctx) hidden;
+extern int maybe_hibernate_vm(struct context *ctx) hidden;
+extern void check_vcpu_idle(struct vcpu *vcpu) hidden;
+extern int restore_vm(struct context *ctx) hidden;
+extern void free_hibernation(struct context *ctx) hidden;
+extern void print_hibernate_stats(struct context *ctx) hidden;
+
+static inline uint64_t unused
+timespec_ns(const struct timespec *ts)
+{
+        return (uint64_t)ts->tv_sec * 1000000000ul + ts->tv_nsec;
+}
+
+static inline uint64_t unused
+monotonic_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return timespec_ns(&ts);
+}
+
+#endif /* !HIBERNATE_H_ */
+// vim:fenc=utf-8:tw=75:et
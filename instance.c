@@ -0,0 +1,371 @@
+/*
+ * instance.c - several copies of the guest in one vm
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+static bool
+is_vcpu_stack(struct context *ctx, struct proc_map *map)
+{
+        for (unsigned int i = 0; i < ctx->nvcpus; i++)
+                if (map == ctx->vcpus[i].stack_map)
+                        return true;
+        return false;
+}
+
+/*
+ * What every instance needs its own copy of.  The host reads the free
+ * page report page, so that one stays shared (and gaol won't have
+ * instances report free pages at all), as does anything another vm
+ * might be looking at.  Stacks are each vcpu's own already; see
+ * isolate_stacks().
+ */
+static bool
+is_private_map(struct context *ctx, struct proc_map *map)
+{
+        return map->user_pages &&
+               (map->mode & M_W_OK) &&
+               map->kumr.memory_size &&
+               !map->shared &&
+               map != ctx->free_page_reports_map &&
+               !is_vcpu_stack(ctx, map);
+}
+
+static unsigned long
+spans(uintptr_t start, uintptr_t end, unsigned long size)
+{
+        return (end - 1) / size - start / size + 1;
+}
+
+static unsigned long
+count_map_tables(struct proc_map *map)
+{
+        return spans(map->start, map->end, PML4_SIZE) +
+               spans(map->start, map->end, PDP_SIZE) +
+               spans(map->start, map->end, PD_SIZE);
+}
+
+/*
+ * The most tables remapping [start, end) can take: every PDP, PD, and
+ * PT that covers some of it, as if no two maps shared any.  That's for
+ * every private map, and every vcpu's stack, which each instance either
+ * unmaps or keeps a path of its own to.
+ */
+static unsigned long
+count_tables(struct context *ctx, unsigned long *nmaps)
+{
+        unsigned long n = 1;
+        struct list_head *pos;
+
+        *nmaps = 0;
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+
+                if (!is_private_map(ctx, map))
+                        continue;
+
+                n += count_map_tables(map);
+                *nmaps += 1;
+        }
+
+        for (unsigned int i = 0; i < ctx->nvcpus; i++)
+                n += count_map_tables(ctx->vcpus[i].stack_map);
+
+        return n;
+}
+
+/*
+ * table is instance 0's, or one we've already copied; either way, give
+ * back one this instance can change.  Instance 0 changes its own in
+ * place, once everybody else has their copies.
+ */
+static page_table_t *
+own_table(struct instance *inst, void *table)
+{
+        page_table_t *t = table;
+
+        if (!inst->tables)
+                return t;
+        if (t >= inst->tables && t < inst->tables + inst->used_tables)
+                return t;
+
+        if (inst->used_tables == inst->ntables) {
+                warnx("instance %u ran out of page tables", inst->id);
+                return NULL;
+        }
+
+        t = &inst->tables[inst->used_tables++];
+        memcpy(t, table, sizeof(*t));
+        return t;
+}
+
+/*
+ * The pte for va, in a pt this instance owns, copying whatever tables on
+ * the way down are still instance 0's.
+ */
+static pte_t *
+own_pte(struct context *ctx, struct instance *inst, uintptr_t va)
+{
+        pml4e_t *pml4e = &inst->pml4[get_pml4e(va)];
+        page_table_t *pdp, *pd, *pt;
+        pdpe_t *pdpe;
+        pde_t *pde;
+
+        if (!pml4e->p)
+                goto unmapped;
+        pdp = own_table(inst, table_hva(ctx, pml4e->pdp_base));
+        if (!pdp)
+                return NULL;
+        pml4e->pdp_base = table_pfn(ctx, pdp);
+
+        pdpe = &pdp->pdp[get_pdpe(va)];
+        if (!pdpe->p)
+                goto unmapped;
+        if (pdpe->ps)
+                goto large;
+        pd = own_table(inst, table_hva(ctx, pdpe->pd_base));
+        if (!pd)
+                return NULL;
+        pdpe->pd_base = table_pfn(ctx, pd);
+
+        pde = &pd->pd[get_pde(va)];
+        if (!pde->p)
+                goto unmapped;
+        if (pde->ps)
+                goto large;
+        pt = own_table(inst, table_hva(ctx, pde->pt_base));
+        if (!pt)
+                return NULL;
+        pde->pt_base = table_pfn(ctx, pt);
+
+        if (!pt->pt[get_pte(va)].p)
+                goto unmapped;
+        return &pt->pt[get_pte(va)];
+
+unmapped:
+        warnx("instance %u: 0x%016lx isn't mapped in instance 0", inst->id,
+              va);
+        return NULL;
+large:
+        warnx("instance %u: 0x%016lx is in a large page", inst->id, va);
+        return NULL;
+}
+
+static int
+remap_page(struct context *ctx, struct instance *inst, uintptr_t va,
+           uint64_t gpa)
+{
+        pte_t *pte = own_pte(ctx, inst, va);
+
+        if (!pte)
+                return -1;
+        pte->page_base = ptr64_to_pfn40(gpa);
+        return 0;
+}
+
+/*
+ * Every instance's tables start out as copies of instance 0's, which map
+ * every vcpu's stack, but an instance mustn't be able to see, let alone
+ * scribble on, anybody else's.  Unmap the others' and make sure the
+ * path to our own is ours, so that instance 0 can unmap the rest in its
+ * tables afterwards without taking them away from anybody.
+ */
+static int
+isolate_stacks(struct context *ctx, struct instance *inst)
+{
+        for (unsigned int i = 0; i < ctx->nvcpus; i++) {
+                struct proc_map *map = ctx->vcpus[i].stack_map;
+
+                for (uintptr_t va = map->start; va < map->end;
+                     va += PAGE_SIZE) {
+                        pte_t *pte = own_pte(ctx, inst, va);
+
+                        if (!pte)
+                                return -1;
+                        if (i != inst->id)
+                                pte->p = 0;
+                }
+        }
+
+        return 0;
+}
+
+static int
+copy_map(struct context *ctx, struct instance *inst, struct proc_map *map)
+{
+        size_t size = map->kumr.memory_size;
+        struct proc_map *copy;
+        char name[64];
+        int rc;
+
+        snprintf(name, sizeof(name), "[instance:%u]%s", inst->id, map->name);
+        copy = add_guest_ram(ctx, name, size, map->mode);
+        if (!copy)
+                return -1;
+
+        /* whatever the loader and constructors left there */
+        memcpy((void *)copy->kumr.userspace_addr,
+               (void *)map->kumr.userspace_addr, size);
+
+        for (size_t off = 0; off < size; off += PAGE_SIZE) {
+                rc = remap_page(ctx, inst, map->start + off,
+                                copy->kumr.guest_phys_addr + off);
+                if (rc < 0)
+                        return -1;
+        }
+
+        inst->private_bytes += size;
+        return 0;
+}
+
+static int
+init_instance(struct context *ctx, struct instance *inst,
+              struct proc_map **maps, unsigned long nmaps,
+              unsigned long ntables)
+{
+        struct proc_map *table_map;
+        struct kvm_sregs *sregs;
+        cr3_t *cr3;
+
+        table_map = calloc(1, sizeof(*table_map));
+        if (!table_map) {
+                warn("Could not allocate instance page table map");
+                return -1;
+        }
+        INIT_LIST_HEAD(&table_map->list);
+
+        /* like [pagetables], these come out of the pool already zeroed */
+        inst->tables = page_pool_alloc(PAGE_SIZE * ntables);
+        if (!inst->tables) {
+                warn("Could not allocate instance %u page tables", inst->id);
+                free(table_map);
+                return -1;
+        }
+        inst->ntables = ntables;
+        table_map->pooled = PAGE_SIZE * ntables;
+        table_map->kumr.userspace_addr = (uintptr_t)inst->tables;
+        list_add(&table_map->list, &ctx->guest_maps);
+        inst->table_map = table_map;
+        if (add_page_table_memslot(ctx, table_map, inst->tables,
+                                   PAGE_SIZE * ntables) < 0)
+                return -1;
+
+        inst->pml4 = own_table(inst, ctx->guest_pml4)->pml4;
+
+        for (unsigned long i = 0; i < nmaps; i++) {
+                if (copy_map(ctx, inst, maps[i]) < 0)
+                        return -1;
+        }
+        if (isolate_stacks(ctx, inst) < 0)
+                return -1;
+
+        sregs = get_vcpu_sregs(&ctx->vcpus[inst->id]);
+        if (!sregs)
+                return -1;
+        cr3 = (cr3_t *)&sregs->cr3;
+        cr3->pml4_base = table_pfn(ctx, inst->pml4);
+        dirty_vcpu_sregs(&ctx->vcpus[inst->id]);
+
+        printf("instance %u: %u page tables, 0x%zx private bytes\n",
+               inst->id, inst->used_tables, inst->private_bytes);
+        return 0;
+}
+
+/*
+ * After finalize_paging() and prepare_aps(), and before anything runs,
+ * so every instance starts from the same image instance 0 does.
+ */
+int hidden
+init_instances(struct context *ctx)
+{
+        unsigned int n = ctx->options.instances;
+        unsigned long ntables, nmaps, i = 0;
+        struct proc_map **maps;
+        struct list_head *pos;
+        int rc = 0;
+
+        if (n < 2)
+                return 0;
+
+        ctx->instances = calloc(n, sizeof(*ctx->instances));
+        if (!ctx->instances) {
+                warn("Could not allocate instances");
+                return -1;
+        }
+        ctx->ninstances = n;
+        for (unsigned int j = 0; j < n; j++)
+                ctx->instances[j].id = j;
+        ctx->instances[0].pml4 = ctx->guest_pml4;
+
+        ntables = count_tables(ctx, &nmaps);
+        printf("instances: %u, %lu writable maps each, up to %lu tables\n",
+               n, nmaps, ntables);
+
+        /*
+         * The copies go on guest_maps too, and mustn't get copied
+         * themselves, so take the list of originals first.
+         */
+        maps = calloc(nmaps ? nmaps : 1, sizeof(*maps));
+        if (!maps) {
+                warn("Could not allocate instance map list");
+                return -1;
+        }
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+
+                if (is_private_map(ctx, map))
+                        maps[i++] = map;
+        }
+
+        for (unsigned int j = 1; j < n && rc == 0; j++)
+                rc = init_instance(ctx, &ctx->instances[j], maps, nmaps,
+                                   ntables);
+        if (rc == 0)
+                rc = isolate_stacks(ctx, &ctx->instances[0]);
+
+        free(maps);
+        return rc;
+}
+
+void hidden
+instance_exited(struct context *ctx, unsigned int id, int status)
+{
+        if (id >= ctx->ninstances)
+                return;
+
+        ctx->instances[id].status = status;
+        ctx->instances[id].exited = true;
+}
+
+void hidden
+free_instances(struct context *ctx)
+{
+        unsigned int exited = 0, failed = 0;
+
+        if (!ctx->instances)
+                return;
+
+        for (unsigned int i = 0; i < ctx->ninstances; i++) {
+                if (!ctx->instances[i].exited)
+                        continue;
+                exited += 1;
+                if (ctx->instances[i].status != 0)
+                        failed += 1;
+        }
+        printf("instances: %u of %u exited, %u with nonzero status\n",
+               exited, ctx->ninstances, failed);
+
+        /* the tables and copies themselves go with the maps */
+        free(ctx->instances);
+        ctx->instances = NULL;
+        ctx->ninstances = 0;
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,46 @@
+/*
+ * instance.h - several copies of the guest in one vm
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef INSTANCE_H_
+#define INSTANCE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct context;
+struct proc_map;
+
+/*
+ * With --instances=<n>, vcpu i runs its own copy of the guest from main().
+ * Everything read-only (text, rodata, the clock page) is the same memory
+ * for all of them; every writable region except the vcpu stacks, which
+ * are already per-vcpu, gets a private copy at a gpa of its own, and each
+ * instance gets its own page tables that map its copies at the same
+ * virtual addresses instance 0 has the originals at.  Only the paths
+ * down to those pages are copied; everything else in the tree is
+ * instance 0's.
+ */
+struct instance {
+        unsigned int id;
+        pml4e_t *pml4;
+
+        /* tables we've copied for this instance, from one pool block */
+        page_table_t *tables;
+        unsigned int ntables;
+        unsigned int used_tables;
+        struct proc_map *table_map;
+
+        size_t private_bytes;
+        int status;
+        bool exited;
+};
+
+extern int init_instances(struct context *ctx) hidden;
+extern void instance_exited(struct context *ctx, unsigned int id,
+                            int status) hidden;
+extern void free_instances(struct context *ctx) hidden;
+
+#endif /* !INSTANCE_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -8,7 +8,6 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <unistd.h>
 #include <stdio.h>
 
 #include "gaol.h"
@@ -17,6 +16,15 @@ typedef struct ioring ioring;
 
 struct iorings *iorings__ = NULL;
 
+static void
+init_ring(ioring *ring)
+{
+        ring->mask = IORING_SIZE - 1;
+        ring->head = ring->head_cache = 0;
+        ring->tail = ring->tail_cache = 0;
+        __atomic_store_n(&ring->version, IORING_VERSION, __ATOMIC_RELEASE);
+}
+
 int
 ioring_map_rings(void)
 {
@@ -35,50 +43,66 @@ ioring_map_rings(void)
         printf("parent &iorings__: %p iorings__: %p\n", &iorings__, iorings__);
         //dump_maps("parent");
 
+        init_ring(&iorings__->one);
+        init_ring(&iorings__->two);
         iorings__->input = &iorings__->one;
         iorings__->output = &iorings__->two;
 
-        msync(iorings__, sizeof(*iorings__), MS_ASYNC|MS_INVALIDATE);
-
         printf("parent: input: %p output: %p\n", iorings__->input, iorings__->output);
 
         return 0;
 }
 
-static void
-stall(uint64_t n)
+static struct ioring *
+get_ring(struct ioring *ring)
 {
-        for (uint64_t x = 0; x < n; x++)
-                __asm__("pause");
+        if (!ring) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (__atomic_load_n(&ring->version, __ATOMIC_ACQUIRE) !=
+            IORING_VERSION) {
+                errno = EPROTO;
+                return NULL;
+        }
+
+        return ring;
 }
 
+/*
+ * All of size goes in or none of it does; callers spin on -ENOSPC until
+ * the other side makes room.
+ */
 int
 ioring_write(const char * const buf, size_t size)
 {
-        uint16_t start;
+        uint32_t head, tail, off, first;
         ioring *output;
 
-        if (!iorings__ || !iorings__->output) {
-                errno = EINVAL;
+        if (!iorings__ || !(output = get_ring(iorings__->output)))
+                return -1;
+
+        if (size > IORING_SIZE) {
+                errno = EMSGSIZE;
                 return -1;
         }
 
-        output = iorings__->output;
-        /*
-         * yes yes, this spinlock isn't real. just need something that
-         * mostly works and is static, for now
-         */
-        while (output->lock)
-                stall(1000);
-        output->lock = 1;
-        msync(output, sizeof(*output), MS_ASYNC|MS_INVALIDATE);
-
-        start = output->size;
-        if (sizeof(output->buf) - start > size)
-                return -ENOSPC;
-        memcpy(output->buf + output->size, buf, size);
-        output->size += size;
-        output->lock = 0;
+        tail = output->tail;
+        head = output->head_cache;
+        if (IORING_SIZE - (tail - head) < size) {
+                head = __atomic_load_n(&output->head, __ATOMIC_ACQUIRE);
+                output->head_cache = head;
+                if (IORING_SIZE - (tail - head) < size)
+                        return -ENOSPC;
+        }
+
+        off = tail & output->mask;
+        first = min(size, IORING_SIZE - off);
+        memcpy(output->buf + off, buf, first);
+        memcpy(output->buf, buf + first, size - first);
+
+        __atomic_store_n(&output->tail, tail + size, __ATOMIC_RELEASE);
 
         return size;
 }
@@ -86,28 +110,28 @@ ioring_write(const char * const buf, size_t size)
 int
 ioring_read(char * const buf, size_t size)
 {
-        uint16_t bytes;
+        uint32_t head, tail, off, first, bytes;
         ioring *input;
 
-        if (!iorings__ || !iorings__->input) {
-                errno = EINVAL;
+        if (!iorings__ || !(input = get_ring(iorings__->input)))
                 return -1;
+
+        head = input->head;
+        tail = input->tail_cache;
+        if (tail == head) {
+                tail = __atomic_load_n(&input->tail, __ATOMIC_ACQUIRE);
+                input->tail_cache = tail;
+                if (tail == head)
+                        return 0;
         }
 
-        input = iorings__->input;
-        /*
-         * yes yes, this spinlock isn't real. just need something that
-         * mostly works and is static, for now
-         */
-        while (input->lock)
-                stall(1000);
-        input->lock = 1;
-
-        bytes = min(input->size, size);
-        memcpy(buf, input->buf, bytes);
-        memmove(input->buf, input->buf + bytes, sizeof(input->buf) - bytes);
-        input->size -= bytes;
-        input->lock = 0;
+        bytes = min(tail - head, size);
+        off = head & input->mask;
+        first = min(bytes, IORING_SIZE - off);
+        memcpy(buf, input->buf + off, first);
+        memcpy(buf + first, input->buf, bytes - first);
+
+        __atomic_store_n(&input->head, head + bytes, __ATOMIC_RELEASE);
 
         return bytes;
 }
@@ -12,11 +12,35 @@ extern int ioring_map_rings(void);
 extern int ioring_write(const char * const buf, size_t size);
 extern int ioring_read(char * const buf, size_t size);
 
+/*
+ * Each ring has exactly one writer and one reader, one of them on each
+ * side of the vm.  head and tail only ever count up and wrap at 2^32;
+ * the bytes in the ring are buf[head & mask] through buf[tail & mask].
+ * The writer owns tail and the reader owns head, and each keeps its own
+ * stale copy of the other's index so it only has to go look at the
+ * other cache line when the stale one says it's full or empty.
+ *
+ * The host fills in version and mask when it sets the rings up; a
+ * guest built against some other layout sees the wrong version and
+ * gets EPROTO rather than garbage.
+ */
+#define IORING_VERSION          2
+#define IORING_SIZE             4096
+#define IORING_CACHELINE        64
+
 struct ioring {
         uint32_t version;
-        uint16_t lock;
-        uint16_t size;
-        uint8_t buf[4096] aligned(4096);
+        uint32_t mask;
+
+        /* the writer's cache line */
+        uint32_t tail aligned(IORING_CACHELINE);
+        uint32_t head_cache;
+
+        /* the reader's cache line */
+        uint32_t head aligned(IORING_CACHELINE);
+        uint32_t tail_cache;
+
+        uint8_t buf[IORING_SIZE] aligned(4096);
 } aligned(4096);
 
 struct iorings {
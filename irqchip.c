@@ -0,0 +1,183 @@
+/*
+ * irqchip.c - kvm's in-kernel apic, and waking guests with it
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "gaol.h"
+
+/*
+ * This has to happen before any vcpus exist, so they get a lapic.
+ */
+int hidden
+create_irqchip(struct context *ctx)
+{
+        struct irqchip *chip = &ctx->irqchip;
+        struct kvm_enable_cap cap;
+        int rc;
+
+        memset(chip, 0, sizeof(*chip));
+        if (!ctx->options.irqchip)
+                return 0;
+
+        rc = vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_IRQFD);
+        if (rc <= 0 ||
+            vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_IRQ_ROUTING) <= 0) {
+                warnx("KVM can't route irqfds to msis");
+                return -1;
+        }
+
+        rc = vm_ioctl(ctx, KVM_CREATE_IRQCHIP, 0);
+        if (rc < 0) {
+                warn("Could not create the in-kernel irqchip");
+                return -1;
+        }
+        chip->enabled = true;
+
+        /*
+         * Without this, an msi can only name apic ids up to 255, which
+         * is all a vm of ours needs, but if we can have the x2apic's
+         * 32-bit ids, take them.
+         */
+        if (vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_X2APIC_API) > 0) {
+                memset(&cap, 0, sizeof(cap));
+                cap.cap = KVM_CAP_X2APIC_API;
+                cap.args[0] = KVM_X2APIC_API_USE_32BIT_IDS;
+                rc = vm_ioctl(ctx, KVM_ENABLE_CAP, &cap);
+                if (rc == 0)
+                        chip->x2apic_ids = true;
+        }
+
+        printf("irqchip: in-kernel lapic%s\n",
+               chip->x2apic_ids ? ", 32-bit x2apic ids" : "");
+        return 0;
+}
+
+/*
+ * Give every vcpu its msi route and wakeup eventfd.  This replaces kvm's
+ * default routing, so nothing goes to the pic or ioapic pins, but we
+ * don't give the guest any devices that would use them.
+ */
+int hidden
+init_irq_routes(struct context *ctx)
+{
+        struct irqchip *chip = &ctx->irqchip;
+        struct kvm_irq_routing *routing;
+        unsigned int n = ctx->nvcpus;
+        int rc = -1;
+
+        if (!chip->enabled)
+                return 0;
+
+        routing = calloc(1, sizeof(*routing) + n * sizeof(routing->entries[0]));
+        chip->fds = calloc(n, sizeof(*chip->fds));
+        if (!routing || !chip->fds) {
+                warn("Could not allocate irq routes");
+                goto err;
+        }
+        for (unsigned int i = 0; i < n; i++)
+                chip->fds[i] = -1;
+        chip->nfds = n;
+
+        routing->nr = n;
+        for (unsigned int i = 0; i < n; i++) {
+                struct kvm_irq_routing_entry *e = &routing->entries[i];
+                uint32_t apic_id = i;
+
+                e->gsi = IRQCHIP_GSI_BASE + i;
+                e->type = KVM_IRQ_ROUTING_MSI;
+                /* fixed delivery, physical destination, edge */
+                e->u.msi.address_lo = 0xfee00000 | ((apic_id & 0xff) << 12);
+                if (chip->x2apic_ids)
+                        e->u.msi.address_hi = apic_id & 0xffffff00;
+                e->u.msi.data = GAOL_VECTOR_WAKEUP;
+        }
+
+        rc = vm_ioctl(ctx, KVM_SET_GSI_ROUTING, routing);
+        if (rc < 0) {
+                warn("Could not set msi routes");
+                goto err;
+        }
+
+        for (unsigned int i = 0; i < n; i++) {
+                struct kvm_irqfd irqfd;
+
+                chip->fds[i] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+                if (chip->fds[i] < 0) {
+                        warn("Could not create vcpu %u's wakeup eventfd", i);
+                        rc = -1;
+                        goto err;
+                }
+
+                memset(&irqfd, 0, sizeof(irqfd));
+                irqfd.fd = chip->fds[i];
+                irqfd.gsi = IRQCHIP_GSI_BASE + i;
+                rc = vm_ioctl(ctx, KVM_IRQFD, &irqfd);
+                if (rc < 0) {
+                        warn("Could not attach vcpu %u's wakeup irqfd", i);
+                        goto err;
+                }
+        }
+
+        printf("irqchip: %u wakeup irqfds at gsi %u, vector 0x%x\n",
+               n, IRQCHIP_GSI_BASE, GAOL_VECTOR_WAKEUP);
+        free(routing);
+        return 0;
+err:
+        free(routing);
+        return -1;
+}
+
+/*
+ * Interrupt the guest on one vcpu, out of HLT if that's where it is, and
+ * put it back on a run queue if it's parked.  Without an irqchip there's
+ * no interrupt to send, but a vcpu parked on a HLT exit still wakes.
+ * This doesn't need the vcpu's thread, so it's safe from any thread, but
+ * not from a signal handler.
+ */
+int hidden
+signal_guest(struct context *ctx, unsigned int vcpu)
+{
+        struct irqchip *chip = &ctx->irqchip;
+        uint64_t one = 1;
+
+        if (vcpu >= ctx->nvcpus) {
+                errno = ENODEV;
+                return -1;
+        }
+
+        if (vcpu < chip->nfds && chip->fds[vcpu] >= 0) {
+                if (write(chip->fds[vcpu], &one, sizeof(one)) != sizeof(one) &&
+                    errno != EAGAIN)
+                        return -1;
+                __atomic_add_fetch(&chip->signals, 1, __ATOMIC_RELAXED);
+        }
+
+        wake_vcpu(&ctx->vcpus[vcpu]);
+        return 0;
+}
+
+void hidden
+free_irqchip(struct context *ctx)
+{
+        struct irqchip *chip = &ctx->irqchip;
+
+        if (!chip->enabled)
+                return;
+
+        printf("irqchip: %lu wakeups signalled\n", chip->signals);
+        for (unsigned int i = 0; i < chip->nfds; i++) {
+                if (chip->fds[i] >= 0)
+                        close(chip->fds[i]);
+        }
+        free(chip->fds);
+        memset(chip, 0, sizeof(*chip));
+}
+
+// vim:fenc=utf-8:tw=75:et
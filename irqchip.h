@@ -0,0 +1,41 @@
+/*
+ * irqchip.h - kvm's in-kernel apic, and waking guests with it
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef IRQCHIP_H_
+#define IRQCHIP_H_
+
+#include <stdbool.h>
+
+struct context;
+
+/*
+ * With the in-kernel lapic, a guest HLT blocks in KVM_RUN instead of
+ * coming back to us, until something interrupts it.  Each vcpu gets an
+ * eventfd wired by KVM_IRQFD to an msi route that delivers
+ * GAOL_VECTOR_WAKEUP to that vcpu's apic; writing it is all it takes to
+ * wake the guest.  Our routes are all past the ioapic's pins.
+ *
+ * Nothing calls signal_guest() yet: the host side of the guest's input
+ * ring isn't hooked up, so a guest that sleeps waiting for input stays
+ * asleep until the vm is stopped.
+ */
+#define IRQCHIP_GSI_BASE 24
+
+struct irqchip {
+        bool enabled;
+        bool x2apic_ids;
+        unsigned int nfds;
+        int *fds;
+
+        unsigned long signals;
+};
+
+extern int create_irqchip(struct context *ctx) hidden;
+extern int init_irq_routes(struct context *ctx) hidden;
+extern int signal_guest(struct context *ctx, unsigned int vcpu) hidden;
+extern void free_irqchip(struct context *ctx) hidden;
+
+#endif /* !IRQCHIP_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,156 @@
+/*
+ * ksm.c - kernel samepage merging for guest memory
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "gaol.h"
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+
+/*
+ * Lots of guests running the same binary wind up with byte-identical
+ * data segments, GOTs, and zeroed stacks.  In density mode we tell the
+ * kernel it may merge those, trading some ksmd cpu time for memory.
+ */
+int hidden
+ksm_enable(struct context *ctx)
+{
+        uint8_t *buf = NULL;
+        size_t bufsize = 0;
+        int fd;
+        int rc;
+
+        if (!ctx->options.ksm)
+                return 0;
+
+        fd = open("/sys/kernel/mm/ksm/run", O_RDONLY);
+        if (fd >= 0) {
+                rc = read_file(fd, &buf, &bufsize);
+                close(fd);
+                if (rc >= 0 && buf[0] != '1')
+                        warnx("ksmd is not running; nothing will be merged");
+                free(buf);
+        }
+
+        /*
+         * Newer kernels can mark every anonymous vma in the process,
+         * including ones we create later, in one go.  If that's not
+         * there we just madvise() the guest regions as we make them.
+         */
+        rc = prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0);
+        if (rc < 0) {
+                if (errno != EINVAL)
+                        warn("prctl(PR_SET_MEMORY_MERGE) failed");
+                errno = 0;
+        } else {
+                ctx->ksm_merge_any = true;
+        }
+
+        return 0;
+}
+
+int hidden
+ksm_mark_mergeable(struct context *ctx, uintptr_t addr, size_t size)
+{
+        uintptr_t start = PAGE_ALIGN_UP(addr);
+        uintptr_t end = PAGE_ALIGN_DOWN(addr + size);
+        int rc;
+
+        if (!ctx->options.ksm || end <= start)
+                return 0;
+
+        rc = madvise((void *)start, end - start, MADV_MERGEABLE);
+        if (rc < 0) {
+                warn("madvise(%p, 0x%lx, MADV_MERGEABLE) failed",
+                     (void *)start, end - start);
+                return -1;
+        }
+
+        ctx->ksm_bytes += end - start;
+        return 0;
+}
+
+int hidden
+ksm_get_stats(struct ksm_stats *stats)
+{
+        uint8_t *buf = NULL;
+        size_t bufsize = 0;
+        char *line, *saveptr = NULL;
+        int fd;
+        int rc;
+
+        memset(stats, 0, sizeof(*stats));
+
+        fd = open("/proc/self/ksm_stat", O_RDONLY);
+        if (fd < 0)
+                return -1;
+
+        rc = read_file(fd, &buf, &bufsize);
+        close(fd);
+        if (rc < 0)
+                return -1;
+
+        for (line = strtok_r((char *)buf, "\n", &saveptr);
+             line != NULL;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                sscanf(line, "ksm_rmap_items %ld", &stats->rmap_items);
+                sscanf(line, "ksm_zero_pages %ld", &stats->zero_pages);
+                sscanf(line, "ksm_merging_pages %ld", &stats->merging_pages);
+                sscanf(line, "ksm_process_profit %ld", &stats->process_profit);
+                if (!strcmp(line, "ksm_merge_any: yes"))
+                        stats->merge_any = true;
+                if (!strcmp(line, "ksm_mergeable: yes"))
+                        stats->mergeable = true;
+        }
+
+        free(buf);
+        return 0;
+}
+
+/*
+ * What this vm asked ksm to look at.  What got merged is only counted
+ * per process, see ksm_print_process_stats().
+ */
+void hidden
+ksm_print_stats(struct context *ctx)
+{
+        if (!ctx->options.ksm)
+                return;
+
+        printf("ksm: 0x%zx bytes mergeable%s\n", ctx->ksm_bytes,
+               ctx->ksm_merge_any ? " (merge_any)" : "");
+}
+
+/*
+ * ksm_stat is per process, so with vms side by side there's no telling
+ * whose pages are whose; these are the totals for all of them, once,
+ * when they're all done.
+ */
+void hidden
+ksm_print_process_stats(void)
+{
+        struct ksm_stats stats;
+        int rc;
+
+        rc = ksm_get_stats(&stats);
+        if (rc < 0) {
+                printf("ksm: no /proc/self/ksm_stat\n");
+                errno = 0;
+                return;
+        }
+
+        printf("ksm (whole process): %ld pages merged, %ld zero pages, profit %ld bytes\n",
+               stats.merging_pages, stats.zero_pages, stats.process_profit);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,29 @@
+/*
+ * ksm.h - kernel samepage merging for guest memory
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef KSM_H_
+#define KSM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ksm_stats {
+        long rmap_items;
+        long zero_pages;
+        long merging_pages;
+        long process_profit;
+        bool merge_any;
+        bool mergeable;
+};
+
+extern int ksm_enable(struct context *ctx) hidden;
+extern int ksm_mark_mergeable(struct context *ctx,
+                              uintptr_t addr, size_t size) hidden;
+extern int ksm_get_stats(struct ksm_stats *stats) hidden;
+extern void ksm_print_stats(struct context *ctx) hidden;
+extern void ksm_print_process_stats(void) hidden;
+
+#endif /* !KSM_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,172 @@
+/*
+ * memstats.c - per-vm memory accounting
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gaol.h"
+
+static const char * const region_names[] = {
+        [MEM_REGION_TEXT] = "text",
+        [MEM_REGION_DATA] = "data",
+        [MEM_REGION_STACK] = "stack",
+        [MEM_REGION_HEAP] = "heap",
+        [MEM_REGION_PAGE_TABLES] = "pagetables",
+};
+
+/*
+ * What kind of memory a guest map is, for picking its memory type and
+ * for accounting.
+ */
+int hidden
+guest_map_region(struct context *ctx, struct proc_map *map)
+{
+        if (map == ctx->stack_map)
+                return MEM_REGION_STACK;
+        for (unsigned int i = 1; i < ctx->nvcpus; i++)
+                if (map == ctx->vcpus[i].stack_map)
+                        return MEM_REGION_STACK;
+        if (map == ctx->heap_map)
+                return MEM_REGION_HEAP;
+        if (map == ctx->page_table_map || map->page_tables)
+                return MEM_REGION_PAGE_TABLES;
+        if (map->mode & M_W_OK)
+                return MEM_REGION_DATA;
+        return MEM_REGION_TEXT;
+}
+
+/*
+ * How much of [addr, addr+size) is in memory right now.  vec is grown
+ * as needed and reused across calls.
+ */
+static ssize_t
+resident_bytes(uintptr_t addr, size_t size, unsigned char **vec,
+               size_t *vecsize)
+{
+        size_t npages = N_PAGES(size);
+        size_t resident = 0;
+        int rc;
+
+        if (npages > *vecsize) {
+                unsigned char *newvec = realloc(*vec, npages);
+
+                if (!newvec)
+                        return -1;
+                *vec = newvec;
+                *vecsize = npages;
+        }
+
+        rc = mincore((void *)PAGE_ALIGN_DOWN(addr), size, *vec);
+        if (rc < 0)
+                return -1;
+
+        for (size_t i = 0; i < npages; i++)
+                if ((*vec)[i] & 1)
+                        resident += PAGE_SIZE;
+        return resident;
+}
+
+int hidden
+get_vm_memory_stats(struct context *ctx, struct vm_memory_stats *stats)
+{
+        unsigned char *vec = NULL;
+        size_t vecsize = 0;
+        struct list_head *pos;
+
+        memset(stats, 0, sizeof(*stats));
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+                int region = guest_map_region(ctx, map);
+                uintptr_t addr = map->kumr.userspace_addr;
+                size_t size = map->kumr.memory_size;
+                ssize_t resident;
+
+                if (map->page_tables) {
+                        /* a memslot, but never in the guest's va space */
+                        size = map->pooled;
+                        stats->page_table_pages += size / PAGE_SIZE;
+                        stats->memslots += 1;
+                } else if (size == 0 || addr == 0) {
+                        continue;
+                } else {
+                        stats->memslots += 1;
+                }
+                if (!size)
+                        continue;
+
+                resident = resident_bytes(addr, size, &vec, &vecsize);
+                if (resident < 0) {
+                        warn("Could not get residency for %s", map->name);
+                        free(vec);
+                        return -1;
+                }
+
+                stats->mapped[region] += size;
+                stats->resident[region] += resident;
+                stats->mapped_bytes += size;
+                stats->resident_bytes += resident;
+                if (map->shared) {
+                        stats->shared_bytes += size;
+                        stats->shared_resident += resident;
+                } else {
+                        stats->private_bytes += size;
+                        stats->private_resident += resident;
+                }
+        }
+        free(vec);
+
+        stats->shared_page_table_pages = ctx->nshared_tables;
+        if (ctx->have_shared_pool_slot)
+                stats->memslots += 1;
+        stats->mapped[MEM_REGION_PAGE_TABLES] +=
+                ctx->nshared_tables * PAGE_SIZE;
+        stats->shared_bytes += ctx->nshared_tables * PAGE_SIZE;
+
+        stats->builder_table_pages = ctx->ntables;
+        stats->overhead_bytes = ctx->ntables * sizeof(page_table_list_t);
+        if (ctx->vcpu_mmap_size > 0)
+                stats->overhead_bytes += ctx->vcpu_mmap_size;
+        /* kvm's own pages, not ours, but they're there because we are */
+        stats->overhead_bytes += ctx->vm_tss.memory_size;
+        stats->overhead_bytes += ctx->vm_identity.memory_size;
+
+        return 0;
+}
+
+void hidden
+print_vm_memory_stats(struct context *ctx, const char * const when)
+{
+        struct vm_memory_stats stats;
+        int rc;
+
+        rc = get_vm_memory_stats(ctx, &stats);
+        if (rc < 0)
+                return;
+
+        printf("vm %d memory (%s): 0x%zx bytes mapped, 0x%zx resident in %u memslots\n",
+               ctx->pid, when, stats.mapped_bytes, stats.resident_bytes,
+               stats.memslots);
+        for (int i = 0; i < MEM_REGIONS; i++) {
+                if (!stats.mapped[i])
+                        continue;
+                printf("  %-10s 0x%zx bytes mapped, 0x%zx resident\n",
+                       region_names[i], stats.mapped[i], stats.resident[i]);
+        }
+        printf("  shared     0x%zx bytes mapped, 0x%zx resident\n",
+               stats.shared_bytes, stats.shared_resident);
+        printf("  private    0x%zx bytes mapped, 0x%zx resident\n",
+               stats.private_bytes, stats.private_resident);
+        printf("  page tables: %u private %u shared pages, %u builder pages\n",
+               stats.page_table_pages, stats.shared_page_table_pages,
+               stats.builder_table_pages);
+        printf("  overhead   0x%zx bytes\n", stats.overhead_bytes);
+}
+
+// vim:fenc=utf-8:tw=75:et
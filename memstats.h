@@ -0,0 +1,45 @@
+/*
+ * memstats.h - per-vm memory accounting
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef MEMSTATS_H_
+#define MEMSTATS_H_
+
+#include <stddef.h>
+
+struct context;
+struct proc_map;
+
+struct vm_memory_stats {
+        /* guest memory, by the kind of region it is */
+        size_t mapped[MEM_REGIONS];
+        size_t resident[MEM_REGIONS];
+        size_t mapped_bytes;
+        size_t resident_bytes;
+
+        /* memslot bytes backed by pages other vms also use, or not */
+        size_t shared_bytes;
+        size_t private_bytes;
+        size_t shared_resident;
+        size_t private_resident;
+
+        unsigned int memslots;
+
+        /* what the guest walks, and our builder's copy */
+        unsigned int page_table_pages;
+        unsigned int shared_page_table_pages;
+        unsigned int builder_table_pages;
+
+        /* kvm_run, the tss and identity map, and page table builders */
+        size_t overhead_bytes;
+};
+
+extern int guest_map_region(struct context *ctx, struct proc_map *map) hidden;
+extern int get_vm_memory_stats(struct context *ctx,
+                               struct vm_memory_stats *stats) hidden;
+extern void print_vm_memory_stats(struct context *ctx,
+                                  const char * const when) hidden;
+
+#endif /* !MEMSTATS_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -8,6 +8,7 @@
 
 #include <err.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 
@@ -297,7 +298,7 @@ dump_pte(pte_t *pte, uint16_t i, uint16_t j, uint16_t k, uint16_t l)
 }
 
 static void
-dump_pde(pde_t *pde, uint16_t i, uint16_t j, uint16_t k)
+dump_pde(struct context *ctx, pde_t *pde, uint16_t i, uint16_t j, uint16_t k)
 {
         intptr_t base;
 
@@ -308,9 +309,8 @@ dump_pde(pde_t *pde, uint16_t i, uint16_t j, uint16_t k)
         if (pde->ps) {
                 void *phys, *virt;
                 intptr_t ptr;
-                pde = (pde_t *)pfn30_to_ptr64(base);
                 printf("  pde[0x%03hx].ptr = 0x%lx = %p",
-                       (uint16_t)k, base, pde);
+                       (uint16_t)k, base, pfn30_to_ptr64(base));
 
                 virt = (void *)pde_to_addr(i, j, k, base);
                 phys = (void *)pfn30_to_ptr64(base);
@@ -327,13 +327,13 @@ dump_pde(pde_t *pde, uint16_t i, uint16_t j, uint16_t k)
                 return;
         }
 
-        pte_t *pd = pfn40_to_ptr64(base);
+        pte_t *pt = table_hva(ctx, base);
         for (uint16_t l = 0; l < 512; l++)
-                dump_pte(&pd[k], i, j, k, l);
+                dump_pte(&pt[l], i, j, k, l);
 }
 
 static void
-dump_pdpe(pdpe_t *pdpe, uint16_t i, uint16_t j)
+dump_pdpe(struct context *ctx, pdpe_t *pdpe, uint16_t i, uint16_t j)
 {
         intptr_t base;
 
@@ -344,9 +344,8 @@ dump_pdpe(pdpe_t *pdpe, uint16_t i, uint16_t j)
         if (pdpe->ps) {
                 void *phys, *virt;
                 intptr_t ptr;
-                pdpe = (pdpe_t *)pfn30_to_ptr64(base);
                 printf("  pdpe[0x%03hx].ptr = 0x%lx = %p %c%c%c",
-                       (uint16_t)j, base, pdpe,
+                       (uint16_t)j, base, pfn30_to_ptr64(base),
                        pdpe->nx ? '-' : 'x',
                        pdpe->us ? 'u' : 's',
                        pdpe->rw ? 'w' : 'r');
@@ -366,9 +365,8 @@ dump_pdpe(pdpe_t *pdpe, uint16_t i, uint16_t j)
                 return;
         } else {
                 void *phys, *virt;
-                pdpe = (pdpe_t *)pfn30_to_ptr64(base);
                 printf("  pdpe[0x%03hx].ptr = 0x%lx = %p %c%c%c",
-                       (uint16_t)j, base, pdpe,
+                       (uint16_t)j, base, pfn30_to_ptr64(base),
                        pdpe->nx ? '-' : 'x',
                        pdpe->us ? 'u' : 's',
                        pdpe->rw ? 'w' : 'r');
@@ -381,13 +379,13 @@ dump_pdpe(pdpe_t *pdpe, uint16_t i, uint16_t j)
                        pdpe->rw ? 'w' : 'r');
         }
 
-        pde_t *pd = pfn40_to_ptr64(base);
+        pde_t *pd = table_hva(ctx, base);
         for (uint16_t k = 0; k < 512; k++)
-                dump_pde(&pd[k], i, j, k);
+                dump_pde(ctx, &pd[k], i, j, k);
 }
 
 static void
-dump_pml4e(pml4e_t *pml4e, uint16_t i)
+dump_pml4e(struct context *ctx, pml4e_t *pml4e, uint16_t i)
 {
         pdpe_t *pdpe;
         intptr_t base;
@@ -396,29 +394,29 @@ dump_pml4e(pml4e_t *pml4e, uint16_t i)
                 return;
 
         base = pml4e->pdp_base;
-        pdpe = (pdpe_t *)pfn40_to_ptr64(base);
+        pdpe = (pdpe_t *)table_hva(ctx, base);
         printf(" pml4[0x%03hx].ptr = 0x%lx = %p %c%c%c\n", i, base, pdpe,
                pml4e->nx ? '-' : 'x',
                pml4e->us ? 'u' : 's',
                pml4e->rw ? 'w' : 'r');
 
         for (uint16_t j = 0; j < 512; j ++)
-                dump_pdpe(pdpe + j, i, j);
+                dump_pdpe(ctx, pdpe + j, i, j);
 }
 
 static void
-dump_pgtbls(cr3_t cr3)
+dump_pgtbls(struct context *ctx, cr3_t cr3)
 {
         pml4e_t *pml4;
         intptr_t base;
 
         printf("dumping page tables:\n");
         base = cr3.pml4_base;
-        pml4 = (pml4e_t *)pfn40_to_ptr64(base);
+        pml4 = (pml4e_t *)table_hva(ctx, base);
         printf("cr3.pml4_base = 0x%lx = %p\n", base, pml4);
 
         for (uint16_t i = 0; i < 512; i++)
-                dump_pml4e(pml4 + i, i);
+                dump_pml4e(ctx, pml4 + i, i);
 }
 
 static page_table_list_t *
@@ -444,6 +442,34 @@ new_page_table_list(struct context *ctx)
         return ret;
 }
 
+/*
+ * Make tables a memslot of the guest's, so entries that point into it
+ * (see table_pfn()) lead somewhere.  map stays out of the guest's own
+ * address space; it's just how the slot gets freed and counted.
+ */
+int private
+add_page_table_memslot(struct context *ctx, struct proc_map *map,
+                       void *tables, size_t size)
+{
+        int rc;
+
+        map->page_tables = true;
+        map->kumr.slot = ctx->kumr_slot++;
+        map->kumr.flags = 0;
+        map->kumr.guest_phys_addr = ctx->vm_phys_base + (uintptr_t)tables;
+        map->kumr.memory_size = size;
+        map->kumr.userspace_addr = (uintptr_t)tables;
+
+        rc = vm_ioctl(ctx, KVM_SET_USER_MEMORY_REGION, &map->kumr);
+        if (rc < 0) {
+                warn("Could not add page table memslot");
+                map->kumr.memory_size = 0;
+                return -1;
+        }
+
+        return 0;
+}
+
 int private
 init_paging(struct context *ctx)
 {
@@ -479,9 +505,20 @@ err:
         return -1;
 }
 
-int private nonnull(1)
-map_pt_entry(pte_t *pt, uintptr_t va,
-             bool nx, bool user, bool rw)
+/*
+ * What the walker fetches every level below cr3 as.  Non-leaf entries
+ * have no pat bit, so this only gets the first four PAT entries, which
+ * is all of our types anyway.
+ */
+static inline int
+page_table_mem_type(struct context *ctx)
+{
+        return ctx->options.mem_types[MEM_REGION_PAGE_TABLES];
+}
+
+int private nonnull(1, 2)
+map_pt_entry(struct context *ctx, pte_t *pt, uintptr_t va,
+             bool nx, bool user, bool rw, int mem_type)
 {
         pte_t *pte;
 
@@ -489,11 +526,14 @@ map_pt_entry(pte_t *pt, uintptr_t va,
                va & ~PAGE_MASK, get_pte(va));
         pte = &pt[get_pte(va)];
         if (!pte->p) {
-                pte->page_base = ptr64_to_pfn40(va);
+                /* the frame is where the memslot put it, not our va */
+                pte->page_base = ptr64_to_pfn40(ctx->vm_phys_base + va);
                 printf("        create PT[0x%03lx] (page_base:0x%lx nx:%d us:%d rw:%d)\n", get_pte(va), (uintptr_t)pte->page_base, nx, user, rw);
                 pte->nx = nx;
-                pte->pwt = pte->rw = rw;
+                pte->rw = rw;
                 pte->us = user;
+                set_mem_type(pte, mem_type);
+                pte->pat = (mem_type >> 2) & 1;
                 pte->p = 1;
         } else {
                 printf("        update PT[0x%03lx] (page_base:0x%lx nx:%d->%d us:%d->%d rw:%d->%d)\n", get_pte(va), (uintptr_t)pte->page_base, pte->nx, nx, pte->us, user, pte->rw, rw);
@@ -501,14 +541,18 @@ map_pt_entry(pte_t *pt, uintptr_t va,
                         printf("            Not changing permissions on PTE\n");
                         return -1;
                 }
+                if (mem_type != (get_mem_type(pte) | (pte->pat << 2))) {
+                        printf("            Not changing memory type on PTE\n");
+                        return -1;
+                }
         }
 
         return 0;
 }
 
-int private nonnull(1)
-map_pt_entries(pte_t *pt, uintptr_t va, size_t size,
-               bool nx, bool user, bool rw)
+int private nonnull(1, 2)
+map_pt_entries(struct context *ctx, pte_t *pt, uintptr_t va, size_t size,
+               bool nx, bool user, bool rw, int mem_type)
 {
         bool first = true;
         do {
@@ -529,7 +573,7 @@ map_pt_entries(pte_t *pt, uintptr_t va, size_t size,
                         fflush(stderr);
                 }
                 first = false;
-                rc = map_pt_entry(pt, va, nx, user, rw);
+                rc = map_pt_entry(ctx, pt, va, nx, user, rw, mem_type);
                 if (rc < 0)
                         return rc;
 
@@ -543,7 +587,7 @@ map_pt_entries(pte_t *pt, uintptr_t va, size_t size,
 int private nonnull(1, 2)
 map_pd_entry(struct context *ctx, pde_t *pd,
              uintptr_t va, size_t size,
-             bool nx, bool user, bool rw)
+             bool nx, bool user, bool rw, int mem_type)
 {
         pde_t *pde;
         pte_t *pt;
@@ -563,9 +607,13 @@ map_pd_entry(struct context *ctx, pde_t *pd,
                 pde->pt_base = ptr64_to_pfn40(&ptl->table.pt[0]);
                 printf("      create PD[0x%03lx] (pt_base:0x%lx nx:%d us:%d rw:%d)\n", get_pde(va), (uintptr_t)pde->pt_base, nx, user, rw);
                 pde->nx = nx;
-                pde->pwt = pde->rw = rw;
+                pde->rw = rw;
                 pde->us = user;
                 pde->ps = size == PD_SIZE;
+                if (pde->ps)
+                        set_mem_type(pde, mem_type);
+                else
+                        set_mem_type(pde, page_table_mem_type(ctx));
                 pde->p = 1;
         } else {
                 if (!nx && pde->nx)
@@ -586,13 +634,13 @@ map_pd_entry(struct context *ctx, pde_t *pd,
                 return 0;
 
         return 0;
-        return map_pt_entries(pt, va, size, nx, user, rw);
+        return map_pt_entries(ctx, pt, va, size, nx, user, rw, mem_type);
 }
 
 int private nonnull(1, 2)
 map_pd_entries(struct context *ctx, pde_t *pd,
                uintptr_t va, size_t size,
-               bool nx, bool user, bool rw)
+               bool nx, bool user, bool rw, int mem_type)
 {
         do {
                 int rc;
@@ -607,7 +655,7 @@ map_pd_entries(struct context *ctx, pde_t *pd,
 
                 rc = map_pd_entry(ctx, pd,
                                   va, min(size, rem),
-                                  nx, user, rw);
+                                  nx, user, rw, mem_type);
                 if (rc < 0)
                         return rc;
 
@@ -621,7 +669,7 @@ map_pd_entries(struct context *ctx, pde_t *pd,
 int private nonnull(1, 2)
 map_pdp_entry(struct context *ctx, pdpe_t *pdp,
               uintptr_t va, size_t size,
-              bool nx, bool user, bool rw)
+              bool nx, bool user, bool rw, int mem_type)
 {
         pdpe_t *pdpe;
         pde_t *pd;
@@ -641,9 +689,13 @@ map_pdp_entry(struct context *ctx, pdpe_t *pdp,
                 pdpe->pd_base = ptr64_to_pfn40(pd);
                 printf("    create PDP[0x%03lx] (pd_base:0x%lx nx:%d us:%d rw:%d)\n", get_pdpe(va), (uintptr_t)pdpe->pd_base, nx, user, rw);
                 pdpe->nx = nx;
-                pdpe->pwt = pdpe->rw = rw;
+                pdpe->rw = rw;
                 pdpe->us = user;
                 pdpe->ps = size == PDP_SIZE;
+                if (pdpe->ps)
+                        set_mem_type(pdpe, mem_type);
+                else
+                        set_mem_type(pdpe, page_table_mem_type(ctx));
                 pdpe->p = 1;
         } else {
                 if (!nx && pdpe->nx)
@@ -665,13 +717,13 @@ map_pdp_entry(struct context *ctx, pdpe_t *pdp,
                 return 0;
 
         return 0;
-        return map_pd_entries(ctx, pd, va, size, nx, user, rw);
+        return map_pd_entries(ctx, pd, va, size, nx, user, rw, mem_type);
 }
 
 int private nonnull(1, 2)
 map_pdp_entries(struct context *ctx, pdpe_t *pdp,
                 uintptr_t va, size_t size,
-                bool nx, bool user, bool rw)
+                bool nx, bool user, bool rw, int mem_type)
 {
         do {
                 int rc;
@@ -680,7 +732,7 @@ map_pdp_entries(struct context *ctx, pdpe_t *pdp,
 
                 rc = map_pdp_entry(ctx, pdp,
                                    va, min(size, rem),
-                                   nx, user, rw);
+                                   nx, user, rw, mem_type);
                 if (rc < 0)
                         return rc;
 
@@ -694,7 +746,7 @@ map_pdp_entries(struct context *ctx, pdpe_t *pdp,
 int private nonnull(1, 2)
 map_pml4_entry(struct context *ctx, pml4e_t *pml4,
                uintptr_t va, size_t size,
-               bool nx, bool user, bool rw)
+               bool nx, bool user, bool rw, int mem_type)
 {
         pml4e_t *pml4e;
         pdpe_t *pdp;
@@ -715,8 +767,9 @@ map_pml4_entry(struct context *ctx, pml4e_t *pml4,
                 pml4e->pdp_base = ptr64_to_pfn40(pdp);
                 printf("  create PML4[0x%03lx] (pdp_base:0x%lx nx:%d us:%d rw:%d)\n", get_pml4e(va), (uintptr_t)pml4e->pdp_base, nx, user, rw);
                 pml4e->nx = nx;
-                pml4e->pwt = pml4e->rw = rw;
+                pml4e->rw = rw;
                 pml4e->us = user;
+                set_mem_type(pml4e, page_table_mem_type(ctx));
                 pml4e->p = 1;
         } else {
                 pdp = pfn40_to_ptr64(pml4e->pdp_base);
@@ -741,13 +794,13 @@ map_pml4_entry(struct context *ctx, pml4e_t *pml4,
         }
 
         return 0;
-        return map_pdp_entries(ctx, pdp, va, size, nx, user, rw);
+        return map_pdp_entries(ctx, pdp, va, size, nx, user, rw, mem_type);
 }
 
 int private nonnull(1, 2)
 map_pml4_entries(struct context *ctx, pml4e_t *pml4,
                  uintptr_t va, size_t size,
-                 bool nx, bool user, bool rw)
+                 bool nx, bool user, bool rw, int mem_type)
 {
         do {
                 int rc;
@@ -765,7 +818,7 @@ map_pml4_entries(struct context *ctx, pml4e_t *pml4,
 
                 rc = map_pml4_entry(ctx, pml4,
                                     va, min(size, rem),
-                                    nx, user, rw);
+                                    nx, user, rw, mem_type);
                 if (rc < 0)
                         return rc;
 
@@ -779,7 +832,7 @@ map_pml4_entries(struct context *ctx, pml4e_t *pml4,
 int private nonnull(1)
 map_pages(struct context *ctx,
           uintptr_t va, size_t size,
-          bool nx, bool user, bool rw)
+          bool nx, bool user, bool rw, int mem_type)
 {
         page_table_list_t *pt;
         pml4e_t *pml4 = NULL;
@@ -790,7 +843,7 @@ map_pages(struct context *ctx,
         if (!pml4)
                 return -1;
 
-        printf("Mapping pages for 0x%016lx to 0x%016lx nx:%d us:%d rw:%d\n", va, va + size, nx, user, rw);
+        printf("Mapping pages for 0x%016lx to 0x%016lx nx:%d us:%d rw:%d mt:%s\n", va, va + size, nx, user, rw, mem_type_name(mem_type));
 
         int16_t prev_pml4e = -1;
         int16_t prev_pdpe = -1;
@@ -806,7 +859,7 @@ map_pages(struct context *ctx,
                 pml4e = get_pml4e(pgva);
                 if (pml4e != prev_pml4e) {
                         //printf("next pml4[0x%03hx]\n", pml4e);
-                        rc = map_pml4_entry(ctx, pml4, pgva, size, nx, user, rw);
+                        rc = map_pml4_entry(ctx, pml4, pgva, size, nx, user, rw, mem_type);
                         if (rc < 0)
                                 return rc;
                 }
@@ -815,7 +868,7 @@ map_pages(struct context *ctx,
                 pdp = (pdpe_t *)pfn40_to_ptr64(pml4[pml4e].pdp_base);
                 if (pdpe != prev_pdpe) {
                         //printf("  next pdp[0x%03hx]\n", pdpe);
-                        rc = map_pdp_entry(ctx, pdp, pgva, size, nx, user, rw);
+                        rc = map_pdp_entry(ctx, pdp, pgva, size, nx, user, rw, mem_type);
                         if (rc < 0)
                                 return rc;
                         if (size >= PDP_SIZE) {
@@ -829,7 +882,7 @@ map_pages(struct context *ctx,
                 pd = (pde_t *)pfn40_to_ptr64(pdp[pdpe].pd_base);
                 if (pde != prev_pde) {
                         //printf("    next pd[0x%03hx]\n", pde);
-                        rc = map_pd_entry(ctx, pd, pgva, size, nx, user, rw);
+                        rc = map_pd_entry(ctx, pd, pgva, size, nx, user, rw, mem_type);
                         if (rc < 0)
                                 return rc;
                         if (size >= PD_SIZE) {
@@ -843,7 +896,8 @@ map_pages(struct context *ctx,
                 pt = (pte_t *)pfn40_to_ptr64(pd[pde].pt_base);
                 if (pte != prev_pte) {
                         //printf("        next pt[0x%03hx]\n", pte);
-                        rc = map_pt_entry(pt, pgva, nx, user, rw);
+                        rc = map_pt_entry(ctx, pt, pgva, nx, user, rw,
+                                          mem_type);
                         if (rc < 0)
                                 return rc;
                         size -= PAGE_SIZE;
@@ -856,7 +910,381 @@ map_pages(struct context *ctx,
         }
 
         return 0;
-        return map_pml4_entries(ctx, pml4, va, size, nx, user, rw);
+        return map_pml4_entries(ctx, pml4, va, size, nx, user, rw, mem_type);
+}
+
+/*
+ * Paging structures shared between vms.  A PT whose present entries are
+ * all read-only, or a PD whose present entries are all read-only and
+ * refer only to such PTs, depends on nothing but the layout and
+ * permissions of the regions it maps, so it's looked up by content here
+ * and any vm with the same read-only regions at the same addresses
+ * points its PDEs/PDPEs at the same host page.
+ */
+struct shared_table {
+        page_table_t *table;
+        uint64_t hash;
+        int refcount;
+        list_t list;
+};
+
+#define SHARED_TABLE_BUCKETS 256
+static list_t shared_tables[SHARED_TABLE_BUCKETS];
+static bool shared_tables_ready = false;
+static pthread_mutex_t shared_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The shared tables all come out of one reservation, so a vm that uses
+ * any of them needs just the one memslot for all of them.  It's never
+ * moved or grown once it's there, since every such vm's slot points at
+ * it.  Pages nobody has touched cost nothing but address space.
+ */
+#define SHARED_TABLE_POOL_PAGES 8192
+static page_table_t *shared_pool;
+static uint32_t shared_pool_used;
+/* the free list: a freed table's index + 1, or 0 for empty */
+static uint32_t shared_pool_free;
+static uint32_t shared_pool_next[SHARED_TABLE_POOL_PAGES];
+
+static page_table_t *
+alloc_pool_table(void)
+{
+        uint32_t i;
+
+        if (!shared_pool) {
+                void *pool = mmap(NULL, SHARED_TABLE_POOL_PAGES * PAGE_SIZE,
+                                  PROT_READ|PROT_WRITE,
+                                  MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+                                  -1, 0);
+                if (pool == MAP_FAILED)
+                        return NULL;
+                shared_pool = pool;
+        }
+
+        if (shared_pool_free) {
+                i = shared_pool_free - 1;
+                shared_pool_free = shared_pool_next[i];
+                return &shared_pool[i];
+        }
+
+        if (shared_pool_used == SHARED_TABLE_POOL_PAGES) {
+                errno = ENOSPC;
+                return NULL;
+        }
+        return &shared_pool[shared_pool_used++];
+}
+
+static void
+free_pool_table(page_table_t *table)
+{
+        uint32_t i = table - shared_pool;
+
+        madvise(table, PAGE_SIZE, MADV_DONTNEED);
+        shared_pool_next[i] = shared_pool_free;
+        shared_pool_free = i + 1;
+}
+
+static uint64_t
+hash_table(const page_table_t *table)
+{
+        uint64_t hash = 0xcbf29ce484222325ul;
+
+        for (unsigned int i = 0; i < 512; i++) {
+                hash ^= table->data[i];
+                hash *= 0x100000001b3ul;
+        }
+        return hash;
+}
+
+static struct shared_table *
+get_shared_table(const page_table_t *table)
+{
+        struct shared_table *st = NULL;
+        struct list_head *pos;
+        page_table_t tmp;
+        uint64_t hash;
+        list_t *bucket;
+
+        /*
+         * Nobody may write to these once they're shared, so set the
+         * accessed bits up front rather than letting the guest's
+         * page walker try to.
+         */
+        memcpy(&tmp, table, sizeof(tmp));
+        for (unsigned int i = 0; i < 512; i++) {
+                if (tmp.pt[i].p)
+                        tmp.pt[i].a = 1;
+        }
+        hash = hash_table(&tmp);
+
+        pthread_mutex_lock(&shared_tables_lock);
+        if (!shared_tables_ready) {
+                for (unsigned int i = 0; i < SHARED_TABLE_BUCKETS; i++)
+                        INIT_LIST_HEAD(&shared_tables[i]);
+                shared_tables_ready = true;
+        }
+
+        bucket = &shared_tables[hash % SHARED_TABLE_BUCKETS];
+        list_for_each(pos, bucket) {
+                st = list_entry(pos, struct shared_table, list);
+                if (st->hash == hash &&
+                    !memcmp(st->table, &tmp, sizeof(tmp))) {
+                        st->refcount += 1;
+                        goto out;
+                }
+        }
+
+        st = calloc(1, sizeof(*st));
+        if (!st) {
+                warn("Could not allocate shared page table");
+                goto out;
+        }
+
+        st->table = alloc_pool_table();
+        if (!st->table) {
+                warn("Could not allocate shared page table");
+                free(st);
+                st = NULL;
+                goto out;
+        }
+        memcpy(st->table, &tmp, sizeof(tmp));
+
+        st->hash = hash;
+        st->refcount = 1;
+        list_add(&st->list, bucket);
+out:
+        pthread_mutex_unlock(&shared_tables_lock);
+        return st;
+}
+
+static void
+put_shared_table(struct shared_table *st)
+{
+        pthread_mutex_lock(&shared_tables_lock);
+        st->refcount -= 1;
+        if (st->refcount == 0) {
+                list_del(&st->list);
+                free_pool_table(st->table);
+                free(st);
+        }
+        pthread_mutex_unlock(&shared_tables_lock);
+}
+
+/*
+ * The pool gets one memslot in every vm that uses any of it, read-only,
+ * since it's everybody's.  The accessed bits are already set, so the
+ * walker has no reason to write to it.
+ */
+static int
+add_shared_pool_memslot(struct context *ctx)
+{
+        struct kvm_userspace_memory_region kumr = {
+                .slot = ctx->kumr_slot,
+                .flags = KVM_MEM_READONLY,
+                .guest_phys_addr = ctx->vm_phys_base + (uintptr_t)shared_pool,
+                .memory_size = SHARED_TABLE_POOL_PAGES * PAGE_SIZE,
+                .userspace_addr = (uintptr_t)shared_pool,
+        };
+        int rc;
+
+        if (ctx->have_shared_pool_slot)
+                return 0;
+
+        rc = vm_ioctl(ctx, KVM_SET_USER_MEMORY_REGION, &kumr);
+        if (rc < 0) {
+                warn("Could not add shared page table memslot");
+                return -1;
+        }
+
+        ctx->shared_pool_slot = ctx->kumr_slot++;
+        ctx->have_shared_pool_slot = true;
+        return 0;
+}
+
+static page_table_t *
+ref_shared_table(struct context *ctx, const page_table_t *table)
+{
+        struct shared_table **new, *st;
+
+        new = reallocarray(ctx->shared_tables, ctx->nshared_tables + 1,
+                           sizeof(*new));
+        if (!new) {
+                warn("Could not allocate shared page table list");
+                return NULL;
+        }
+        ctx->shared_tables = new;
+
+        st = get_shared_table(table);
+        if (!st)
+                return NULL;
+
+        if (add_shared_pool_memslot(ctx) < 0) {
+                put_shared_table(st);
+                return NULL;
+        }
+
+        ctx->shared_tables[ctx->nshared_tables++] = st;
+        return st->table;
+}
+
+void private
+put_shared_page_tables(struct context *ctx)
+{
+        /* the pages can be reused under the slot otherwise */
+        if (ctx->have_shared_pool_slot && ctx->vm >= 0) {
+                struct kvm_userspace_memory_region kumr = {
+                        .slot = ctx->shared_pool_slot,
+                        .memory_size = 0,
+                };
+
+                vm_ioctl(ctx, KVM_SET_USER_MEMORY_REGION, &kumr);
+        }
+        ctx->have_shared_pool_slot = false;
+
+        for (int i = 0; i < ctx->nshared_tables; i++)
+                put_shared_table(ctx->shared_tables[i]);
+
+        free(ctx->shared_tables);
+        ctx->shared_tables = NULL;
+        ctx->nshared_tables = 0;
+}
+
+static bool
+pt_is_shareable(const pte_t *pt)
+{
+        for (unsigned int i = 0; i < 512; i++) {
+                if (pt[i].p && pt[i].rw)
+                        return false;
+        }
+        return true;
+}
+
+static bool
+pd_is_shareable(const pde_t *pd)
+{
+        for (unsigned int i = 0; i < 512; i++) {
+                if (!pd[i].p)
+                        continue;
+                if (pd[i].rw)
+                        return false;
+                if (!pd[i].ps && !pt_is_shareable(pfn40_to_ptr64(pd[i].pt_base)))
+                        return false;
+        }
+        return true;
+}
+
+/*
+ * How many tables the finalized copy needs that aren't coming from the
+ * shared cache.
+ */
+static unsigned int
+count_private_tables(struct context *ctx)
+{
+        bool share = ctx->options.share_page_tables;
+        unsigned int n = 1;
+
+        for (uint16_t i = 0; i < 512; i++) {
+                pdpe_t *opdp;
+
+                if (!ctx->pml4[i].p)
+                        continue;
+
+                n += 1;
+                opdp = pfn40_to_ptr64(ctx->pml4[i].pdp_base);
+                for (uint16_t j = 0; j < 512; j++) {
+                        pde_t *opd;
+
+                        if (!opdp[j].p || opdp[j].ps)
+                                continue;
+
+                        opd = pfn40_to_ptr64(opdp[j].pd_base);
+                        if (share && pd_is_shareable(opd))
+                                continue;
+
+                        n += 1;
+                        for (uint16_t k = 0; k < 512; k++) {
+                                if (!opd[k].p || opd[k].ps)
+                                        continue;
+                                if (share && pt_is_shareable(pfn40_to_ptr64(opd[k].pt_base)))
+                                        continue;
+                                n += 1;
+                        }
+                }
+        }
+
+        return n;
+}
+
+static int
+copy_pd(struct context *ctx, pde_t *pd, const pde_t *opd,
+        page_table_t *tables, unsigned int *n)
+{
+        for (uint16_t k = 0; k < 512; k++) {
+                const pde_t *opde = &opd[k];
+                page_table_t *opt, *pt;
+
+                if (!opde->p)
+                        continue;
+
+                memcpy(&pd[k], opde, sizeof(*opde));
+                if (opde->ps)
+                        continue;
+
+                opt = pfn40_to_ptr64(opde->pt_base);
+                if (ctx->options.share_page_tables &&
+                    pt_is_shareable(opt->pt)) {
+                        pt = ref_shared_table(ctx, opt);
+                        if (!pt)
+                                return -1;
+                } else {
+                        pt = &tables[(*n)++];
+                        memcpy(pt, opt, sizeof(*pt));
+                }
+                pd[k].pt_base = table_pfn(ctx, pt);
+        }
+
+        return 0;
+}
+
+/*
+ * Which memory type a guest region gets: write-back unless the options
+ * say otherwise for its kind of region.
+ */
+static int
+map_mem_type(struct context *ctx, struct proc_map *map)
+{
+        return ctx->options.mem_types[guest_map_region(ctx, map)];
+}
+
+/*
+ * The PAT has to hold what our pat:pcd:pwt indices mean, rather than
+ * whatever the vcpu came up with.
+ */
+static int
+set_pat(struct context *ctx)
+{
+        struct {
+                struct kvm_msrs msrs;
+                struct kvm_msr_entry entries[1];
+        } msrs;
+        int rc;
+
+        memset(&msrs, 0, sizeof(msrs));
+        msrs.msrs.nmsrs = 1;
+        msrs.entries[0].index = MSR_IA32_CR_PAT;
+        msrs.entries[0].data = GAOL_PAT;
+
+        rc = vcpu_ioctl(ctx, KVM_SET_MSRS, &msrs);
+        if (rc < 0) {
+                warn("Could not set PAT");
+                return -1;
+        }
+        if (rc != 1) {
+                warnx("KVM did not take our PAT");
+                return -1;
+        }
+
+        return 0;
 }
 
 int private
@@ -867,9 +1295,9 @@ finalize_paging(struct context *ctx)
         struct list_head *this;
         page_table_t *tables = NULL;
         pml4e_t *pml4;
-        unsigned int n;
+        unsigned int n, ntables;
 
-        struct kvm_sregs sregs;
+        struct kvm_sregs *sregs;
         int rc;
 
         printf("Building page tables\n");
@@ -897,19 +1325,25 @@ finalize_paging(struct context *ctx)
                         continue;
                 rc = map_pages(ctx, map->start, map->end - map->start,
                                map->mode & M_X_OK, map->mode & M_R_OK,
-                               map->mode & M_W_OK);
+                               map->mode & M_W_OK, map_mem_type(ctx, map));
         }
         struct proc_map *map = list_entry(maps.prev, struct proc_map, list);
         free(map);
 
-        rc = posix_memalign((void **)&tables, PAGE_SIZE,
-                            PAGE_SIZE * ctx->ntables);
-        if (rc < 0) {
+        ntables = count_private_tables(ctx);
+        /* these come out of the pool already zeroed */
+        tables = page_pool_alloc(PAGE_SIZE * ntables);
+        if (!tables) {
                 warn("Could not allocate page tables");
                 goto err;
         }
-        memset(tables, 0, PAGE_SIZE * ctx->ntables);
+        ctx->page_table_map->pooled = PAGE_SIZE * ntables;
+        ksm_mark_mergeable(ctx, (uintptr_t)tables, PAGE_SIZE * ntables);
         ctx->page_table_map->kumr.userspace_addr = (uintptr_t)tables;
+        rc = add_page_table_memslot(ctx, ctx->page_table_map, tables,
+                                    PAGE_SIZE * ntables);
+        if (rc < 0)
+                goto err;
 
         n = 0;
         pml4 = tables[n++].pml4;
@@ -923,60 +1357,71 @@ finalize_paging(struct context *ctx)
                 memcpy(&pml4[i], opml4e, sizeof(*opml4e));
                 opdp = pfn40_to_ptr64(opml4e->pdp_base);
                 pdp = tables[n++].pdp;
-                pml4[i].pdp_base = ptr64_to_pfn40(pdp);
+                pml4[i].pdp_base = table_pfn(ctx, pdp);
 
                 for (uint16_t j = 0; j < 512; j++) {
-                        pde_t *opd, *pd;
+                        pde_t *opd;
                         pdpe_t *opdpe = &opdp[j];
 
                         if (!opdpe->p)
                                 continue;
 
                         memcpy(&pdp[j], opdpe, sizeof(*opdpe));
-                        opd = pfn40_to_ptr64(opdpe->pd_base);
-                        pd = tables[n++].pd;
-                        pdp[j].pd_base = ptr64_to_pfn40(pdp);
-
                         if (pdp[j].ps)
                                 continue;
 
-                        for (uint16_t k = 0; k < 512; k++) {
-                                pte_t *opt, *pt;
-                                pde_t *opde = &opd[k];
-
-                                if (!opde->p)
-                                        continue;
-
-                                memcpy(&pd[k], opde, sizeof(*opde));
-                                opt = pfn40_to_ptr64(opde->pt_base);
-                                pt = tables[n++].pt;
-                                pd[k].pt_base = ptr64_to_pfn40(pt);
-
-                                memcpy(pt, opt, sizeof(*opt));
+                        opd = pfn40_to_ptr64(opdpe->pd_base);
+                        if (ctx->options.share_page_tables &&
+                            pd_is_shareable(opd)) {
+                                page_table_t tmp;
+                                page_table_t *pd;
+
+                                memset(&tmp, 0, sizeof(tmp));
+                                rc = copy_pd(ctx, tmp.pd, opd, tables, &n);
+                                if (rc < 0)
+                                        goto err;
+                                pd = ref_shared_table(ctx, &tmp);
+                                if (!pd)
+                                        goto err;
+                                pdp[j].pd_base = table_pfn(ctx, pd);
+                        } else {
+                                pde_t *pd = tables[n++].pd;
+
+                                rc = copy_pd(ctx, pd, opd, tables, &n);
+                                if (rc < 0)
+                                        goto err;
+                                pdp[j].pd_base = table_pfn(ctx, pd);
                         }
                 }
         }
 
-        rc = vcpu_ioctl(ctx, KVM_GET_SREGS, &sregs);
-        if (rc < 0) {
-                warn("Could not get VCPU SREGS");
+        printf("page tables: %u private %d shared\n",
+               ntables, ctx->nshared_tables);
+
+        sregs = get_vcpu_sregs(&ctx->vcpus[0]);
+        if (!sregs)
                 goto err;
-        }
 
-        cr3_t *cr3 = (cr3_t *)&sregs.cr3;
-        cr3->pml4_base = ptr64_to_pfn40(ctx->pml4);
-        cr3->pwt = 1;
+        ctx->guest_pml4 = pml4;
+        guest_tlb_flush(ctx);
+
+        cr3_t *cr3 = (cr3_t *)&sregs->cr3;
+        cr3->pml4_base = table_pfn(ctx, pml4);
+        set_mem_type(cr3, page_table_mem_type(ctx));
 
-        dump_pgtbls(*cr3);
+        dump_pgtbls(ctx, *cr3);
 
-        cr4_t *cr4 = (cr4_t *)&sregs.cr4;
+        cr4_t *cr4 = (cr4_t *)&sregs->cr4;
         cr4->cr4 = 0;
         cr4->pae = 1;
         /* enable SSE instruction */
         cr4->osfxsr = 1;
         cr4->osxmmexcpt = 1;
+        /* and xsave, for AVX and up, if init_cpuid() turned any on */
+        if (ctx->xcr0)
+                cr4->osxsave = 1;
 
-        cr0_t *cr0 = (cr0_t *)&sregs.cr0;
+        cr0_t *cr0 = (cr0_t *)&sregs->cr0;
         cr0->cr0 = 0;
         cr0->pe = 1;
         cr0->mp = 1;
@@ -986,18 +1431,18 @@ finalize_paging(struct context *ctx)
         cr0->am = 1;
         cr0->pg = 1;
 
-        efer_t *efer = (efer_t *)&sregs.efer;
+        efer_t *efer = (efer_t *)&sregs->efer;
         efer->efer = 0;
         efer->lme = 1;
         efer->lma = 1;
         /* enable syscall instruction */
         /* efer->sce = 1; */
 
-        rc = vcpu_ioctl(ctx, KVM_SET_SREGS, &sregs);
-        if (rc < 0) {
-                warn("Could not set VCPU SREGS");
+        dirty_vcpu_sregs(&ctx->vcpus[0]);
+
+        rc = set_pat(ctx);
+        if (rc < 0)
                 goto err;
-        }
 
         return 0;
 err:
@@ -1018,32 +1463,25 @@ dump_sreg(const char * const name, struct kvm_segment sreg)
 
 int private
 init_segments(struct context *ctx) {
-        struct kvm_sregs sregs;
-        int rc;
+        struct kvm_sregs *sregs;
 
-        rc = vcpu_ioctl(ctx, KVM_GET_SREGS, &sregs);
-        if (rc < 0) {
-                warn("Could not get VCPU SREGS");
+        sregs = get_vcpu_sregs(&ctx->vcpus[0]);
+        if (!sregs)
                 goto err;
-        }
 
-        sregs.cs.base = sregs.cs.selector = 0;
+        sregs->cs.base = sregs->cs.selector = 0;
 
-        dump_sreg("cs", sregs.cs);
+        dump_sreg("cs", sregs->cs);
 #if 0
-        dump_sreg("ds", sregs.ds);
-        dump_sreg("es", sregs.es);
-        dump_sreg("fs", sregs.fs);
-        dump_sreg("gs", sregs.gs);
-        dump_sreg("ss", sregs.ss);
-        dump_sreg("ds", sregs.ds);
+        dump_sreg("ds", sregs->ds);
+        dump_sreg("es", sregs->es);
+        dump_sreg("fs", sregs->fs);
+        dump_sreg("gs", sregs->gs);
+        dump_sreg("ss", sregs->ss);
+        dump_sreg("ds", sregs->ds);
 #endif
 
-        rc = vcpu_ioctl(ctx, KVM_SET_SREGS, &sregs);
-        if (rc < 0) {
-                warn("Could not set VCPU SREGS");
-                goto err;
-        }
+        dirty_vcpu_sregs(&ctx->vcpus[0]);
 
         return 0;
 err:
@@ -168,7 +168,7 @@ typedef struct {
 } page_table_list_t;
 
 #define ALIGN_PADDING(addr, align) (((align) - ((addr) % (align))) % (align))
-#define ALIGN_DOWN(addr, align) ((addr) - ((align) - ALIGN_PADDING(addr, align)))
+#define ALIGN_DOWN(addr, align) ((addr) - ((addr) % (align)))
 #define ALIGN_UP(addr, align) ((addr) + ALIGN_PADDING(addr, align))
 
 #define signex(val, bits) ({ \
@@ -321,13 +321,43 @@ typedef struct {
 
 #define get_pfn(addr) ((addr) >> PAGE_SHIFT)
 
-#define virt_to_phys(pml4_base, vaddr)                                  \
+/*
+ * Memory types, numbered by the PAT entry we program for each, so that
+ * a leaf entry's pat:pcd:pwt bits are just the type.
+ */
+typedef enum {
+        MEM_TYPE_WB = 0,
+        MEM_TYPE_WT = 1,
+        MEM_TYPE_WC = 2,
+        MEM_TYPE_UC = 3,
+        MEM_TYPES
+} mem_type;
+
+#define MSR_IA32_CR_PAT 0x277
+/* PA0-PA3 are WB, WT, WC, UC, and PA4-PA7 repeat them */
+#define GAOL_PAT 0x0001040600010406ul
+
+#define set_mem_type(entry, type)                                       \
         ({                                                              \
-                uint16_t pml4en_ = get_pml4e(vaddr);                    \
-                uint16_t pdpen_ = get_pdpe(vaddr);                      \
-                pml4e_t *pml4e = ((pml4e_t *)pml4_base) + pml4en_;      \
-                struct list_head *n_, *pos_;                            \
-                pdpe_t *pdpe = (
+                (entry)->pwt = (type) & 1;                              \
+                (entry)->pcd = ((type) >> 1) & 1;                       \
+        })
+#define get_mem_type(entry) ((entry)->pwt | ((entry)->pcd << 1))
+
+static inline const char * unused
+mem_type_name(int type)
+{
+        static const char * const names[] = {
+                [MEM_TYPE_WB] = "wb",
+                [MEM_TYPE_WT] = "wt",
+                [MEM_TYPE_WC] = "wc",
+                [MEM_TYPE_UC] = "uc",
+        };
+
+        if (type < 0 || type >= MEM_TYPES)
+                return "??";
+        return names[type];
+}
 
 typedef enum {
         CR3,
@@ -0,0 +1,131 @@
+/*
+ * options.h - per-vm tunables
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* kinds of guest memory that can each have their own memory type */
+enum mem_region {
+        MEM_REGION_TEXT,
+        MEM_REGION_DATA,
+        MEM_REGION_STACK,
+        MEM_REGION_HEAP,
+        MEM_REGION_PAGE_TABLES,
+        MEM_REGIONS
+};
+
+/* the scheduler's priority classes, highest first */
+enum sched_prio {
+        SCHED_PRIO_HIGH,
+        SCHED_PRIO_NORMAL,
+        SCHED_PRIO_LOW,
+        SCHED_PRIOS
+};
+
+struct vm_options {
+        /*
+         * Map identical read-only file-backed segments once per process
+         * and register every vm's memslots from those same host pages.
+         */
+        bool share_dsos;
+
+        /*
+         * Point every vm's paging structures for read-only regions at
+         * read-only tables shared with other vms with the same layout.
+         */
+        bool share_page_tables;
+
+        /* mark guest-owned anonymous memory as mergeable by ksmd */
+        bool ksm;
+
+        /*
+         * If nonzero, give the guest a free page report channel, and
+         * release reported ranges at least this big with
+         * free_page_advice (MADV_DONTNEED or MADV_FREE).
+         */
+        size_t free_page_min_chunk;
+        int free_page_advice;
+
+        /*
+         * If nonzero, compress a vm's writable memory away once its
+         * vcpu has been halted this long, and fault it back in when it
+         * runs.  Halting only idles a vcpu with the in-kernel lapic.
+         */
+        unsigned long hibernate_idle_ms;
+
+        /*
+         * Back writable guest memory with a memfd, optionally from
+         * hugetlbfs, and optionally sealed once the layout is done.
+         */
+        bool memfd;
+        bool memfd_hugetlb;
+        bool memfd_seal;
+
+        /*
+         * If nonzero, reserve this much memory for the guest's heap
+         * and tell its allocator where it is.
+         */
+        size_t heap_size;
+
+        /* MEM_TYPE_* for each MEM_REGION_*; the default is write-back */
+        int mem_types[MEM_REGIONS];
+
+        /* vcpus per vm; all but the first start at the guest's ap_main() */
+        unsigned int nvcpus;
+
+        /*
+         * If nonzero, run this many copies of the guest in the vm, one
+         * per vcpu, each with its own writable memory and page tables.
+         */
+        unsigned int instances;
+
+        /* which SCHED_PRIO_* class the scheduler runs our vcpus in */
+        int sched_prio;
+
+        /*
+         * If any are set, pin each vcpu's thread to one of these cpus,
+         * round robin, and if vcpu_rt_prio is nonzero run it SCHED_FIFO
+         * at that priority.
+         */
+        cpu_set_t vcpu_cpus;
+        int vcpu_rt_prio;
+
+        /* KVM_CAP_HALT_POLL's max poll time for this vm, or -1 to leave it */
+        long halt_poll_ns;
+
+        /*
+         * Let the guest PAUSE, HLT, and MWAIT without exiting; its vcpus
+         * must be pinned to isolated cpus of their own.
+         */
+        bool dedicated_cores;
+
+        /*
+         * Give the vm kvm's in-kernel lapic, so the guest can HLT until
+         * we interrupt it instead of spinning.
+         */
+        bool irqchip;
+
+        /* cpu features (see parse_cpu_features()) to keep from the guest */
+        uint64_t cpuid_hide;
+};
+
+static inline void unused
+init_vm_options(struct vm_options *opts)
+{
+        memset(opts, 0, sizeof(*opts));
+        opts->free_page_advice = MADV_DONTNEED;
+        opts->nvcpus = 1;
+        opts->sched_prio = SCHED_PRIO_NORMAL;
+        opts->halt_poll_ns = -1;
+}
+
+#endif /* !OPTIONS_H_ */
+// vim:fenc=utf-8:tw=75:et
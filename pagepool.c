@@ -0,0 +1,399 @@
+/*
+ * pagepool.c - pre-zeroed memory for guests
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "gaol.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Starting a vm shouldn't have to wait for the kernel to fault in and
+ * zero its stack and page tables.  A low priority thread keeps a few
+ * chunks of each size class mapped, populated, and zeroed, and zeroes
+ * what torn down vms give back, so the launch path just pops a list.
+ *
+ * Chunks on the lists are linked through their first word, which gets
+ * cleared again when a clean chunk is handed out.
+ */
+struct pool_chunk {
+        struct pool_chunk *next;
+};
+
+struct pool_class {
+        struct pool_chunk *clean;
+        unsigned int depth;
+        struct pool_chunk *dirty;
+        unsigned int ndirty;
+        /* nobody's asked for this size, so don't stock it */
+        bool wanted;
+        unsigned long hits;
+        unsigned long misses;
+};
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t thread;
+        bool running;
+        bool stop;
+
+        unsigned int target_depth;
+        unsigned int refill_rate;
+
+        unsigned long chunks_mapped;
+        unsigned long recycled;
+        unsigned long released;
+
+        struct pool_class classes[PAGE_POOL_CLASSES];
+} pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static inline size_t
+class_size(int c)
+{
+        return PAGE_SIZE << c;
+}
+
+static int
+size_class(size_t size)
+{
+        for (int c = 0; c < PAGE_POOL_CLASSES; c++) {
+                if (size <= class_size(c))
+                        return c;
+        }
+        return -1;
+}
+
+/*
+ * mmap() len bytes aligned to align, optionally faulting them all in
+ * now so nobody has to later.
+ */
+static void *
+map_aligned(size_t len, size_t align, bool populate)
+{
+        uint8_t *addr, *aligned;
+        size_t pad;
+        int rc;
+
+        addr = mmap(NULL, len + align, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+                return NULL;
+
+        aligned = (uint8_t *)ALIGN_UP((uintptr_t)addr, align);
+        pad = aligned - addr;
+        if (pad)
+                munmap(addr, pad);
+        munmap(aligned + len, align - pad);
+
+        if (align >= PAGE_POOL_CHUNK_SIZE)
+                madvise(aligned, len, MADV_HUGEPAGE);
+
+        if (populate) {
+                rc = madvise(aligned, len, MADV_POPULATE_WRITE);
+                if (rc < 0) {
+                        memset(aligned, 0, len);
+                        errno = 0;
+                }
+        }
+
+        return aligned;
+}
+
+static void
+refill_class(int c, unsigned int need)
+{
+        struct pool_class *cls = &pool.classes[c];
+        size_t size = class_size(c);
+        uint8_t *chunks;
+
+        chunks = map_aligned(size * need, size, true);
+        if (!chunks)
+                return;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.chunks_mapped += 1;
+        for (unsigned int i = 0; i < need; i++) {
+                struct pool_chunk *chunk;
+
+                chunk = (struct pool_chunk *)(chunks + i * size);
+                chunk->next = cls->clean;
+                cls->clean = chunk;
+                cls->depth += 1;
+        }
+        pthread_mutex_unlock(&pool.lock);
+}
+
+static void *
+page_pool_thread(void *arg unused)
+{
+        struct sched_param param = { .sched_priority = 0 };
+
+        pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stop) {
+                bool recycled = false, refilled = false;
+
+                /* recycling what we're given back comes first... */
+                for (int c = 0; c < PAGE_POOL_CLASSES && !recycled; c++) {
+                        struct pool_class *cls = &pool.classes[c];
+                        struct pool_chunk *chunk = cls->dirty;
+
+                        if (!chunk)
+                                continue;
+
+                        cls->dirty = chunk->next;
+                        cls->ndirty -= 1;
+                        pthread_mutex_unlock(&pool.lock);
+
+                        memset(chunk, 0, class_size(c));
+
+                        pthread_mutex_lock(&pool.lock);
+                        if (cls->depth < pool.target_depth) {
+                                chunk->next = cls->clean;
+                                cls->clean = chunk;
+                                cls->depth += 1;
+                                pool.recycled += 1;
+                        } else {
+                                munmap(chunk, class_size(c));
+                                pool.released += 1;
+                        }
+                        recycled = true;
+                }
+                if (recycled)
+                        continue;
+
+                /* ... then topping up anything that's running low */
+                for (int c = 0; c < PAGE_POOL_CLASSES && !refilled; c++) {
+                        struct pool_class *cls = &pool.classes[c];
+                        unsigned int need;
+
+                        if (!cls->wanted || cls->depth >= pool.target_depth)
+                                continue;
+
+                        need = pool.target_depth - cls->depth;
+                        pthread_mutex_unlock(&pool.lock);
+                        refill_class(c, need);
+                        pthread_mutex_lock(&pool.lock);
+                        refilled = true;
+                }
+
+                if (refilled && pool.refill_rate) {
+                        struct timespec ts = {
+                                .tv_sec = 1 / pool.refill_rate,
+                                .tv_nsec = 1000000000ul / pool.refill_rate
+                                           % 1000000000ul,
+                        };
+
+                        pthread_mutex_unlock(&pool.lock);
+                        nanosleep(&ts, NULL);
+                        pthread_mutex_lock(&pool.lock);
+                } else if (!refilled) {
+                        struct timespec ts;
+
+                        clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_nsec += 100000000;
+                        if (ts.tv_nsec >= 1000000000) {
+                                ts.tv_sec += 1;
+                                ts.tv_nsec -= 1000000000;
+                        }
+                        pthread_cond_timedwait(&pool.cond, &pool.lock, &ts);
+                }
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        return NULL;
+}
+
+/*
+ * depth is how many free chunks of each size in use to keep around, and
+ * refill_rate caps how many refills per second the thread does (0 for
+ * no cap).
+ */
+int hidden
+page_pool_start(unsigned int depth, unsigned int refill_rate)
+{
+        int rc;
+
+        if (pool.running)
+                return 0;
+
+        pool.target_depth = depth;
+        pool.refill_rate = refill_rate;
+        pool.stop = false;
+
+        rc = pthread_create(&pool.thread, NULL, page_pool_thread, NULL);
+        if (rc != 0) {
+                errno = rc;
+                warn("Could not start page pool thread");
+                return -1;
+        }
+        pool.running = true;
+
+        return 0;
+}
+
+static void
+unmap_list(struct pool_chunk *chunk, size_t size)
+{
+        while (chunk) {
+                struct pool_chunk *next = chunk->next;
+
+                munmap(chunk, size);
+                chunk = next;
+        }
+}
+
+void hidden
+page_pool_stop(void)
+{
+        if (!pool.running)
+                return;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.stop = true;
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        pthread_join(pool.thread, NULL);
+        pool.running = false;
+
+        for (int c = 0; c < PAGE_POOL_CLASSES; c++) {
+                struct pool_class *cls = &pool.classes[c];
+
+                unmap_list(cls->clean, class_size(c));
+                unmap_list(cls->dirty, class_size(c));
+                cls->clean = cls->dirty = NULL;
+                cls->depth = cls->ndirty = 0;
+        }
+}
+
+/*
+ * Zeroed, page aligned (and aligned to its size class) memory.  It has
+ * to go back through page_pool_free() with the same size.
+ */
+hidden void *
+page_pool_alloc(size_t size)
+{
+        struct pool_class *cls;
+        struct pool_chunk *chunk;
+        int c = size_class(size);
+
+        if (c < 0)
+                return map_aligned(PAGE_ALIGN_UP(size), PAGE_SIZE, false);
+
+        cls = &pool.classes[c];
+        pthread_mutex_lock(&pool.lock);
+        cls->wanted = true;
+        chunk = cls->clean;
+        if (chunk) {
+                cls->clean = chunk->next;
+                cls->depth -= 1;
+                cls->hits += 1;
+        } else {
+                cls->misses += 1;
+        }
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (chunk) {
+                chunk->next = NULL;
+                return chunk;
+        }
+
+        /* fresh anonymous memory is already zeroed */
+        return map_aligned(class_size(c), class_size(c), false);
+}
+
+void hidden
+page_pool_free(void *addr, size_t size)
+{
+        struct pool_class *cls;
+        struct pool_chunk *chunk = addr;
+        int c = size_class(size);
+
+        if (!addr)
+                return;
+
+        if (c < 0) {
+                munmap(addr, PAGE_ALIGN_UP(size));
+                return;
+        }
+
+        if (!pool.running) {
+                munmap(addr, class_size(c));
+                return;
+        }
+
+        cls = &pool.classes[c];
+        pthread_mutex_lock(&pool.lock);
+        chunk->next = cls->dirty;
+        cls->dirty = chunk;
+        cls->ndirty += 1;
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+}
+
+void hidden
+page_pool_get_stats(struct page_pool_stats *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+
+        pthread_mutex_lock(&pool.lock);
+        stats->running = pool.running;
+        stats->target_depth = pool.target_depth;
+        stats->refill_rate = pool.refill_rate;
+        stats->chunks_mapped = pool.chunks_mapped;
+        stats->recycled = pool.recycled;
+        stats->released = pool.released;
+        for (int c = 0; c < PAGE_POOL_CLASSES; c++) {
+                struct pool_class *cls = &pool.classes[c];
+
+                stats->classes[c].size = class_size(c);
+                stats->classes[c].depth = cls->depth;
+                stats->classes[c].dirty = cls->ndirty;
+                stats->classes[c].hits = cls->hits;
+                stats->classes[c].misses = cls->misses;
+        }
+        pthread_mutex_unlock(&pool.lock);
+}
+
+void hidden
+page_pool_print_stats(void)
+{
+        struct page_pool_stats stats;
+
+        page_pool_get_stats(&stats);
+        if (!stats.running)
+                return;
+
+        printf("page pool: depth %u, %u refills/s, %lu mapped, %lu recycled, %lu released\n",
+               stats.target_depth, stats.refill_rate, stats.chunks_mapped,
+               stats.recycled, stats.released);
+        for (int c = 0; c < PAGE_POOL_CLASSES; c++) {
+                struct page_pool_class_stats *cs = &stats.classes[c];
+
+                if (!cs->hits && !cs->misses && !cs->depth)
+                        continue;
+                printf("  0x%06zx: %u free %u dirty %lu hits %lu misses\n",
+                       cs->size, cs->depth, cs->dirty, cs->hits,
+                       cs->misses);
+        }
+}
+
+// vim:fenc=utf-8:tw=75:et
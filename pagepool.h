@@ -0,0 +1,42 @@
+/*
+ * pagepool.h - pre-zeroed memory for guests
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef PAGEPOOL_H_
+#define PAGEPOOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* size classes are PAGE_SIZE << n, up to one 2MiB chunk */
+#define PAGE_POOL_CLASSES 10
+#define PAGE_POOL_CHUNK_SIZE (PAGE_SIZE << (PAGE_POOL_CLASSES - 1))
+
+struct page_pool_class_stats {
+        size_t size;
+        unsigned int depth;
+        unsigned int dirty;
+        unsigned long hits;
+        unsigned long misses;
+};
+
+struct page_pool_stats {
+        bool running;
+        unsigned int target_depth;
+        unsigned int refill_rate;
+        unsigned long chunks_mapped;
+        unsigned long recycled;
+        unsigned long released;
+        struct page_pool_class_stats classes[PAGE_POOL_CLASSES];
+};
+
+extern int page_pool_start(unsigned int depth, unsigned int refill_rate) hidden;
+extern void page_pool_stop(void) hidden;
+extern void *page_pool_alloc(size_t size) hidden;
+extern void page_pool_free(void *addr, size_t size) hidden;
+extern void page_pool_get_stats(struct page_pool_stats *stats) hidden;
+extern void page_pool_print_stats(void) hidden;
+
+#endif /* !PAGEPOOL_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,55 @@
+/*
+ * ports.h - I/O ports the guest uses to talk to us
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef PORTS_H_
+#define PORTS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte writes of console output.  The host asks kvm to coalesce these,
+ * so most of them don't exit at all.
+ */
+#define GAOL_PORT_CONSOLE 0x217
+
+/*
+ * A 32-bit write of the guest's exit status.  With HLT exits disabled
+ * (see --dedicated-cores), a halted vcpu never comes back to us, so this
+ * is how a guest says it's done.
+ */
+#define GAOL_PORT_EXIT 0x218
+
+static inline void unused
+outb(uint16_t port, uint8_t val)
+{
+        __asm__ __volatile__("outb %0, %w1" : : "a"(val), "Nd"(port));
+}
+
+static inline void unused
+outl(uint16_t port, uint32_t val)
+{
+        __asm__ __volatile__("outl %0, %w1" : : "a"(val), "Nd"(port));
+}
+
+static inline void unused
+console_write(const void *buf, size_t len)
+{
+        const uint8_t *bytes = buf;
+
+        for (size_t i = 0; i < len; i++)
+                outb(GAOL_PORT_CONSOLE, bytes[i]);
+}
+
+static inline void unused noreturn
+guest_exit(int status)
+{
+        outl(GAOL_PORT_EXIT, status);
+        for (;;)
+                __asm__ __volatile__("hlt");
+}
+
+#endif /* !PORTS_H_ */
+// vim:fenc=utf-8:tw=75:et
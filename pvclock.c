@@ -0,0 +1,189 @@
+/*
+ * pvclock.c - keeping the guest's clock page
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gaol.h"
+
+/*
+ * Find tsc_shift and tsc_to_system_mul so that
+ * ((delta << shift) * mul) >> 32 is delta tsc ticks in ns, with mul
+ * holding as many significant bits as it can.
+ */
+static void
+tsc_scale(uint64_t tsc_khz, int8_t *shift, uint32_t *mul)
+{
+        uint64_t num = 1000000, den = tsc_khz;
+        int s = 0;
+
+        while (num >= den) {
+                den <<= 1;
+                s++;
+        }
+        while (num < den / 2 && num < (1ull << 31)) {
+                num <<= 1;
+                s--;
+        }
+
+        *shift = s;
+        *mul = (num << 32) / den;
+}
+
+static uint64_t
+clock_ns(clockid_t clk)
+{
+        struct timespec ts;
+
+        clock_gettime(clk, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Pair a reading of the boot vcpu's tsc with our CLOCK_MONOTONIC.  We
+ * can only read the tsc with an ioctl, so take a few and keep the one
+ * with the tightest window around it.
+ */
+static int
+sample_guest_tsc(struct context *ctx, uint64_t *tsc, uint64_t *mono_ns)
+{
+        struct {
+                struct kvm_msrs msrs;
+                struct kvm_msr_entry entries[1];
+        } msrs;
+        uint64_t best = UINT64_MAX;
+        int rc;
+
+        for (int i = 0; i < 4; i++) {
+                uint64_t t0, t1;
+
+                memset(&msrs, 0, sizeof(msrs));
+                msrs.msrs.nmsrs = 1;
+                msrs.entries[0].index = MSR_IA32_TSC;
+
+                t0 = clock_ns(CLOCK_MONOTONIC);
+                rc = cpu_ioctl(&ctx->vcpus[0], KVM_GET_MSRS, &msrs);
+                t1 = clock_ns(CLOCK_MONOTONIC);
+                if (rc != 1) {
+                        warn("Could not read the guest tsc");
+                        return -1;
+                }
+
+                if (t1 - t0 < best) {
+                        best = t1 - t0;
+                        *tsc = msrs.entries[0].data;
+                        *mono_ns = t0 + (t1 - t0) / 2;
+                }
+        }
+
+        return 0;
+}
+
+static void
+update_guest_clock(struct context *ctx, uint64_t tsc, uint64_t mono_ns,
+                   int64_t realtime_offset)
+{
+        struct guest_clock *gc = ctx->guest_clock;
+        uint32_t version = gc->version;
+
+        /*
+         * Our clock and the tsc drift apart, but the guest's mustn't run
+         * backwards because we re-anchored it, so if it's ahead of us we
+         * carry on from where it's got to.
+         */
+        if (gc->tsc_timestamp && tsc > gc->tsc_timestamp) {
+                uint64_t delta = tsc - gc->tsc_timestamp;
+                uint64_t then;
+
+                if (gc->tsc_shift < 0)
+                        delta >>= -gc->tsc_shift;
+                else
+                        delta <<= gc->tsc_shift;
+                then = gc->system_time +
+                       (uint64_t)(((unsigned __int128)delta *
+                                   gc->tsc_to_system_mul) >> 32);
+                if (then > mono_ns)
+                        mono_ns = then;
+        }
+
+        __atomic_store_n(&gc->version, version + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        gc->tsc_timestamp = tsc;
+        gc->system_time = mono_ns;
+        gc->realtime_offset = realtime_offset;
+        __atomic_store_n(&gc->version, version + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Re-anchor the guest's clock if it's been long enough.  This only
+ * happens when the boot vcpu exits, so a guest that never does (see
+ * --dedicated-cores) keeps the tsc's idea of a second.
+ */
+void hidden
+refresh_guest_clock(struct context *ctx, uint64_t now_ns)
+{
+        uint64_t tsc, mono_ns;
+        int64_t realtime_offset;
+
+        if (!ctx->guest_clock ||
+            now_ns - ctx->guest_clock_updated_ns < GUEST_CLOCK_REFRESH_NS)
+                return;
+
+        if (sample_guest_tsc(ctx, &tsc, &mono_ns) < 0)
+                return;
+        realtime_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+        update_guest_clock(ctx, tsc, mono_ns, realtime_offset);
+        ctx->guest_clock_updated_ns = now_ns;
+        ctx->guest_clock_refreshes += 1;
+}
+
+/*
+ * Work out the scale for gc's tsc_khz and anchor it to our clock, before
+ * the guest can see it.  gc is ours from here on; free_guest_clock()
+ * gets rid of it.
+ */
+int hidden
+start_guest_clock(struct context *ctx, struct guest_clock *gc)
+{
+        uint64_t tsc, mono_ns;
+        int64_t realtime_offset;
+
+        if (!(ctx->vm_clock.flags & KVM_CLOCK_TSC_STABLE))
+                printf("guest clock: kvm says the tsc isn't stable; guest time may wander\n");
+
+        gc->tsc_khz = ctx->vcpu_tsc_khz;
+        tsc_scale(gc->tsc_khz, &gc->tsc_shift, &gc->tsc_to_system_mul);
+        ctx->guest_clock = gc;
+
+        if (sample_guest_tsc(ctx, &tsc, &mono_ns) < 0)
+                return -1;
+        realtime_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+        update_guest_clock(ctx, tsc, mono_ns, realtime_offset);
+        ctx->guest_clock_updated_ns = mono_ns;
+
+        printf("guest clock: %"PRIu64"kHz tsc, mul 0x%08"PRIx32" shift %d\n",
+               gc->tsc_khz, gc->tsc_to_system_mul, gc->tsc_shift);
+        return 0;
+}
+
+void hidden
+free_guest_clock(struct context *ctx)
+{
+        if (!ctx->guest_clock)
+                return;
+
+        printf("guest clock: %lu refreshes\n", ctx->guest_clock_refreshes);
+        free(ctx->guest_clock);
+        ctx->guest_clock = NULL;
+        ctx->guest_clock_map = NULL;
+}
+
+// vim:fenc=utf-8:tw=75:et
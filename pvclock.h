@@ -0,0 +1,29 @@
+/*
+ * pvclock.h - keeping the guest's clock page
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef PVCLOCK_H_
+#define PVCLOCK_H_
+
+#include <stdint.h>
+
+struct context;
+struct guest_clock;
+
+#define MSR_IA32_TSC 0x10
+
+/*
+ * The guest's time is the tsc scaled by tsc_khz, which drifts from our
+ * CLOCK_MONOTONIC as ntp slews it; re-anchoring it this often keeps
+ * that well under a millisecond.
+ */
+#define GUEST_CLOCK_REFRESH_NS 1000000000ull
+
+extern int start_guest_clock(struct context *ctx,
+                             struct guest_clock *gc) hidden;
+extern void refresh_guest_clock(struct context *ctx, uint64_t now_ns) hidden;
+extern void free_guest_clock(struct context *ctx) hidden;
+
+#endif /* !PVCLOCK_H_ */
+// vim:fenc=utf-8:tw=75:et
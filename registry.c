@@ -0,0 +1,362 @@
+/*
+ * registry.c - every live vm in the process, by id
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * Each thread that registers with vm_registry_register_thread() gets one
+ * of these, and keeps it until it exits.  count[phase] is how many read
+ * sections this thread has open that started in that phase; signal
+ * handlers nest on top of whatever the thread was doing, which is why
+ * it's a count.  Threads that never registered, or came after the first
+ * VM_REGISTRY_READERS, share overflow[], which costs them a contended
+ * cache line but nothing else.
+ */
+struct registry_reader {
+        unsigned long count[2];
+        int claimed;
+} aligned(64);
+
+#define TOKEN_PHASE     1u
+#define TOKEN_OVERFLOW  2u
+
+static struct {
+        struct context *slots[VM_REGISTRY_SIZE];
+        uint32_t gens[VM_REGISTRY_SIZE];
+
+        /*
+         * The free list: the low half of free_head is a slot + 1, or 0
+         * for empty, and the high half counts pops and pushes so a slot
+         * that's popped and pushed back behind our back doesn't fool
+         * the compare-and-swap.  next_free[] is linked the same way.
+         */
+        uint64_t free_head;
+        uint32_t next_free[VM_REGISTRY_SIZE];
+        uint32_t high_water;
+
+        unsigned int phase;
+        struct registry_reader readers[VM_REGISTRY_READERS];
+        unsigned long overflow[2] aligned(64);
+        pthread_mutex_t sync_lock;
+
+        unsigned int live;
+        unsigned int peak;
+        unsigned long adds;
+        unsigned long removes;
+        unsigned long full;
+        unsigned long sync_waits;
+} registry = {
+        .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct registry_reader *this_reader;
+
+/*
+ * A thread can't be inside a read section when it exits, so its counts
+ * are back to 0 and the slot can go to whoever asks next.
+ */
+static pthread_key_t reader_key;
+static bool have_reader_key;
+
+static void
+put_reader(void *data)
+{
+        struct registry_reader *r = data;
+
+        this_reader = NULL;
+        __atomic_store_n(&r->claimed, 0, __ATOMIC_RELEASE);
+}
+
+static void
+make_reader_key(void)
+{
+        have_reader_key = pthread_key_create(&reader_key, put_reader) == 0;
+}
+
+/*
+ * Claiming a slot takes pthread_once() and pthread_setspecific(), which
+ * a signal handler can't call, so threads that read do this up front:
+ * vm_registry_add() does it for whoever launches a vm, and vcpu threads
+ * and scheduler workers do it when they start.  A thread that didn't
+ * still reads, through overflow[].
+ */
+void hidden
+vm_registry_register_thread(void)
+{
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+        if (this_reader)
+                return;
+
+        pthread_once(&once, make_reader_key);
+        if (!have_reader_key)
+                return;
+
+        for (unsigned int i = 0; i < VM_REGISTRY_READERS; i++) {
+                struct registry_reader *r = &registry.readers[i];
+                int unclaimed = 0;
+
+                if (!__atomic_compare_exchange_n(&r->claimed, &unclaimed, 1,
+                                                 false, __ATOMIC_ACQUIRE,
+                                                 __ATOMIC_RELAXED))
+                        continue;
+
+                if (pthread_setspecific(reader_key, r) != 0) {
+                        __atomic_store_n(&r->claimed, 0, __ATOMIC_RELEASE);
+                        return;
+                }
+                /* a handler that sees this set can use it from here on */
+                __atomic_store_n(&this_reader, r, __ATOMIC_RELAXED);
+                __atomic_signal_fence(__ATOMIC_SEQ_CST);
+                return;
+        }
+}
+
+unsigned int hidden
+vm_registry_read_lock(void)
+{
+        struct registry_reader *r = this_reader;
+        unsigned int phase;
+
+        phase = __atomic_load_n(&registry.phase, __ATOMIC_RELAXED) & 1;
+        if (r)
+                __atomic_add_fetch(&r->count[phase], 1, __ATOMIC_RELAXED);
+        else
+                __atomic_add_fetch(&registry.overflow[phase], 1,
+                                   __ATOMIC_RELAXED);
+
+        /* our count has to be visible before we look at any slot */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return phase | (r ? 0 : TOKEN_OVERFLOW);
+}
+
+void hidden
+vm_registry_read_unlock(unsigned int token)
+{
+        unsigned int phase = token & TOKEN_PHASE;
+
+        if (token & TOKEN_OVERFLOW)
+                __atomic_sub_fetch(&registry.overflow[phase], 1,
+                                   __ATOMIC_RELEASE);
+        else
+                __atomic_sub_fetch(&this_reader->count[phase], 1,
+                                   __ATOMIC_RELEASE);
+}
+
+static unsigned long
+readers_in(unsigned int phase)
+{
+        unsigned long n;
+
+        n = __atomic_load_n(&registry.overflow[phase], __ATOMIC_ACQUIRE);
+        for (unsigned int i = 0; i < VM_REGISTRY_READERS; i++) {
+                struct registry_reader *r = &registry.readers[i];
+
+                if (!__atomic_load_n(&r->claimed, __ATOMIC_RELAXED))
+                        continue;
+                n += __atomic_load_n(&r->count[phase], __ATOMIC_ACQUIRE);
+        }
+
+        return n;
+}
+
+/*
+ * Wait until nobody can still be holding a pointer they got before we
+ * were called.  A reader can read the phase, stall, and then count
+ * itself into the old one after we've seen it empty, so flip twice:
+ * whoever that was is in the phase the second flip waits out.
+ */
+static void
+synchronize_readers(void)
+{
+        pthread_mutex_lock(&registry.sync_lock);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (unsigned int flip = 0; flip < 2; flip++) {
+                unsigned int old;
+
+                old = __atomic_fetch_xor(&registry.phase, 1,
+                                         __ATOMIC_SEQ_CST) & 1;
+                while (readers_in(old)) {
+                        registry.sync_waits += 1;
+                        sched_yield();
+                }
+        }
+
+        pthread_mutex_unlock(&registry.sync_lock);
+}
+
+static int
+pop_free_slot(void)
+{
+        uint64_t old, new;
+        uint32_t slot;
+
+        old = __atomic_load_n(&registry.free_head, __ATOMIC_ACQUIRE);
+        do {
+                if ((uint32_t)old == 0)
+                        goto bump;
+                slot = (uint32_t)old - 1;
+                new = ((old >> 32) + 1) << 32 |
+                      __atomic_load_n(&registry.next_free[slot],
+                                      __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&registry.free_head, &old, new,
+                                              true, __ATOMIC_ACQUIRE,
+                                              __ATOMIC_ACQUIRE));
+        return slot;
+
+bump:
+        slot = __atomic_fetch_add(&registry.high_water, 1, __ATOMIC_RELAXED);
+        if (slot < VM_REGISTRY_SIZE)
+                return slot;
+
+        /* nobody else gets to bump past the end either */
+        __atomic_store_n(&registry.high_water, VM_REGISTRY_SIZE,
+                         __ATOMIC_RELAXED);
+        return -1;
+}
+
+static void
+push_free_slot(uint32_t slot)
+{
+        uint64_t old, new;
+
+        old = __atomic_load_n(&registry.free_head, __ATOMIC_RELAXED);
+        do {
+                __atomic_store_n(&registry.next_free[slot], (uint32_t)old,
+                                 __ATOMIC_RELAXED);
+                new = ((old >> 32) + 1) << 32 | (slot + 1);
+        } while (!__atomic_compare_exchange_n(&registry.free_head, &old, new,
+                                              true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+}
+
+int hidden
+vm_registry_add(struct context *ctx)
+{
+        unsigned int live, peak;
+        uint32_t gen;
+        int slot;
+
+        vm_registry_register_thread();
+
+        slot = pop_free_slot();
+        if (slot < 0) {
+                __atomic_add_fetch(&registry.full, 1, __ATOMIC_RELAXED);
+                errno = ENOSPC;
+                return -1;
+        }
+
+        gen = __atomic_add_fetch(&registry.gens[slot], 1, __ATOMIC_RELAXED);
+        ctx->id = (vmid_t)(((gen << VM_REGISTRY_SHIFT) | slot) & INT32_MAX);
+        __atomic_store_n(&registry.slots[slot], ctx, __ATOMIC_RELEASE);
+
+        __atomic_add_fetch(&registry.adds, 1, __ATOMIC_RELAXED);
+        live = __atomic_add_fetch(&registry.live, 1, __ATOMIC_RELAXED);
+        peak = __atomic_load_n(&registry.peak, __ATOMIC_RELAXED);
+        while (live > peak &&
+               !__atomic_compare_exchange_n(&registry.peak, &peak, live, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+        return 0;
+}
+
+/*
+ * Take ctx out where new readers can't find it, and wait out the ones
+ * that might have; after this it's ours to free.
+ */
+void hidden
+vm_registry_remove(struct context *ctx)
+{
+        uint32_t slot = ctx->id & (VM_REGISTRY_SIZE - 1);
+
+        if (ctx->id < 0 ||
+            __atomic_load_n(&registry.slots[slot], __ATOMIC_RELAXED) != ctx)
+                return;
+
+        __atomic_store_n(&registry.slots[slot], NULL, __ATOMIC_RELEASE);
+        synchronize_readers();
+        push_free_slot(slot);
+        ctx->id = -1;
+
+        __atomic_add_fetch(&registry.removes, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&registry.live, 1, __ATOMIC_RELAXED);
+}
+
+struct context hidden *
+vm_registry_get(vmid_t id)
+{
+        struct context *ctx;
+
+        if (id < 0)
+                return NULL;
+
+        ctx = __atomic_load_n(&registry.slots[id & (VM_REGISTRY_SIZE - 1)],
+                              __ATOMIC_ACQUIRE);
+        if (!ctx || ctx->id != id)
+                return NULL;
+        return ctx;
+}
+
+/*
+ * Call fn on every live vm until it returns nonzero, and return that.
+ * vms added while we're walking may or may not be seen.
+ */
+int hidden
+vm_registry_for_each(int (*fn)(struct context *ctx, void *data), void *data)
+{
+        unsigned int token, n;
+        int rc = 0;
+
+        token = vm_registry_read_lock();
+        n = __atomic_load_n(&registry.high_water, __ATOMIC_ACQUIRE);
+        n = min(n, VM_REGISTRY_SIZE);
+        for (unsigned int i = 0; i < n && rc == 0; i++) {
+                struct context *ctx;
+
+                ctx = __atomic_load_n(&registry.slots[i], __ATOMIC_ACQUIRE);
+                if (ctx)
+                        rc = fn(ctx, data);
+        }
+        vm_registry_read_unlock(token);
+
+        return rc;
+}
+
+void hidden
+get_vm_registry_stats(struct vm_registry_stats *stats)
+{
+        stats->live = __atomic_load_n(&registry.live, __ATOMIC_RELAXED);
+        stats->peak = __atomic_load_n(&registry.peak, __ATOMIC_RELAXED);
+        stats->adds = __atomic_load_n(&registry.adds, __ATOMIC_RELAXED);
+        stats->removes = __atomic_load_n(&registry.removes, __ATOMIC_RELAXED);
+        stats->full = __atomic_load_n(&registry.full, __ATOMIC_RELAXED);
+        stats->sync_waits = __atomic_load_n(&registry.sync_waits,
+                                            __ATOMIC_RELAXED);
+}
+
+void hidden
+print_vm_registry_stats(void)
+{
+        struct vm_registry_stats stats;
+
+        get_vm_registry_stats(&stats);
+        if (!stats.adds)
+                return;
+
+        printf("vm registry: %u live, %u peak, %lu added, %lu removed, %lu refused, %lu waits for readers\n",
+               stats.live, stats.peak, stats.adds, stats.removes, stats.full,
+               stats.sync_waits);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,58 @@
+/*
+ * registry.h - every live vm in the process, by id
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct context;
+
+typedef int vmid_t;
+
+/*
+ * A vm's id is its slot in the table plus how many times that slot has
+ * been used, so a stale id never finds the vm that took its slot over.
+ */
+#define VM_REGISTRY_SHIFT       10
+#define VM_REGISTRY_SIZE        (1u << VM_REGISTRY_SHIFT)
+#define VM_REGISTRY_READERS     64
+
+/*
+ * Lookups and walks take no locks and never wait: they bump a counter of
+ * their own, and a vm being removed isn't freed until every reader that
+ * might have seen it has let go.  Only removal waits for that.  Adding a
+ * vm is a pop from a lock-free free list and one store, so launching
+ * never waits on anything here either.
+ *
+ * Everything but remove and register_thread is async-signal-safe, so a
+ * profiler's or stats exporter's signal handler can look at the vms
+ * too.  The pointers are only good between read_lock and read_unlock.
+ */
+extern void vm_registry_register_thread(void) hidden;
+extern int vm_registry_add(struct context *ctx) hidden;
+extern void vm_registry_remove(struct context *ctx) hidden;
+
+extern unsigned int vm_registry_read_lock(void) hidden;
+extern void vm_registry_read_unlock(unsigned int token) hidden;
+extern struct context *vm_registry_get(vmid_t id) hidden;
+extern int vm_registry_for_each(int (*fn)(struct context *ctx, void *data),
+                                void *data) hidden;
+
+struct vm_registry_stats {
+        unsigned int live;
+        unsigned int peak;
+        unsigned long adds;
+        unsigned long removes;
+        unsigned long full;
+        unsigned long sync_waits;
+};
+
+extern void get_vm_registry_stats(struct vm_registry_stats *stats) hidden;
+extern void print_vm_registry_stats(void) hidden;
+
+#endif /* !REGISTRY_H_ */
+// vim:fenc=utf-8:tw=75:et
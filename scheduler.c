@@ -0,0 +1,670 @@
+/*
+ * scheduler.c - running many vcpus on a few worker threads
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gaol.h"
+
+/*
+ * A thread blocked in KVM_RUN per vcpu doesn't go far when most vms are
+ * idle most of the time.  Instead, a fixed pool of workers (one per cpu
+ * by default) each has a run queue per priority class, and runs vcpus
+ * from it a time slice at a time; a worker with nothing of its own
+ * steals from the others.  When a slice is up, a per-worker timer
+ * signals the worker, which knocks the vcpu out of KVM_RUN (see
+ * vcpu_kick_handler()) and puts it at the back of the queue.
+ *
+ * A handler that has nothing for the vcpu to do until some I/O or a
+ * timer comes in returns park_vcpu(); the vcpu sits on the parked list,
+ * off every run queue, until wake_vcpu() or its deadline.  HLT exits
+ * park, as does a vcpu the slice timer finds halted in the kernel, and
+ * signal_guest() wakes them.
+ *
+ * Lock order is sched.lock, then a run queue's lock.  Parking, waking,
+ * and idle workers all go through sched.lock; picking and queueing only
+ * take the queue's.
+ */
+struct sched_queue {
+        pthread_mutex_t lock;
+        struct list_head runnable[SCHED_PRIOS];
+        unsigned int nrunnable;
+};
+
+struct sched_worker {
+        unsigned int id;
+        pthread_t thread;
+        timer_t timer;
+        bool have_timer;
+        unsigned long picks;
+
+        struct sched_queue queue;
+
+        unsigned long slices;
+        unsigned long preemptions;
+        unsigned long steals;
+        unsigned long idle_waits;
+};
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool running;
+        bool stop;
+
+        unsigned int nworkers;
+        struct sched_worker *workers;
+        unsigned int next_worker;
+        unsigned int nidle;
+        uint64_t slice_ns;
+
+        /* parked vcpus, and the soonest any of them wants waking */
+        struct list_head parked;
+        uint64_t next_deadline;
+        unsigned long timer_wakeups;
+} sched = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .parked = LIST_HEAD_INIT(sched.parked),
+        .next_deadline = UINT64_MAX,
+};
+
+static inline struct timespec
+ns_to_timespec(uint64_t ns)
+{
+        struct timespec ts = {
+                .tv_sec = ns / 1000000000ul,
+                .tv_nsec = ns % 1000000000ul,
+        };
+
+        return ts;
+}
+
+static inline bool
+vcpu_stopping(struct vcpu *vcpu)
+{
+        return __atomic_load_n(&vcpu->stop, __ATOMIC_ACQUIRE);
+}
+
+static void
+push_vcpu(struct vcpu *vcpu)
+{
+        struct sched_queue *q = &sched.workers[vcpu->sched_worker].queue;
+        int prio = vcpu->ctx->sched.prio;
+
+        pthread_mutex_lock(&q->lock);
+        vcpu->sched_state = VCPU_RUNNABLE;
+        list_add_tail(&vcpu->sched_list, &q->runnable[prio]);
+        __atomic_add_fetch(&q->nrunnable, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&q->lock);
+}
+
+static void
+kick_idle_locked(void)
+{
+        if (sched.nidle)
+                pthread_cond_signal(&sched.cond);
+}
+
+/*
+ * nidle only changes under sched.lock, and a worker going idle checks the
+ * run queues after it takes the lock, so looking at it without the lock
+ * could miss one that's between the two and lose the wakeup.
+ */
+static void
+kick_idle(void)
+{
+        pthread_mutex_lock(&sched.lock);
+        kick_idle_locked();
+        pthread_mutex_unlock(&sched.lock);
+}
+
+static struct vcpu *
+pop_vcpu(struct sched_queue *q, bool starving)
+{
+        struct vcpu *vcpu = NULL;
+
+        if (!__atomic_load_n(&q->nrunnable, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        pthread_mutex_lock(&q->lock);
+        for (int i = 0; i < SCHED_PRIOS; i++) {
+                int prio = starving ? SCHED_PRIOS - 1 - i : i;
+
+                if (list_empty(&q->runnable[prio]))
+                        continue;
+
+                vcpu = list_entry(q->runnable[prio].next, struct vcpu,
+                                  sched_list);
+                list_del_init(&vcpu->sched_list);
+                __atomic_sub_fetch(&q->nrunnable, 1, __ATOMIC_RELEASE);
+                vcpu->sched_state = VCPU_RUNNING;
+                break;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        return vcpu;
+}
+
+static struct vcpu *
+pick_vcpu(struct sched_worker *w)
+{
+        bool starving = ++w->picks % SCHED_STARVE_PICKS == 0;
+        struct vcpu *vcpu;
+
+        vcpu = pop_vcpu(&w->queue, starving);
+        if (vcpu)
+                return vcpu;
+
+        for (unsigned int i = 1; i < sched.nworkers; i++) {
+                struct sched_worker *victim;
+
+                victim = &sched.workers[(w->id + i) % sched.nworkers];
+                vcpu = pop_vcpu(&victim->queue, starving);
+                if (vcpu) {
+                        vcpu->sched_worker = w->id;
+                        w->steals += 1;
+                        return vcpu;
+                }
+        }
+
+        return NULL;
+}
+
+static bool
+anything_runnable(void)
+{
+        for (unsigned int i = 0; i < sched.nworkers; i++)
+                if (__atomic_load_n(&sched.workers[i].queue.nrunnable,
+                                    __ATOMIC_ACQUIRE))
+                        return true;
+        return false;
+}
+
+/*
+ * Put anything parked whose deadline has passed back on a run queue.
+ * Called with sched.lock held.
+ */
+static void
+wake_expired_locked(uint64_t now)
+{
+        struct list_head *pos, *n;
+        uint64_t next = UINT64_MAX;
+
+        list_for_each_safe(pos, n, &sched.parked) {
+                struct vcpu *vcpu = list_entry(pos, struct vcpu, sched_list);
+
+                if (vcpu->wake_ns && vcpu->wake_ns <= now) {
+                        list_del_init(&vcpu->sched_list);
+                        vcpu->wake_ns = 0;
+                        sched.timer_wakeups += 1;
+                        push_vcpu(vcpu);
+                        kick_idle_locked();
+                } else if (vcpu->wake_ns && vcpu->wake_ns < next) {
+                        next = vcpu->wake_ns;
+                }
+        }
+
+        __atomic_store_n(&sched.next_deadline, next, __ATOMIC_RELEASE);
+}
+
+static void
+park_locked(struct vcpu *vcpu)
+{
+        struct vm_sched *vs = &vcpu->ctx->sched;
+
+        __atomic_add_fetch(&vs->parks, 1, __ATOMIC_RELAXED);
+
+        if (vcpu->wake_pending || vcpu_stopping(vcpu)) {
+                vcpu->wake_pending = false;
+                vcpu->wake_ns = 0;
+                push_vcpu(vcpu);
+                kick_idle_locked();
+                return;
+        }
+
+        vcpu->sched_state = VCPU_PARKED;
+        list_add_tail(&vcpu->sched_list, &sched.parked);
+        if (vcpu->wake_ns && vcpu->wake_ns < sched.next_deadline) {
+                __atomic_store_n(&sched.next_deadline, vcpu->wake_ns,
+                                 __ATOMIC_RELEASE);
+                /* somebody idle may be sleeping past it */
+                kick_idle_locked();
+        }
+}
+
+/*
+ * For a handler to return: wait until wake_vcpu(), or until deadline_ns
+ * on the monotonic clock if it isn't 0.  A wake that came before the
+ * park makes it return at once.
+ */
+int hidden
+park_vcpu(struct vcpu *vcpu, uint64_t deadline_ns)
+{
+        vcpu->wake_ns = deadline_ns;
+        return EXIT_PARK;
+}
+
+void hidden
+wake_vcpu(struct vcpu *vcpu)
+{
+        pthread_mutex_lock(&sched.lock);
+        __atomic_add_fetch(&vcpu->ctx->sched.wakeups, 1, __ATOMIC_RELAXED);
+        if (vcpu->sched_state == VCPU_PARKED) {
+                list_del_init(&vcpu->sched_list);
+                vcpu->wake_ns = 0;
+                push_vcpu(vcpu);
+                kick_idle_locked();
+        } else {
+                vcpu->wake_pending = true;
+                pthread_cond_signal(&vcpu->wake_cond);
+        }
+        pthread_mutex_unlock(&sched.lock);
+}
+
+/*
+ * Parking a vcpu that has a thread of its own just means that thread
+ * waits here.
+ */
+void hidden
+wait_for_wake(struct vcpu *vcpu)
+{
+        pthread_mutex_lock(&sched.lock);
+        __atomic_add_fetch(&vcpu->ctx->sched.parks, 1, __ATOMIC_RELAXED);
+        while (!vcpu->wake_pending && !vcpu_stopping(vcpu)) {
+                if (vcpu->wake_ns) {
+                        struct timespec ts = ns_to_timespec(vcpu->wake_ns);
+                        int rc;
+
+                        rc = pthread_cond_timedwait(&vcpu->wake_cond,
+                                                    &sched.lock, &ts);
+                        if (rc == ETIMEDOUT)
+                                break;
+                } else {
+                        pthread_cond_wait(&vcpu->wake_cond, &sched.lock);
+                }
+        }
+        vcpu->wake_pending = false;
+        vcpu->wake_ns = 0;
+        pthread_mutex_unlock(&sched.lock);
+}
+
+static void
+finish_vcpu(struct vcpu *vcpu, int rc)
+{
+        struct context *ctx = vcpu->ctx;
+        struct vm_sched *vs = &ctx->sched;
+
+        if (rc < 0)
+                warnx("vcpu %u failed", vcpu->id);
+
+        /*
+         * The vm is over when its boot vcpu is, as with its own threads,
+         * unless it's running instances, which each finish on their own.
+         * This has to happen before we count ourselves out, since the vm
+         * can be torn down as soon as the last vcpu is.
+         */
+        if (vcpu->id == 0 && !ctx->ninstances) {
+                for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                        struct vcpu *ap = &ctx->vcpus[i];
+
+                        __atomic_store_n(&ap->stop, true, __ATOMIC_RELEASE);
+                        wake_vcpu(ap);
+                        if (ap->sched_state == VCPU_RUNNING)
+                                pthread_kill(sched.workers[ap->sched_worker].thread,
+                                             VCPU_KICK_SIGNAL);
+                }
+        }
+
+        pthread_mutex_lock(&vs->lock);
+        vcpu->sched_state = VCPU_DONE;
+        if (vcpu->id == 0)
+                vs->rc = rc < 0 ? rc : 0;
+        vs->live_vcpus -= 1;
+        if (vs->live_vcpus == 0)
+                pthread_cond_broadcast(&vs->done);
+        pthread_mutex_unlock(&vs->lock);
+}
+
+static void
+arm_slice_timer(struct sched_worker *w, uint64_t ns)
+{
+        struct itimerspec its;
+
+        if (!w->have_timer)
+                return;
+
+        memset(&its, 0, sizeof(its));
+        its.it_value = ns_to_timespec(ns);
+        timer_settime(w->timer, 0, &its, NULL);
+}
+
+static void
+run_slice(struct sched_worker *w, struct vcpu *vcpu)
+{
+        struct context *ctx = vcpu->ctx;
+        uint64_t start = monotonic_ns();
+        int rc = EXIT_RESUME;
+
+        w->slices += 1;
+        __atomic_add_fetch(&ctx->sched.slices, 1, __ATOMIC_RELAXED);
+
+        /*
+         * The slice timer's signal can land while we're between two
+         * KVM_RUNs, where there's nothing for it to interrupt, so
+         * immediate_exit stays set for the rest of the slice and the
+         * next one returns at once.  Any kick ends the slice.
+         */
+        set_running_vcpu(vcpu);
+        vcpu->run->immediate_exit = 0;
+        arm_slice_timer(w, sched.slice_ns);
+        while (!vcpu_stopping(vcpu)) {
+                rc = run_vcpu_once(vcpu);
+                if (rc == EXIT_RESUME)
+                        check_vcpu_idle(vcpu);
+                if (rc != EXIT_RESUME)
+                        break;
+                if (vcpu->run->exit_reason == KVM_EXIT_INTR ||
+                    monotonic_ns() - start >= sched.slice_ns)
+                        break;
+        }
+        arm_slice_timer(w, 0);
+        set_running_vcpu(NULL);
+
+        if (rc == EXIT_RESUME && vcpu_stopping(vcpu))
+                rc = EXIT_STOP;
+        /*
+         * With the in-kernel lapic, a guest HLT never exits to us; the
+         * vcpu just sleeps in KVM_RUN until the slice timer kicks it
+         * out.  Rather than put it back on a run queue to hold a worker
+         * for another whole slice, park it until signal_guest() or, so
+         * its own lapic timer still gets serviced to within a slice,
+         * until the next one would be up.
+         */
+        else if (rc == EXIT_RESUME && vcpu_halted(vcpu))
+                rc = park_vcpu(vcpu, monotonic_ns() + sched.slice_ns);
+
+        switch (rc) {
+        case EXIT_RESUME:
+                w->preemptions += 1;
+                __atomic_add_fetch(&ctx->sched.preemptions, 1,
+                                   __ATOMIC_RELAXED);
+                push_vcpu(vcpu);
+                kick_idle();
+                break;
+        case EXIT_PARK:
+                pthread_mutex_lock(&sched.lock);
+                park_locked(vcpu);
+                pthread_mutex_unlock(&sched.lock);
+                break;
+        default:
+                finish_vcpu(vcpu, rc > 0 ? 0 : rc);
+                break;
+        }
+}
+
+static void
+idle_wait(struct sched_worker *w)
+{
+        pthread_mutex_lock(&sched.lock);
+        if (!sched.stop && !anything_runnable()) {
+                uint64_t deadline = sched.next_deadline;
+
+                sched.nidle += 1;
+                w->idle_waits += 1;
+                if (deadline != UINT64_MAX) {
+                        struct timespec ts = ns_to_timespec(deadline);
+
+                        pthread_cond_timedwait(&sched.cond, &sched.lock, &ts);
+                } else {
+                        pthread_cond_wait(&sched.cond, &sched.lock);
+                }
+                sched.nidle -= 1;
+        }
+        wake_expired_locked(monotonic_ns());
+        pthread_mutex_unlock(&sched.lock);
+}
+
+static void *
+sched_worker_thread(void *arg)
+{
+        struct sched_worker *w = arg;
+        struct sigevent sev;
+        int rc;
+
+        vm_registry_register_thread();
+
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = VCPU_KICK_SIGNAL;
+        sev._sigev_un._tid = gettid();
+        rc = timer_create(CLOCK_MONOTONIC, &sev, &w->timer);
+        if (rc < 0)
+                warn("worker %u: no slice timer, vcpus only yield on exits",
+                     w->id);
+        else
+                w->have_timer = true;
+
+        while (!__atomic_load_n(&sched.stop, __ATOMIC_ACQUIRE)) {
+                struct vcpu *vcpu;
+
+                if (monotonic_ns() >= __atomic_load_n(&sched.next_deadline,
+                                                      __ATOMIC_ACQUIRE)) {
+                        pthread_mutex_lock(&sched.lock);
+                        wake_expired_locked(monotonic_ns());
+                        pthread_mutex_unlock(&sched.lock);
+                }
+
+                vcpu = pick_vcpu(w);
+                if (!vcpu) {
+                        idle_wait(w);
+                        continue;
+                }
+
+                run_slice(w, vcpu);
+        }
+
+        if (w->have_timer)
+                timer_delete(w->timer);
+        return NULL;
+}
+
+int hidden
+sched_start(unsigned int nworkers, unsigned int slice_us)
+{
+        pthread_condattr_t attr;
+        int rc;
+
+        if (sched.running)
+                return 0;
+
+        if (nworkers == 0) {
+                long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+                nworkers = ncpus > 0 ? ncpus : 1;
+        }
+        if (slice_us == 0)
+                slice_us = SCHED_SLICE_US_DEFAULT;
+
+        sched.workers = calloc(nworkers, sizeof(*sched.workers));
+        if (!sched.workers) {
+                warn("Could not allocate %u scheduler workers", nworkers);
+                return -1;
+        }
+        sched.nworkers = nworkers;
+        sched.slice_ns = slice_us * 1000ul;
+        sched.stop = false;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sched.cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        init_vcpu_kick();
+
+        for (unsigned int i = 0; i < nworkers; i++) {
+                struct sched_worker *w = &sched.workers[i];
+
+                w->id = i;
+                pthread_mutex_init(&w->queue.lock, NULL);
+                for (int j = 0; j < SCHED_PRIOS; j++)
+                        INIT_LIST_HEAD(&w->queue.runnable[j]);
+        }
+
+        for (unsigned int i = 0; i < nworkers; i++) {
+                rc = pthread_create(&sched.workers[i].thread, NULL,
+                                    sched_worker_thread, &sched.workers[i]);
+                if (rc != 0) {
+                        errno = rc;
+                        warn("Could not start scheduler worker %u", i);
+                        sched.nworkers = i;
+                        sched.running = true;
+                        sched_stop();
+                        return -1;
+                }
+        }
+        sched.running = true;
+
+        printf("scheduler: %u workers, %luus slices\n", nworkers,
+               sched.slice_ns / 1000);
+        return 0;
+}
+
+void hidden
+sched_stop(void)
+{
+        if (!sched.running)
+                return;
+
+        pthread_mutex_lock(&sched.lock);
+        __atomic_store_n(&sched.stop, true, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&sched.cond);
+        pthread_mutex_unlock(&sched.lock);
+
+        for (unsigned int i = 0; i < sched.nworkers; i++) {
+                pthread_join(sched.workers[i].thread, NULL);
+                pthread_mutex_destroy(&sched.workers[i].queue.lock);
+        }
+
+        pthread_cond_destroy(&sched.cond);
+        free(sched.workers);
+        sched.workers = NULL;
+        sched.nworkers = 0;
+        sched.running = false;
+}
+
+bool hidden
+sched_running(void)
+{
+        return sched.running;
+}
+
+/*
+ * Hand all of a vm's vcpus to the workers, and wait until its boot vcpu
+ * stops and the rest have followed it.
+ */
+int hidden
+sched_run_vm(struct context *ctx)
+{
+        struct vm_sched *vs = &ctx->sched;
+        int rc;
+
+        pthread_mutex_lock(&vs->lock);
+        vs->live_vcpus = ctx->nvcpus;
+        vs->rc = 0;
+        pthread_mutex_unlock(&vs->lock);
+
+        for (unsigned int i = 0; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                vcpu->sched_worker =
+                        __atomic_fetch_add(&sched.next_worker, 1,
+                                           __ATOMIC_RELAXED) % sched.nworkers;
+                push_vcpu(vcpu);
+        }
+
+        pthread_mutex_lock(&sched.lock);
+        pthread_cond_broadcast(&sched.cond);
+        pthread_mutex_unlock(&sched.lock);
+
+        pthread_mutex_lock(&vs->lock);
+        while (vs->live_vcpus)
+                pthread_cond_wait(&vs->done, &vs->lock);
+        rc = vs->rc;
+        pthread_mutex_unlock(&vs->lock);
+
+        return rc;
+}
+
+void hidden
+init_vm_sched(struct context *ctx)
+{
+        struct vm_sched *vs = &ctx->sched;
+
+        memset(vs, 0, sizeof(*vs));
+        vs->prio = ctx->options.sched_prio;
+        pthread_mutex_init(&vs->lock, NULL);
+        pthread_cond_init(&vs->done, NULL);
+}
+
+void hidden
+free_vm_sched(struct context *ctx)
+{
+        pthread_mutex_destroy(&ctx->sched.lock);
+        pthread_cond_destroy(&ctx->sched.done);
+}
+
+void hidden
+get_sched_stats(struct sched_stats *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+        stats->workers = sched.nworkers;
+        stats->timer_wakeups = sched.timer_wakeups;
+
+        for (unsigned int i = 0; i < sched.nworkers; i++) {
+                struct sched_worker *w = &sched.workers[i];
+
+                stats->slices += w->slices;
+                stats->preemptions += w->preemptions;
+                stats->steals += w->steals;
+                stats->idle_waits += w->idle_waits;
+        }
+}
+
+void hidden
+print_sched_stats(void)
+{
+        struct sched_stats stats;
+
+        if (!sched.running)
+                return;
+
+        get_sched_stats(&stats);
+        printf("scheduler: %u workers, %lu slices %lu preempted %lu stolen %lu idle waits %lu timer wakeups\n",
+               stats.workers, stats.slices, stats.preemptions, stats.steals,
+               stats.idle_waits, stats.timer_wakeups);
+}
+
+void hidden
+print_vm_sched_stats(struct context *ctx)
+{
+        struct vm_sched *vs = &ctx->sched;
+
+        printf("cpu: %lu.%06lus", vs->cpu_ns / 1000000000ul,
+               (vs->cpu_ns / 1000) % 1000000ul);
+        if (vs->slices)
+                printf(" in %lu slices, %lu preempted", vs->slices,
+                       vs->preemptions);
+        if (vs->parks)
+                printf(", %lu parks %lu wakeups", vs->parks, vs->wakeups);
+        printf("\n");
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,77 @@
+/*
+ * scheduler.h - running many vcpus on a few worker threads
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct context;
+struct vcpu;
+
+/*
+ * Runnable vcpus of a higher class (see enum sched_prio) always go first,
+ * except that every SCHED_STARVE_PICKS'th pick looks from the bottom up,
+ * so nothing waits forever behind a busy high priority vm.
+ */
+#define SCHED_STARVE_PICKS      16
+#define SCHED_SLICE_US_DEFAULT  10000
+
+enum vcpu_sched_state {
+        VCPU_UNSCHEDULED,
+        VCPU_RUNNABLE,
+        VCPU_RUNNING,
+        VCPU_PARKED,
+        VCPU_DONE,
+};
+
+/*
+ * The scheduler's view of a vm: its class, how many of its vcpus haven't
+ * finished, and the cpu it's used.  cpu_ns is kept whether the scheduler
+ * is running it or not.
+ */
+struct vm_sched {
+        int prio;
+        unsigned int live_vcpus;
+        int rc;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+
+        uint64_t cpu_ns;
+        unsigned long slices;
+        unsigned long preemptions;
+        unsigned long parks;
+        unsigned long wakeups;
+};
+
+struct sched_stats {
+        unsigned int workers;
+        unsigned long slices;
+        unsigned long preemptions;
+        unsigned long steals;
+        unsigned long idle_waits;
+        unsigned long timer_wakeups;
+};
+
+extern int sched_start(unsigned int nworkers, unsigned int slice_us) hidden;
+extern void sched_stop(void) hidden;
+extern bool sched_running(void) hidden;
+extern int sched_run_vm(struct context *ctx) hidden;
+
+extern void init_vm_sched(struct context *ctx) hidden;
+extern void free_vm_sched(struct context *ctx) hidden;
+
+extern int park_vcpu(struct vcpu *vcpu, uint64_t deadline_ns) hidden;
+extern void wake_vcpu(struct vcpu *vcpu) hidden;
+extern void wait_for_wake(struct vcpu *vcpu) hidden;
+
+extern void get_sched_stats(struct sched_stats *stats) hidden;
+extern void print_sched_stats(void) hidden;
+extern void print_vm_sched_stats(struct context *ctx) hidden;
+
+#endif /* !SCHEDULER_H_ */
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,212 @@
+/*
+ * share.c - read-only segments shared between vms
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "gaol.h"
+
+/*
+ * Every vm in this process that maps the same bytes of the same file
+ * read-only gets its memslot backed by one host mapping of those bytes,
+ * so we only pay for one set of host ptes and page cache references no
+ * matter how many guests are running the same binary.
+ */
+static LIST_HEAD(segments);
+static pthread_mutex_t segments_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mapped_bytes = 0;
+
+bool hidden
+can_share_map(struct proc_map *map)
+{
+        if (map->mode & M_W_OK)
+                return false;
+        if (map->ino == 0 || !map->name || map->name[0] != '/')
+                return false;
+        return true;
+}
+
+static struct shared_segment *
+find_segment(struct proc_map *map)
+{
+        struct list_head *pos;
+        size_t size = map->end - map->start;
+
+        list_for_each(pos, &segments) {
+                struct shared_segment *seg =
+                        list_entry(pos, struct shared_segment, list);
+
+                if (seg->ino == map->ino &&
+                    seg->major == map->major &&
+                    seg->minor == map->minor &&
+                    seg->pgoff == map->pgoff &&
+                    seg->size == size &&
+                    seg->mode == map->mode)
+                        return seg;
+        }
+
+        return NULL;
+}
+
+static struct shared_segment *
+new_segment(struct proc_map *map)
+{
+        struct shared_segment *seg;
+        size_t size = map->end - map->start;
+        struct stat sb;
+        int prot = PROT_READ;
+        void *addr;
+        int fd;
+        int rc;
+
+        fd = open(map->name, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) {
+                warn("Could not open \"%s\"", map->name);
+                return NULL;
+        }
+
+        /*
+         * Make sure the path still names the file the host has mapped,
+         * otherwise we'd hand the guest something else entirely.
+         */
+        rc = fstat(fd, &sb);
+        if (rc < 0) {
+                warn("Could not stat \"%s\"", map->name);
+                close(fd);
+                return NULL;
+        }
+        if (sb.st_ino != map->ino ||
+            (long long)major(sb.st_dev) != map->major ||
+            (long long)minor(sb.st_dev) != map->minor) {
+                close(fd);
+                errno = ESTALE;
+                return NULL;
+        }
+
+        if (map->mode & M_X_OK)
+                prot |= PROT_EXEC;
+
+        addr = mmap(NULL, size, prot, MAP_SHARED, fd, map->pgoff);
+        close(fd);
+        if (addr == MAP_FAILED) {
+                warn("Could not map %zd bytes of \"%s\" at 0x%llx",
+                     size, map->name, map->pgoff);
+                return NULL;
+        }
+
+        seg = calloc(1, sizeof(*seg));
+        if (!seg) {
+                munmap(addr, size);
+                return NULL;
+        }
+
+        seg->major = map->major;
+        seg->minor = map->minor;
+        seg->ino = map->ino;
+        seg->pgoff = map->pgoff;
+        seg->size = size;
+        seg->mode = map->mode;
+        seg->addr = addr;
+        INIT_LIST_HEAD(&seg->list);
+
+        return seg;
+}
+
+static void
+free_segment(struct shared_segment *seg)
+{
+        munmap(seg->addr, seg->size);
+        free(seg);
+}
+
+/*
+ * Find or create the shared backing for map.  Segments that match by
+ * device, inode, and offset can still differ from the file if the
+ * loader wrote to them before they went read-only (relro), so the
+ * guest's own copy is compared against the shared pages, and if they
+ * differ we return NULL and let the caller keep it private.
+ */
+hidden struct shared_segment *
+get_shared_segment(struct proc_map *map)
+{
+        struct shared_segment *seg, *new = NULL;
+        size_t size = map->end - map->start;
+
+        pthread_mutex_lock(&segments_lock);
+        seg = find_segment(map);
+        if (!seg) {
+                pthread_mutex_unlock(&segments_lock);
+                new = new_segment(map);
+                if (!new)
+                        return NULL;
+                pthread_mutex_lock(&segments_lock);
+                seg = find_segment(map);
+                if (!seg) {
+                        seg = new;
+                        new = NULL;
+                        list_add(&seg->list, &segments);
+                }
+        }
+
+        if (memcmp(seg->addr, (void *)map->start, size)) {
+                if (seg->refcount == 0) {
+                        list_del(&seg->list);
+                        free_segment(seg);
+                }
+                seg = NULL;
+        } else {
+                seg->refcount += 1;
+                mapped_bytes += size;
+        }
+        pthread_mutex_unlock(&segments_lock);
+
+        if (new)
+                free_segment(new);
+
+        return seg;
+}
+
+void hidden
+put_shared_segment(struct shared_segment *seg)
+{
+        if (!seg)
+                return;
+
+        pthread_mutex_lock(&segments_lock);
+        mapped_bytes -= seg->size;
+        seg->refcount -= 1;
+        if (seg->refcount == 0) {
+                list_del(&seg->list);
+                free_segment(seg);
+        }
+        pthread_mutex_unlock(&segments_lock);
+}
+
+void hidden
+get_share_stats(struct share_stats *stats)
+{
+        struct list_head *pos;
+
+        memset(stats, 0, sizeof(*stats));
+
+        pthread_mutex_lock(&segments_lock);
+        list_for_each(pos, &segments) {
+                struct shared_segment *seg =
+                        list_entry(pos, struct shared_segment, list);
+
+                stats->segment_bytes += seg->size;
+                stats->nsegments += 1;
+        }
+        stats->mapped_bytes = mapped_bytes;
+        pthread_mutex_unlock(&segments_lock);
+}
+
+// vim:fenc=utf-8:tw=75:et
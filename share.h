@@ -0,0 +1,40 @@
+/*
+ * share.h - read-only segments shared between vms
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef SHARE_H_
+#define SHARE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct shared_segment {
+        /* key: which bytes of which file this is */
+        long long major, minor;
+        unsigned long long ino;
+        long long pgoff;
+        size_t size;
+        int mode;
+
+        void *addr;
+        int refcount;
+
+        list_t list;
+};
+
+struct share_stats {
+        /* bytes of host memory backing all live shared segments */
+        size_t segment_bytes;
+        /* bytes of guest memslots backed by those segments */
+        size_t mapped_bytes;
+        int nsegments;
+};
+
+extern bool can_share_map(struct proc_map *map) hidden;
+extern struct shared_segment *get_shared_segment(struct proc_map *map) hidden;
+extern void put_shared_segment(struct shared_segment *seg) hidden;
+extern void get_share_stats(struct share_stats *stats) hidden;
+
+#endif /* !SHARE_H_ */
+// vim:fenc=utf-8:tw=75:et
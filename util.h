@@ -82,6 +82,42 @@ read_file(int fd, uint8_t **buf, size_t *bufsize)
         return 0;
 }
 
+/*
+ * A cpu list like 0-3,8,10-11, as in cpuset(7) and /sys/devices/system/cpu.
+ */
+static inline int unused
+parse_cpu_list(cpu_set_t *set, const char *arg)
+{
+        CPU_ZERO(set);
+
+        while (*arg && *arg != '\n') {
+                char *end = NULL;
+                unsigned long first, last;
+
+                first = last = strtoul(arg, &end, 10);
+                if (end == arg)
+                        return -1;
+                if (*end == '-') {
+                        arg = end + 1;
+                        last = strtoul(arg, &end, 10);
+                        if (end == arg)
+                                return -1;
+                }
+                if (last < first || last >= CPU_SETSIZE)
+                        return -1;
+                for (unsigned long cpu = first; cpu <= last; cpu++)
+                        CPU_SET(cpu, set);
+
+                if (*end == ',')
+                        end++;
+                else if (*end && *end != '\n')
+                        return -1;
+                arg = end;
+        }
+
+        return 0;
+}
+
 static inline int unused
 sev_ioctl(struct context *ctx, int cmd, void *data, int *error)
 {
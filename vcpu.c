@@ -0,0 +1,754 @@
+/*
+ * vcpu.c - virtual cpus and the threads that run them
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gaol.h"
+
+/*
+ * Whatever vcpu this thread has in KVM_RUN.  A kick that lands just before
+ * the ioctl would otherwise be lost, so the handler sets immediate_exit
+ * and KVM_RUN comes straight back out instead.
+ */
+__thread struct vcpu *running_vcpu hidden = NULL;
+
+static void
+vcpu_kick_handler(int sig unused)
+{
+        struct vcpu *vcpu = running_vcpu;
+
+        if (vcpu)
+                vcpu->run->immediate_exit = 1;
+}
+
+static pthread_once_t kick_once = PTHREAD_ONCE_INIT;
+
+static void
+install_kick_handler(void)
+{
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = vcpu_kick_handler;
+        sigemptyset(&sa.sa_mask);
+        /* no SA_RESTART: KVM_RUN has to come back to us */
+        sa.sa_flags = 0;
+        sigaction(VCPU_KICK_SIGNAL, &sa, NULL);
+}
+
+void hidden
+init_vcpu_kick(void)
+{
+        pthread_once(&kick_once, install_kick_handler);
+}
+
+/*
+ * Get vcpu out of KVM_RUN, or keep it from getting back in, from any
+ * thread.
+ */
+void hidden
+kick_vcpu(struct vcpu *vcpu)
+{
+        init_vcpu_kick();
+        vcpu->run->immediate_exit = 1;
+        if (__atomic_load_n(&vcpu->in_run, __ATOMIC_ACQUIRE))
+                pthread_kill(vcpu->run_thread, VCPU_KICK_SIGNAL);
+}
+
+/*
+ * Whether the in-kernel lapic has vcpu sitting in HLT.  Only meaningful
+ * when it's out of KVM_RUN.
+ */
+bool hidden
+vcpu_halted(struct vcpu *vcpu)
+{
+        struct kvm_mp_state mp_state;
+
+        if (!vcpu->ctx->irqchip.enabled)
+                return false;
+        if (cpu_ioctl(vcpu, KVM_GET_MP_STATE, &mp_state) < 0)
+                return false;
+        return mp_state.mp_state == KVM_MP_STATE_HALTED;
+}
+
+int hidden
+create_vcpus(struct context *ctx, unsigned int n)
+{
+        pthread_condattr_t attr;
+        uint64_t sync = 0;
+        bool binary_stats;
+        int max;
+
+        max = kvm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+        if (max <= 0)
+                max = kvm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+        if (max > 0 && n > (unsigned int)max) {
+                warnx("%u vcpus requested but KVM allows %d", n, max);
+                return -1;
+        }
+
+        ctx->vcpu_mmap_size = kvm_ioctl(ctx, KVM_GET_VCPU_MMAP_SIZE, 0);
+        if (ctx->vcpu_mmap_size < 0) {
+                warn("Could not get vcpu mmap size");
+                return -1;
+        }
+
+        /*
+         * We only ever look at the general and special registers; events
+         * would cost a copy on every exit for nothing.
+         */
+        max = kvm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+        if (max > 0)
+                sync = max & (KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS);
+        printf("sync regs: %s%s\n",
+               sync & KVM_SYNC_X86_REGS ? "regs " : "",
+               sync & KVM_SYNC_X86_SREGS ? "sregs" : "");
+
+        binary_stats = kvm_ioctl(ctx, KVM_CHECK_EXTENSION,
+                                 KVM_CAP_BINARY_STATS_FD) > 0;
+
+        ctx->vcpus = calloc(n, sizeof(*ctx->vcpus));
+        if (!ctx->vcpus) {
+                warn("Could not allocate %u vcpus", n);
+                return -1;
+        }
+        /* park deadlines are on the monotonic clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        for (unsigned int i = 0; i < n; i++) {
+                ctx->vcpus[i].ctx = ctx;
+                ctx->vcpus[i].id = i;
+                ctx->vcpus[i].fd = -1;
+                ctx->vcpus[i].stats_fd = -1;
+                INIT_LIST_HEAD(&ctx->vcpus[i].sched_list);
+                pthread_cond_init(&ctx->vcpus[i].wake_cond, &attr);
+        }
+        pthread_condattr_destroy(&attr);
+        ctx->nvcpus = n;
+
+        for (unsigned int i = 0; i < n; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+                void *run;
+
+                vcpu->fd = vm_ioctl(ctx, KVM_CREATE_VCPU, (unsigned long)i);
+                if (vcpu->fd < 0) {
+                        warn("Could not make vcpu %u", i);
+                        return -1;
+                }
+
+                run = mmap(NULL, ctx->vcpu_mmap_size, PROT_READ|PROT_WRITE,
+                           MAP_SHARED, vcpu->fd, 0);
+                if (run == MAP_FAILED) {
+                        warn("Could not map vcpu %u runtime controls", i);
+                        return -1;
+                }
+                vcpu->run = run;
+
+                if (binary_stats)
+                        vcpu->stats_fd = cpu_ioctl(vcpu, KVM_GET_STATS_FD, 0);
+
+                vcpu->sync_regs = sync;
+                vcpu->run->kvm_valid_regs = sync;
+                vcpu->regs = sync & KVM_SYNC_X86_REGS ?
+                             &vcpu->run->s.regs.regs : &vcpu->regs_copy;
+                vcpu->sregs = sync & KVM_SYNC_X86_SREGS ?
+                              &vcpu->run->s.regs.sregs : &vcpu->sregs_copy;
+        }
+
+        /* everything that only knows about one vcpu gets the boot one */
+        ctx->vcpu = ctx->vcpus[0].fd;
+        ctx->run = ctx->vcpus[0].run;
+
+        if (n > 1)
+                init_vcpu_kick();
+
+        return 0;
+}
+
+void hidden
+destroy_vcpus(struct context *ctx)
+{
+        stop_aps(ctx);
+
+        for (unsigned int i = 0; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                if (vcpu->run) {
+                        munmap(vcpu->run, ctx->vcpu_mmap_size);
+                        vcpu->run = NULL;
+                }
+                if (vcpu->stats_fd >= 0) {
+                        close(vcpu->stats_fd);
+                        vcpu->stats_fd = -1;
+                }
+                if (vcpu->fd >= 0) {
+                        close(vcpu->fd);
+                        vcpu->fd = -1;
+                }
+                pthread_cond_destroy(&vcpu->wake_cond);
+        }
+
+        free(ctx->vcpus);
+        ctx->vcpus = NULL;
+        ctx->nvcpus = 0;
+        ctx->vcpu = -1;
+        ctx->run = NULL;
+}
+
+/*
+ * The register state from the last exit, or from KVM_GET_REGS if there
+ * hasn't been one yet (or the kernel can't sync them).  Changes only take
+ * after dirty_vcpu_regs(), on the next KVM_RUN.
+ */
+hidden struct kvm_regs *
+get_vcpu_regs(struct vcpu *vcpu)
+{
+        int rc;
+
+        if (!(vcpu->valid_regs & KVM_SYNC_X86_REGS)) {
+                rc = cpu_ioctl(vcpu, KVM_GET_REGS, vcpu->regs);
+                if (rc < 0) {
+                        warn("Could not get vcpu %u regs", vcpu->id);
+                        return NULL;
+                }
+                vcpu->valid_regs |= KVM_SYNC_X86_REGS;
+        }
+
+        return vcpu->regs;
+}
+
+hidden struct kvm_sregs *
+get_vcpu_sregs(struct vcpu *vcpu)
+{
+        int rc;
+
+        if (!(vcpu->valid_regs & KVM_SYNC_X86_SREGS)) {
+                rc = cpu_ioctl(vcpu, KVM_GET_SREGS, vcpu->sregs);
+                if (rc < 0) {
+                        warn("Could not get vcpu %u SREGS", vcpu->id);
+                        return NULL;
+                }
+                vcpu->valid_regs |= KVM_SYNC_X86_SREGS;
+        }
+
+        return vcpu->sregs;
+}
+
+/*
+ * Hand anything dirty back to the kernel before KVM_RUN: through
+ * kvm_dirty_regs if it syncs that class, which KVM_RUN applies for free,
+ * and with its own ioctl if not.
+ */
+int hidden
+flush_vcpu_regs(struct vcpu *vcpu)
+{
+        uint64_t dirty = vcpu->dirty_regs;
+        int rc;
+
+        if (!dirty)
+                return 0;
+
+        vcpu->run->kvm_dirty_regs |= dirty & vcpu->sync_regs;
+        dirty &= ~vcpu->sync_regs;
+
+        if (dirty & KVM_SYNC_X86_SREGS) {
+                rc = cpu_ioctl(vcpu, KVM_SET_SREGS, vcpu->sregs);
+                if (rc < 0) {
+                        warn("Could not set vcpu %u SREGS", vcpu->id);
+                        return -1;
+                }
+        }
+
+        if (dirty & KVM_SYNC_X86_REGS) {
+                rc = cpu_ioctl(vcpu, KVM_SET_REGS, vcpu->regs);
+                if (rc < 0) {
+                        warn("Could not set vcpu %u regs", vcpu->id);
+                        return -1;
+                }
+        }
+
+        vcpu->dirty_regs = 0;
+        return 0;
+}
+
+/*
+ * Everything finalize_paging() and init_segments() set up on the boot
+ * vcpu, the others need too.
+ */
+static int
+copy_boot_state(struct context *ctx, struct vcpu *vcpu)
+{
+        struct kvm_sregs *sregs;
+        struct {
+                struct kvm_msrs msrs;
+                struct kvm_msr_entry entries[1];
+        } msrs;
+        int rc;
+
+        sregs = get_vcpu_sregs(&ctx->vcpus[0]);
+        if (!sregs)
+                return -1;
+
+        memcpy(vcpu->sregs, sregs, sizeof(*sregs));
+        vcpu->valid_regs |= KVM_SYNC_X86_SREGS;
+        dirty_vcpu_sregs(vcpu);
+
+        memset(&msrs, 0, sizeof(msrs));
+        msrs.msrs.nmsrs = 1;
+        msrs.entries[0].index = MSR_IA32_CR_PAT;
+        rc = vcpu_ioctl(ctx, KVM_GET_MSRS, &msrs);
+        if (rc != 1) {
+                warn("Could not get boot vcpu MSRs");
+                return -1;
+        }
+
+        rc = cpu_ioctl(vcpu, KVM_SET_MSRS, &msrs);
+        if (rc != 1) {
+                warn("Could not set vcpu %u MSRs", vcpu->id);
+                return -1;
+        }
+
+        return 0;
+}
+
+static void *
+ap_thread(void *arg)
+{
+        struct vcpu *vcpu = arg;
+        int rc;
+
+        vm_registry_register_thread();
+        rc = run_vcpu(vcpu);
+        if (rc < 0)
+                warnx("vcpu %u failed", vcpu->id);
+
+        return NULL;
+}
+
+/*
+ * Point each secondary vcpu at entry(cpu, ncpus) on its own stack.  offset
+ * is whatever the boot vcpu's rip and rsp got added.
+ */
+int hidden
+prepare_aps(struct context *ctx, uintptr_t entry, uint64_t offset)
+{
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+                struct kvm_regs *regs = vcpu->regs;
+                int rc;
+
+                rc = copy_boot_state(ctx, vcpu);
+                if (rc < 0)
+                        return -1;
+
+                /* nothing in a fresh vcpu's regs is worth fetching */
+                memset(regs, 0, sizeof(*regs));
+                regs->rip = entry + offset;
+                /*
+                 * ap_main() is entered with a jmp, not a call, so leave
+                 * room for the return address the ABI expects to find
+                 * there: rsp must be 8 mod 16 at function entry.
+                 */
+                regs->rsp = vcpu->stack_map->kumr.guest_phys_addr +
+                            vcpu->stack_map->kumr.memory_size + offset - 8;
+                regs->rdi = i;
+                regs->rsi = ctx->nvcpus;
+                regs->rflags = 0x2;
+                vcpu->valid_regs |= KVM_SYNC_X86_REGS;
+                dirty_vcpu_regs(vcpu);
+                printf("vcpu %u: setting rip=0x%016llx rsp=0x%016llx\n",
+                       i, regs->rip, regs->rsp);
+        }
+
+        return 0;
+}
+
+/*
+ * Give each secondary vcpu a host thread of its own.
+ */
+int hidden
+start_aps(struct context *ctx)
+{
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+                int rc;
+
+                rc = pthread_create(&vcpu->thread, NULL, ap_thread, vcpu);
+                if (rc != 0) {
+                        errno = rc;
+                        warn("Could not start vcpu %u thread", i);
+                        goto err;
+                }
+                vcpu->thread_running = true;
+        }
+
+        return 0;
+err:
+        stop_aps(ctx);
+        return -1;
+}
+
+/*
+ * Wait for every secondary vcpu to stop on its own.
+ */
+void hidden
+wait_for_aps(struct context *ctx)
+{
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                if (!vcpu->thread_running)
+                        continue;
+
+                pthread_join(vcpu->thread, NULL);
+                vcpu->thread_running = false;
+        }
+}
+
+void hidden
+stop_aps(struct context *ctx)
+{
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                if (!vcpu->thread_running)
+                        continue;
+
+                __atomic_store_n(&vcpu->stop, true, __ATOMIC_RELEASE);
+                vcpu->run->immediate_exit = 1;
+                pthread_kill(vcpu->thread, VCPU_KICK_SIGNAL);
+                wake_vcpu(vcpu);
+        }
+
+        for (unsigned int i = 1; i < ctx->nvcpus; i++) {
+                struct vcpu *vcpu = &ctx->vcpus[i];
+
+                if (!vcpu->thread_running)
+                        continue;
+
+                pthread_join(vcpu->thread, NULL);
+                vcpu->thread_running = false;
+                vcpu->run->immediate_exit = 0;
+        }
+}
+
+/*
+ * Cap how long a halted vcpu in this vm busy-waits for a wakeup before
+ * KVM really puts it to sleep.
+ */
+int hidden
+configure_halt_poll(struct context *ctx)
+{
+        struct kvm_enable_cap cap;
+        int rc;
+
+        if (ctx->options.halt_poll_ns < 0)
+                return 0;
+
+        rc = vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL);
+        if (rc <= 0) {
+                warnx("KVM doesn't support per-vm halt polling");
+                return 0;
+        }
+
+        memset(&cap, 0, sizeof(cap));
+        cap.cap = KVM_CAP_HALT_POLL;
+        cap.args[0] = ctx->options.halt_poll_ns;
+        rc = vm_ioctl(ctx, KVM_ENABLE_CAP, &cap);
+        if (rc < 0) {
+                warn("Could not set halt polling to %ldns",
+                     ctx->options.halt_poll_ns);
+                return -1;
+        }
+
+        printf("halt polling: %ldns\n", ctx->options.halt_poll_ns);
+        return 0;
+}
+
+/*
+ * For a guest that has its cores to itself: let it PAUSE, HLT and MWAIT
+ * without trapping, so spinning and idling cost no exits.  That only
+ * makes sense if nothing else is going to want those cores, so every
+ * vcpu has to be pinned (see set_vcpu_thread_policy()) to a cpu of its
+ * own that the kernel has isolated, which scheduler workers never are.
+ * This has to happen before the vcpus are created.
+ */
+int hidden
+enable_dedicated_cores(struct context *ctx)
+{
+        struct vm_options *opts = &ctx->options;
+        const uint64_t want = KVM_X86_DISABLE_EXITS_MWAIT |
+                              KVM_X86_DISABLE_EXITS_HLT |
+                              KVM_X86_DISABLE_EXITS_PAUSE |
+                              KVM_X86_DISABLE_EXITS_CSTATE;
+        struct kvm_enable_cap cap;
+        cpu_set_t isolated, pinned;
+        uint8_t *buf = NULL;
+        size_t bufsize = 0;
+        int fd, rc;
+
+        if (!opts->dedicated_cores)
+                return 0;
+
+        if (sched_running()) {
+                warnx("--dedicated-cores needs vcpu threads, not scheduler workers");
+                return -1;
+        }
+
+        if ((unsigned int)CPU_COUNT(&opts->vcpu_cpus) < opts->nvcpus) {
+                warnx("--dedicated-cores needs --pin-vcpus with a cpu for each of %u vcpus",
+                      opts->nvcpus);
+                return -1;
+        }
+
+        fd = open("/sys/devices/system/cpu/isolated", O_RDONLY);
+        if (fd < 0) {
+                warn("Could not open /sys/devices/system/cpu/isolated");
+                return -1;
+        }
+        rc = read_file(fd, &buf, &bufsize);
+        close(fd);
+        if (rc < 0) {
+                warn("Could not read /sys/devices/system/cpu/isolated");
+                return -1;
+        }
+        rc = parse_cpu_list(&isolated, (char *)buf);
+        free(buf);
+        if (rc < 0) {
+                warnx("Could not parse /sys/devices/system/cpu/isolated");
+                return -1;
+        }
+
+        CPU_AND(&pinned, &opts->vcpu_cpus, &isolated);
+        if (!CPU_EQUAL(&pinned, &opts->vcpu_cpus)) {
+                warnx("--dedicated-cores needs every --pin-vcpus cpu to be isolated");
+                return -1;
+        }
+
+        rc = vm_ioctl(ctx, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+        if (rc <= 0 || !(rc & KVM_X86_DISABLE_EXITS_PAUSE) ||
+            !(rc & KVM_X86_DISABLE_EXITS_HLT)) {
+                warnx("KVM can't disable PAUSE and HLT exits");
+                return -1;
+        }
+
+        memset(&cap, 0, sizeof(cap));
+        cap.cap = KVM_CAP_X86_DISABLE_EXITS;
+        cap.args[0] = want & rc;
+        rc = vm_ioctl(ctx, KVM_ENABLE_CAP, &cap);
+        if (rc < 0) {
+                warn("Could not disable exits");
+                return -1;
+        }
+
+        printf("dedicated cores: no exits for pause hlt%s%s\n",
+               cap.args[0] & KVM_X86_DISABLE_EXITS_MWAIT ? " mwait" : "",
+               cap.args[0] & KVM_X86_DISABLE_EXITS_CSTATE ? " cstate" : "");
+        return 0;
+}
+
+static void
+format_cpu_set(char *buf, size_t size, cpu_set_t *set)
+{
+        size_t pos = 0;
+        int first = -1;
+
+        buf[0] = '\0';
+        for (int cpu = 0; cpu <= CPU_SETSIZE; cpu++) {
+                bool in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, set);
+
+                if (in && first < 0)
+                        first = cpu;
+                if (in || first < 0)
+                        continue;
+
+                if (pos < size)
+                        pos += snprintf(buf + pos, size - pos, "%s%d",
+                                        pos ? "," : "", first);
+                if (cpu - 1 > first && pos < size)
+                        pos += snprintf(buf + pos, size - pos, "-%d",
+                                        cpu - 1);
+                first = -1;
+        }
+}
+
+/*
+ * Pin the calling thread, which is about to run vcpu, to its share of the
+ * vm's cpus, and give it a realtime policy if asked.  What we actually
+ * got is kept for reporting; failing to get it isn't fatal.
+ */
+int hidden
+set_vcpu_thread_policy(struct vcpu *vcpu)
+{
+        struct vm_options *opts = &vcpu->ctx->options;
+        pthread_t self = pthread_self();
+        int ncpus = CPU_COUNT(&opts->vcpu_cpus);
+        struct sched_param sp;
+        char cpus[256];
+        int rc;
+
+        if (ncpus) {
+                int n = vcpu->id % ncpus;
+                cpu_set_t set;
+
+                CPU_ZERO(&set);
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                        if (!CPU_ISSET(cpu, &opts->vcpu_cpus) || n--)
+                                continue;
+                        CPU_SET(cpu, &set);
+                        break;
+                }
+
+                rc = pthread_setaffinity_np(self, sizeof(set), &set);
+                if (rc != 0) {
+                        errno = rc;
+                        warn("Could not pin vcpu %u", vcpu->id);
+                }
+        }
+
+        if (opts->vcpu_rt_prio) {
+                memset(&sp, 0, sizeof(sp));
+                sp.sched_priority = opts->vcpu_rt_prio;
+                rc = pthread_setschedparam(self, SCHED_FIFO, &sp);
+                if (rc != 0) {
+                        errno = rc;
+                        warn("Could not make vcpu %u SCHED_FIFO", vcpu->id);
+                }
+        }
+
+        CPU_ZERO(&vcpu->affinity);
+        pthread_getaffinity_np(self, sizeof(vcpu->affinity), &vcpu->affinity);
+        pthread_getschedparam(self, &vcpu->policy, &sp);
+
+        format_cpu_set(cpus, sizeof(cpus), &vcpu->affinity);
+        printf("vcpu %u: cpus %s, %s\n", vcpu->id, cpus,
+               vcpu->policy == SCHED_FIFO ? "SCHED_FIFO" :
+               vcpu->policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER");
+        return 0;
+}
+
+/*
+ * Pick the counters we want out of the vcpu's binary stats: a header, a
+ * descriptor (with its name tacked on) per stat, and the data.
+ */
+static void
+read_kvm_stats(struct vcpu *vcpu, struct vcpu_kvm_stats *hs)
+{
+        static const struct {
+                const char *name;
+                size_t offset;
+        } wanted[] = {
+                { "exits",
+                  offsetof(struct vcpu_kvm_stats, exits) },
+                { "halt_attempted_poll",
+                  offsetof(struct vcpu_kvm_stats, attempted_polls) },
+                { "halt_successful_poll",
+                  offsetof(struct vcpu_kvm_stats, successful_polls) },
+                { "halt_poll_invalid",
+                  offsetof(struct vcpu_kvm_stats, invalid_polls) },
+                { "halt_wakeup",
+                  offsetof(struct vcpu_kvm_stats, wakeups) },
+                { "halt_poll_success_ns",
+                  offsetof(struct vcpu_kvm_stats, poll_success_ns) },
+                { "halt_poll_fail_ns",
+                  offsetof(struct vcpu_kvm_stats, poll_fail_ns) },
+        };
+        struct kvm_stats_header hdr;
+        struct kvm_stats_desc *desc;
+        size_t desc_size;
+        uint8_t *descs = NULL;
+        ssize_t sz;
+
+        memset(hs, 0, sizeof(*hs));
+        if (vcpu->stats_fd < 0)
+                return;
+
+        sz = pread(vcpu->stats_fd, &hdr, sizeof(hdr), 0);
+        if (sz != sizeof(hdr))
+                return;
+
+        desc_size = sizeof(*desc) + hdr.name_size;
+        descs = calloc(hdr.num_desc, desc_size);
+        if (!descs)
+                return;
+
+        sz = pread(vcpu->stats_fd, descs, hdr.num_desc * desc_size,
+                   hdr.desc_offset);
+        if (sz != (ssize_t)(hdr.num_desc * desc_size))
+                goto out;
+
+        for (unsigned int i = 0; i < hdr.num_desc; i++) {
+                desc = (struct kvm_stats_desc *)(descs + i * desc_size);
+
+                for (unsigned int j = 0; j < sizeof(wanted) / sizeof(wanted[0]); j++) {
+                        uint64_t *val;
+
+                        if (strcmp(desc->name, wanted[j].name))
+                                continue;
+
+                        val = (uint64_t *)((uint8_t *)hs + wanted[j].offset);
+                        sz = pread(vcpu->stats_fd, val, sizeof(*val),
+                                   hdr.data_offset + desc->offset);
+                        if (sz == sizeof(*val))
+                                hs->valid = true;
+                        break;
+                }
+        }
+out:
+        free(descs);
+}
+
+int hidden
+get_vcpu_stats(struct context *ctx, unsigned int id,
+               struct vcpu_stats *stats)
+{
+        if (id >= ctx->nvcpus) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memcpy(stats, &ctx->vcpus[id].stats, sizeof(*stats));
+        read_kvm_stats(&ctx->vcpus[id], &stats->kvm);
+        return 0;
+}
+
+void hidden
+print_vcpu_stats(struct context *ctx)
+{
+        for (unsigned int i = 0; i < ctx->nvcpus; i++) {
+                struct vcpu_stats stats;
+
+                get_vcpu_stats(ctx, i, &stats);
+                printf("vcpu %u: %lu runs, %lu.%06lu s in guest, exits: %lu hlt %lu io %lu mmio %lu other\n",
+                       i, stats.runs, stats.run_ns / 1000000000ul,
+                       (stats.run_ns / 1000) % 1000000ul,
+                       stats.hlt_exits, stats.io_exits, stats.mmio_exits,
+                       stats.other_exits);
+                if (stats.kvm.valid)
+                        printf("vcpu %u: %lu exits to kvm\n", i,
+                               stats.kvm.exits);
+                if (stats.kvm.valid && stats.kvm.attempted_polls)
+                        printf("vcpu %u: halt polls: %lu of %lu successful (%lu%%), %lu invalid, %lu wakeups, %lu ns polling\n",
+                               i, stats.kvm.successful_polls,
+                               stats.kvm.attempted_polls,
+                               stats.kvm.successful_polls * 100 /
+                               stats.kvm.attempted_polls,
+                               stats.kvm.invalid_polls, stats.kvm.wakeups,
+                               stats.kvm.poll_success_ns +
+                               stats.kvm.poll_fail_ns);
+        }
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,146 @@
+/*
+ * vcpu.h - virtual cpus and the threads that run them
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef VCPU_H_
+#define VCPU_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct context;
+struct proc_map;
+
+/*
+ * KVM's own counts, from the vcpu's binary stats fd, if it has one: all
+ * exits, including the ones it handles without us, and halt polling.
+ */
+struct vcpu_kvm_stats {
+        bool valid;
+        uint64_t exits;
+        uint64_t attempted_polls;
+        uint64_t successful_polls;
+        uint64_t invalid_polls;
+        uint64_t wakeups;
+        uint64_t poll_success_ns;
+        uint64_t poll_fail_ns;
+};
+
+struct vcpu_stats {
+        unsigned long runs;
+        unsigned long hlt_exits;
+        unsigned long io_exits;
+        unsigned long mmio_exits;
+        unsigned long other_exits;
+        /* time spent in KVM_RUN */
+        uint64_t run_ns;
+        struct vcpu_kvm_stats kvm;
+};
+
+/*
+ * vcpu 0 boots at main() on the calling thread, with the stack aliased
+ * from ours.  The rest start at the guest's ap_main(cpu, ncpus), each on
+ * its own stack and its own host thread.
+ */
+struct vcpu {
+        struct context *ctx;
+        unsigned int id;
+        int fd;
+        struct kvm_run *run;
+
+        struct proc_map *stack_map;
+
+        /*
+         * Register state.  regs and sregs point either into run->s.regs,
+         * when KVM_CAP_SYNC_REGS lets the kernel hand them over on every
+         * exit and take them back on the next KVM_RUN, or at our own copies
+         * below.  valid and dirty are KVM_SYNC_X86_* bits.
+         */
+        uint64_t sync_regs;
+        uint64_t valid_regs;
+        uint64_t dirty_regs;
+        struct kvm_regs *regs;
+        struct kvm_sregs *sregs;
+        struct kvm_regs regs_copy;
+        struct kvm_sregs sregs_copy;
+
+        pthread_t thread;
+        bool thread_running;
+        bool stop;
+
+        /* whichever thread has us in KVM_RUN right now, if any */
+        pthread_t run_thread;
+        bool in_run;
+
+        /*
+         * Scheduler state: which run queue or parked list we're on, the
+         * worker running us, and when a parked vcpu wants waking anyway.
+         * Without the scheduler a parked vcpu's own thread waits on
+         * wake_cond.
+         */
+        struct list_head sched_list;
+        int sched_state;
+        unsigned int sched_worker;
+        uint64_t wake_ns;
+        bool wake_pending;
+        pthread_cond_t wake_cond;
+
+        /* the cpus and policy our thread really got */
+        cpu_set_t affinity;
+        int policy;
+        int stats_fd;
+
+        struct vcpu_stats stats;
+};
+
+#define cpu_ioctl(vcpu, num, ...) ioctl((vcpu)->fd, num, __VA_ARGS__)
+
+/*
+ * Sent to a thread to knock whatever vcpu it's running out of KVM_RUN.
+ */
+#define VCPU_KICK_SIGNAL SIGUSR1
+
+extern __thread struct vcpu *running_vcpu hidden;
+
+static inline void unused
+set_running_vcpu(struct vcpu *vcpu)
+{
+        __atomic_store_n(&running_vcpu, vcpu, __ATOMIC_RELAXED);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+extern void init_vcpu_kick(void) hidden;
+extern void kick_vcpu(struct vcpu *vcpu) hidden;
+extern bool vcpu_halted(struct vcpu *vcpu) hidden;
+
+extern int create_vcpus(struct context *ctx, unsigned int n) hidden;
+extern void destroy_vcpus(struct context *ctx) hidden;
+extern struct kvm_regs *get_vcpu_regs(struct vcpu *vcpu) hidden;
+extern struct kvm_sregs *get_vcpu_sregs(struct vcpu *vcpu) hidden;
+extern int flush_vcpu_regs(struct vcpu *vcpu) hidden;
+
+/* after changing what get_vcpu_regs() or get_vcpu_sregs() returned */
+#define dirty_vcpu_regs(vcpu) ((vcpu)->dirty_regs |= KVM_SYNC_X86_REGS)
+#define dirty_vcpu_sregs(vcpu) ((vcpu)->dirty_regs |= KVM_SYNC_X86_SREGS)
+
+/* whatever the kernel didn't sync back on the last exit is stale */
+#define invalidate_vcpu_regs(vcpu) ((vcpu)->valid_regs = (vcpu)->sync_regs)
+
+extern int prepare_aps(struct context *ctx, uintptr_t entry,
+                       uint64_t offset) hidden;
+extern int start_aps(struct context *ctx) hidden;
+extern void wait_for_aps(struct context *ctx) hidden;
+extern void stop_aps(struct context *ctx) hidden;
+extern int configure_halt_poll(struct context *ctx) hidden;
+extern int enable_dedicated_cores(struct context *ctx) hidden;
+extern int set_vcpu_thread_policy(struct vcpu *vcpu) hidden;
+extern int get_vcpu_stats(struct context *ctx, unsigned int id,
+                          struct vcpu_stats *stats) hidden;
+extern void print_vcpu_stats(struct context *ctx) hidden;
+
+#endif /* !VCPU_H_ */
+// vim:fenc=utf-8:tw=75:et
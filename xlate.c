@@ -0,0 +1,253 @@
+/*
+ * xlate.c - guest virtual address translation
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ *
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gaol.h"
+
+/*
+ * Host code following a guest pointer has to go gva -> gpa through the
+ * tables finalize_paging() installed, and then gpa -> hva through the
+ * memslots.  Walking four levels and then the map list for every access
+ * adds up, so the last few translations are kept in a small direct-mapped
+ * tlb, which anything that changes the tables or memslots must flush.
+ *
+ * Every entry, and cr3, holds a guest physical frame.  The tables
+ * themselves are in memslots at vm_phys_base plus their host address,
+ * so table_hva() gets from an entry to the next table down without a
+ * trip through the memslot list.
+ */
+#define frame_to_gpa(pfn) (((uint64_t)(pfn) & PFN40_MASK) << PAGE_SHIFT)
+
+static inline bool
+is_canonical(uint64_t gva)
+{
+        return (uint64_t)signex(gva & ((1ul << 48) - 1), 48) == gva;
+}
+
+static int
+walk_guest_tables(struct context *ctx, uint64_t gva, uint64_t *gpa,
+                  bool *writable)
+{
+        pml4e_t *pml4e;
+        pdpe_t *pdpe;
+        pde_t *pde;
+        pte_t *pte;
+        bool rw;
+
+        if (!ctx->guest_pml4) {
+                errno = ENXIO;
+                return -1;
+        }
+
+        if (!is_canonical(gva))
+                goto fault;
+
+        pml4e = &ctx->guest_pml4[get_pml4e(gva)];
+        if (!pml4e->p)
+                goto fault;
+        rw = pml4e->rw;
+
+        pdpe = (pdpe_t *)table_hva(ctx, pml4e->pdp_base) + get_pdpe(gva);
+        if (!pdpe->p)
+                goto fault;
+        rw = rw && pdpe->rw;
+        if (pdpe->ps) {
+                *gpa = (frame_to_gpa(pdpe->pd_base) & ~PDP_MASK) |
+                       (gva & PDP_MASK & ~PAGE_MASK);
+                *writable = rw;
+                return 0;
+        }
+
+        pde = (pde_t *)table_hva(ctx, pdpe->pd_base) + get_pde(gva);
+        if (!pde->p)
+                goto fault;
+        rw = rw && pde->rw;
+        if (pde->ps) {
+                *gpa = (frame_to_gpa(pde->pt_base) & ~PD_MASK) |
+                       (gva & PD_MASK & ~PAGE_MASK);
+                *writable = rw;
+                return 0;
+        }
+
+        pte = (pte_t *)table_hva(ctx, pde->pt_base) + get_pte(gva);
+        if (!pte->p)
+                goto fault;
+        *gpa = frame_to_gpa(pte->page_base);
+        *writable = rw && pte->rw;
+        return 0;
+fault:
+        errno = EFAULT;
+        return -1;
+}
+
+static int
+gpa_to_hva(struct context *ctx, uint64_t gpa, uintptr_t *hva,
+           bool *writable)
+{
+        struct list_head *pos;
+
+        list_for_each(pos, &ctx->guest_maps) {
+                struct proc_map *map = list_entry(pos, struct proc_map, list);
+                struct kvm_userspace_memory_region *kumr = &map->kumr;
+
+                if (!map->user_pages || !kumr->memory_size)
+                        continue;
+                if (gpa < kumr->guest_phys_addr ||
+                    gpa >= kumr->guest_phys_addr + kumr->memory_size)
+                        continue;
+
+                *hva = kumr->userspace_addr + gpa - kumr->guest_phys_addr;
+                if (kumr->flags & KVM_MEM_READONLY)
+                        *writable = false;
+                return 0;
+        }
+
+        errno = EFAULT;
+        return -1;
+}
+
+void hidden
+guest_tlb_flush(struct context *ctx)
+{
+        ctx->tlb.generation += 1;
+        ctx->tlb.flushes += 1;
+}
+
+/*
+ * Translate gva, returning how many bytes from there on are contiguous
+ * in both guest physical and our address space (the rest of its page),
+ * or -1 with errno set to EFAULT if it isn't mapped (or isn't writable
+ * and write is set).
+ */
+ssize_t hidden
+guest_translate(struct context *ctx, uint64_t gva, bool write,
+                uint64_t *gpa, void **hva)
+{
+        uint64_t vpn = gva >> PAGE_SHIFT;
+        size_t off = gva & PAGE_MASK;
+        struct guest_tlb_entry *e;
+
+        e = &ctx->tlb.entries[vpn % GUEST_TLB_ENTRIES];
+        if (ctx->tlb.generation == 0 || e->generation != ctx->tlb.generation ||
+            e->vpn != vpn) {
+                uint64_t page_gpa;
+                uintptr_t page_hva;
+                bool writable;
+                int rc;
+
+                ctx->tlb.misses += 1;
+                rc = walk_guest_tables(ctx, gva & ~PAGE_MASK, &page_gpa,
+                                       &writable);
+                if (rc < 0)
+                        return -1;
+                rc = gpa_to_hva(ctx, page_gpa, &page_hva, &writable);
+                if (rc < 0)
+                        return -1;
+
+                e->generation = ctx->tlb.generation;
+                e->vpn = vpn;
+                e->gpa = page_gpa;
+                e->hva = page_hva;
+                e->writable = writable;
+        } else {
+                ctx->tlb.hits += 1;
+        }
+
+        if (write && !e->writable) {
+                errno = EFAULT;
+                return -1;
+        }
+
+        if (gpa)
+                *gpa = e->gpa + off;
+        if (hva)
+                *hva = (void *)(e->hva + off);
+        return PAGE_SIZE - off;
+}
+
+/*
+ * Whether all of [gva, gva+size) is mapped (and writable, if write is
+ * set), for checking a guest buffer before acting on it.
+ */
+int hidden
+guest_range_ok(struct context *ctx, uint64_t gva, size_t size, bool write)
+{
+        if (gva + size < gva) {
+                errno = EFAULT;
+                return -1;
+        }
+
+        while (size) {
+                ssize_t len = guest_translate(ctx, gva, write, NULL, NULL);
+
+                if (len < 0)
+                        return -1;
+                len = min((size_t)len, size);
+                gva += len;
+                size -= len;
+        }
+
+        return 0;
+}
+
+ssize_t hidden
+copy_from_guest(struct context *ctx, void *dst, uint64_t gva, size_t size)
+{
+        uint8_t *buf = dst;
+        size_t done = 0;
+
+        while (done < size) {
+                void *hva;
+                ssize_t len;
+
+                len = guest_translate(ctx, gva + done, false, NULL, &hva);
+                if (len < 0)
+                        return -1;
+                len = min((size_t)len, size - done);
+                memcpy(buf + done, hva, len);
+                done += len;
+        }
+
+        return done;
+}
+
+ssize_t hidden
+copy_to_guest(struct context *ctx, uint64_t gva, const void *src,
+              size_t size)
+{
+        const uint8_t *buf = src;
+        size_t done = 0;
+
+        while (done < size) {
+                void *hva;
+                ssize_t len;
+
+                len = guest_translate(ctx, gva + done, true, NULL, &hva);
+                if (len < 0)
+                        return -1;
+                len = min((size_t)len, size - done);
+                memcpy(hva, buf + done, len);
+                done += len;
+        }
+
+        return done;
+}
+
+void hidden
+print_guest_tlb_stats(struct context *ctx)
+{
+        if (!ctx->tlb.hits && !ctx->tlb.misses)
+                return;
+
+        printf("guest tlb: %lu hits %lu misses %lu flushes\n",
+               ctx->tlb.hits, ctx->tlb.misses, ctx->tlb.flushes);
+}
+
+// vim:fenc=utf-8:tw=75:et
@@ -0,0 +1,50 @@
+/*
+ * xlate.h - guest virtual address translation
+ * Copyright 2019 Peter Jones <pjones@redhat.com>
+ */
+
+#ifndef XLATE_H_
+#define XLATE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct context;
+
+#define GUEST_TLB_ENTRIES 64
+
+/*
+ * One 4KiB page's translation.  An entry is only good if its generation
+ * matches the tlb's, so flushing is just bumping that.
+ */
+struct guest_tlb_entry {
+        uint64_t generation;
+        uint64_t vpn;
+        uint64_t gpa;
+        uintptr_t hva;
+        bool writable;
+};
+
+struct guest_tlb {
+        uint64_t generation;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long flushes;
+        struct guest_tlb_entry entries[GUEST_TLB_ENTRIES];
+};
+
+extern void guest_tlb_flush(struct context *ctx) hidden;
+extern ssize_t guest_translate(struct context *ctx, uint64_t gva,
+                               bool write, uint64_t *gpa, void **hva) hidden;
+extern int guest_range_ok(struct context *ctx, uint64_t gva, size_t size,
+                          bool write) hidden;
+extern ssize_t copy_from_guest(struct context *ctx, void *dst, uint64_t gva,
+                               size_t size) hidden;
+extern ssize_t copy_to_guest(struct context *ctx, uint64_t gva,
+                             const void *src, size_t size) hidden;
+extern void print_guest_tlb_stats(struct context *ctx) hidden;
+
+#endif /* !XLATE_H_ */
+// vim:fenc=utf-8:tw=75:et